@@ -0,0 +1,580 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_bench.c
+ * @author Ben Nahill <bnahill@gmail.com>
+ * @ingroup FLogFS
+ *
+ * @brief Benchmarks of the public interface against the NAND simulator
+ *
+ * Build with the simulator configuration (inc/flogfs_conf.sim.h and
+ * inc/flogfs_conf_implement.sim.h as flogfs_conf.h and
+ * flogfs_conf_implement.h) and link against flogfs.cpp, flogfs_sim.c and
+ * flogfs_ecc.c.
+ *
+ * All latencies are simulated flash time from flog_sim_time(), so results
+ * are identical from run to run. CPU time spent in FLogFS itself is not
+ * included.
+ *
+ * The cached column counts header reads served from the read cache in RAM
+ * (see flogfs_read_cache_stats()).
+ *
+ * The run fails if any benchmark overwrites programmed bits, programs a page
+ * too many times or uses a chip before its program finished.
+ *
+ * Usage: flogfs_bench [-H] [name filter]
+ */
+
+#include "flogfs.h"
+#include "flogfs_private.h"
+#include "flogfs_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! Bytes of data that fit in one file block
+#define BENCH_BLOCK_CAPACITY \
+	((FS_SECTORS_PER_BLOCK - 2) * FS_SECTOR_SIZE - \
+	 sizeof(flog_file_init_sector_header_t) - \
+	 sizeof(flog_file_tail_sector_header_t))
+
+//! Bytes of data available in the tail sector of a block
+#define BENCH_TAIL_DATA (FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t))
+
+/*!
+ @brief A collection of latency samples
+ */
+typedef struct {
+	uint64_t * samples;
+	uint32_t n;
+	uint32_t capacity;
+} bench_hist_t;
+
+/*!
+ @brief A running measurement of one benchmark
+ */
+typedef struct {
+	char name[48];
+	bench_hist_t hist;
+	uint64_t bytes;
+	uint64_t t_start;
+	flog_sim_stats_t stats_start;
+	flog_read_cache_stats_t cache_start;
+} bench_t;
+
+static uint_fast8_t print_histograms;
+static char const * name_filter;
+//! Set when a benchmark broke the flash contract
+static uint_fast8_t failed;
+
+static uint8_t pattern[64 * 1024];
+
+
+static void bench_hist_add(bench_hist_t * hist, uint64_t sample){
+	if(hist->n == hist->capacity){
+		hist->capacity = hist->capacity ? hist->capacity * 2 : 1024;
+		hist->samples = (uint64_t *)realloc(hist->samples,
+		                                    hist->capacity * sizeof(uint64_t));
+		if(hist->samples == NULL){
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	hist->samples[hist->n++] = sample;
+}
+
+static int bench_compare(void const * a, void const * b){
+	uint64_t const x = *(uint64_t const *)a;
+	uint64_t const y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t bench_hist_percentile(bench_hist_t const * hist,
+                                      uint32_t percent){
+	uint32_t idx;
+	if(hist->n == 0){
+		return 0;
+	}
+	idx = (uint32_t)(((uint64_t)(hist->n - 1) * percent + 50) / 100);
+	return hist->samples[idx];
+}
+
+/*!
+ @brief Print a log2-bucketed histogram of sorted samples
+ */
+static void bench_hist_print(bench_hist_t const * hist){
+	uint32_t i = 0;
+	uint64_t bucket = 1;
+	while(i < hist->n){
+		uint32_t count = 0;
+		while((i < hist->n) && (hist->samples[i] < bucket * 2)){
+			count += 1;
+			i += 1;
+		}
+		if(count){
+			printf("    %10llu - %10llu us: %u\n",
+			       (unsigned long long)bucket / 1000,
+			       (unsigned long long)(bucket * 2) / 1000, count);
+		}
+		bucket *= 2;
+	}
+}
+
+static uint_fast8_t bench_begin(bench_t * bench, char const * name){
+	if(name_filter && !strstr(name, name_filter)){
+		return 0;
+	}
+	memset(bench, 0, sizeof(*bench));
+	strncpy(bench->name, name, sizeof(bench->name) - 1);
+	bench->t_start = flog_sim_time();
+	bench->stats_start = flog_sim_get_stats();
+	bench->cache_start = flogfs_read_cache_stats();
+	return 1;
+}
+
+//! Time one operation, adding it to the histogram
+#define BENCH_OP(bench, op) do { \
+	uint64_t const t0 = flog_sim_time(); \
+	op; \
+	bench_hist_add(&(bench)->hist, flog_sim_time() - t0); \
+} while(0)
+
+static void bench_end(bench_t * bench){
+	flog_sim_stats_t const stats = flog_sim_get_stats();
+	flog_read_cache_stats_t const cache = flogfs_read_cache_stats();
+	uint64_t const elapsed = flog_sim_time() - bench->t_start;
+	double throughput = 0;
+	uint32_t cached = cache.hits;
+
+	// The counters start over when mounting
+	if(cached >= bench->cache_start.hits){
+		cached -= bench->cache_start.hits;
+	}
+
+	qsort(bench->hist.samples, bench->hist.n, sizeof(uint64_t),
+	      bench_compare);
+
+	if(bench->bytes && elapsed){
+		throughput = (double)bench->bytes * 1000.0 / (double)elapsed;
+	}
+
+	printf("%-28s %8u %9.3f %9.1f %9.1f %10.1f %8u %8u %6u %8u\n",
+	       bench->name, bench->hist.n, throughput,
+	       bench_hist_percentile(&bench->hist, 50) / 1000.0,
+	       bench_hist_percentile(&bench->hist, 99) / 1000.0,
+	       bench_hist_percentile(&bench->hist, 100) / 1000.0,
+	       stats.page_opens - bench->stats_start.page_opens,
+	       stats.programs - bench->stats_start.programs,
+	       stats.erases - bench->stats_start.erases,
+	       cached);
+	if(print_histograms){
+		bench_hist_print(&bench->hist);
+	}
+
+	// Each benchmark starts on a new simulator, so these cover its setup too
+	if(stats.overwrite_violations || stats.nop_violations ||
+	   stats.busy_violations){
+		printf("  FAILED: %u overwrite, %u NOP, %u busy violations\n",
+		       stats.overwrite_violations, stats.nop_violations,
+		       stats.busy_violations);
+		failed = 1;
+	}
+
+	free(bench->hist.samples);
+}
+
+/*!
+ @brief Start from a freshly-formatted, mounted volume
+ */
+static void bench_fresh(){
+	if((flog_sim_init(NULL) != FLOG_SUCCESS) ||
+	   (flogfs_init() != FLOG_SUCCESS) ||
+	   (flogfs_format() != FLOG_SUCCESS) ||
+	   (flogfs_mount() != FLOG_SUCCESS)){
+		fprintf(stderr, "Failed to prepare volume\n");
+		exit(1);
+	}
+}
+
+/*!
+ @brief Simulate a reboot and mount again
+ */
+static flog_result_t bench_remount(){
+	if(flogfs_init() != FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+	return flogfs_mount();
+}
+
+/*!
+ @brief Write a file of some length in fixed-size records (not timed)
+ */
+static void bench_write_file(char const * name, uint32_t nbytes,
+                             uint32_t record){
+	static flog_write_file_t file;
+	if(flogfs_open_write(&file, name) != FLOG_SUCCESS){
+		fprintf(stderr, "Failed to open %s\n", name);
+		exit(1);
+	}
+	while(nbytes){
+		uint32_t const n = (nbytes < record) ? nbytes : record;
+		if(flogfs_write(&file, pattern, n) != n){
+			fprintf(stderr, "Failed to write %s\n", name);
+			exit(1);
+		}
+		nbytes -= n;
+	}
+	flogfs_close_write(&file);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+///////////////////////////////////////////////////////////////////////////////
+
+static void bench_write(uint32_t record, uint32_t total){
+	static flog_write_file_t file;
+	char name[48];
+	bench_t bench;
+
+	snprintf(name, sizeof(name), "write/%u", record);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	flogfs_open_write(&file, "bench");
+	while(bench.bytes < total){
+		uint32_t written;
+		BENCH_OP(&bench, written = flogfs_write(&file, pattern, record));
+		if(written != record){
+			fprintf(stderr, "%s: short write\n", name);
+			break;
+		}
+		bench.bytes += written;
+	}
+	flogfs_close_write(&file);
+	bench_end(&bench);
+}
+
+static void bench_producer(uint32_t record, uint32_t period_us,
+                           uint32_t total){
+	static flog_write_file_t file;
+	char name[48];
+	bench_t bench;
+
+	snprintf(name, sizeof(name), "producer/%u/%uus", record, period_us);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	// Records arrive at a fixed rate. Only the time spent in flogfs_write()
+	// is a stall.
+	flogfs_open_write(&file, "bench");
+	while(bench.bytes < total){
+		uint32_t written;
+		flog_sim_advance((uint64_t)period_us * 1000);
+		BENCH_OP(&bench, written = flogfs_write(&file, pattern, record));
+		if(written != record){
+			fprintf(stderr, "%s: short write\n", name);
+			break;
+		}
+		bench.bytes += written;
+	}
+	flogfs_close_write(&file);
+	bench_end(&bench);
+}
+
+static void bench_read(uint32_t record, uint32_t total){
+	static flog_read_file_t file;
+	static uint8_t buffer[sizeof(pattern)];
+	char name[48];
+	bench_t bench;
+
+	snprintf(name, sizeof(name), "read/%u", record);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	bench_write_file("bench", total, 4096);
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	flogfs_open_read(&file, "bench");
+	while(bench.bytes < total){
+		uint32_t read;
+		BENCH_OP(&bench, read = flogfs_read(&file, buffer, record));
+		if(read == 0){
+			fprintf(stderr, "%s: short read\n", name);
+			break;
+		}
+		bench.bytes += read;
+	}
+	flogfs_close_read(&file);
+	bench_end(&bench);
+}
+
+static void bench_seek(uint32_t file_size){
+	static flog_read_file_t file;
+	static uint8_t buffer[64];
+	char name[48];
+	bench_t bench;
+	uint32_t seed = 1;
+
+	snprintf(name, sizeof(name), "seek/%uk", file_size / 1024);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	bench_write_file("bench", file_size, 4096);
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	// Random reads of one record each
+	flogfs_open_read(&file, "bench");
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t index;
+		seed = seed * 1103515245 + 12345;
+		index = (seed >> 8) % (file_size - sizeof(buffer));
+		BENCH_OP(&bench,
+		         flogfs_seek(&file, index);
+		         flogfs_read(&file, buffer, sizeof(buffer)));
+		bench.bytes += sizeof(buffer);
+	}
+	flogfs_close_read(&file);
+	bench_end(&bench);
+}
+
+static void bench_open_write(uint32_t file_size){
+	static flog_write_file_t file;
+	char name[48];
+	bench_t bench;
+
+	snprintf(name, sizeof(name), "open_write/%uk", file_size / 1024);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	bench_write_file("bench", file_size, 4096);
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	for(uint32_t i = 0; i < 16; i++){
+		BENCH_OP(&bench, flogfs_open_write(&file, "bench"));
+		flogfs_close_write(&file);
+	}
+	bench_end(&bench);
+}
+
+static void bench_rm(uint32_t file_size){
+	char name[48];
+	bench_t bench;
+
+	snprintf(name, sizeof(name), "rm/%uk", file_size / 1024);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	for(uint32_t i = 0; i < 8; i++){
+		snprintf(name, sizeof(name), "rm%u", i);
+		bench_write_file(name, file_size, 4096);
+	}
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	for(uint32_t i = 0; i < 8; i++){
+		snprintf(name, sizeof(name), "rm%u", i);
+		BENCH_OP(&bench, flogfs_rm(name));
+	}
+	bench_end(&bench);
+}
+
+/*!
+ @brief Time mounting a volume
+ @param percent_full How much of the volume is allocated to files
+ @param clean Whether the volume is unmounted before each reboot
+ */
+static void bench_mount(uint32_t percent_full, uint_fast8_t clean){
+	char name[48];
+	bench_t bench;
+	uint32_t const file_size = 8 * BENCH_BLOCK_CAPACITY;
+	uint32_t const nfiles =
+	   (uint32_t)((uint64_t)FS_NUM_BLOCKS * percent_full / 100 / 8);
+
+	snprintf(name, sizeof(name), "%s/%u%%",
+	         clean ? "mount-clean" : "mount", percent_full);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	for(uint32_t i = 0; i < nfiles; i++){
+		snprintf(name, sizeof(name), "f%u", i);
+		bench_write_file(name, file_size, 4096);
+	}
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	for(uint32_t i = 0; i < 4; i++){
+		flog_result_t result;
+		if(clean && (flogfs_unmount() != FLOG_SUCCESS)){
+			fprintf(stderr, "%s: unmount failed\n", bench.name);
+			break;
+		}
+		BENCH_OP(&bench, result = bench_remount());
+		if(result != FLOG_SUCCESS){
+			fprintf(stderr, "%s: mount failed\n", bench.name);
+			break;
+		}
+	}
+	bench_end(&bench);
+}
+
+static void bench_ls(uint32_t nfiles){
+	static flogfs_ls_iterator_t iter;
+	char name[FLOG_MAX_FNAME_LEN];
+	bench_t bench;
+	uint_fast8_t more;
+
+	snprintf(name, sizeof(name), "ls/%u", nfiles);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	for(uint32_t i = 0; i < nfiles; i++){
+		snprintf(name, sizeof(name), "ls%u", i);
+		bench_write_file(name, 100, 100);
+	}
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	flogfs_start_ls(&iter);
+	do {
+		BENCH_OP(&bench, more = flogfs_ls_iterate(&iter, name));
+	} while(more);
+	flogfs_stop_ls(&iter);
+	bench_end(&bench);
+}
+
+static void bench_open_read(uint32_t nfiles){
+	static flog_read_file_t file;
+	char name[FLOG_MAX_FNAME_LEN];
+	bench_t bench;
+
+	snprintf(name, sizeof(name), "open_read/%u", nfiles);
+	if(!bench_begin(&bench, name)){
+		return;
+	}
+	bench_fresh();
+	for(uint32_t i = 0; i < nfiles; i++){
+		snprintf(name, sizeof(name), "o%u", i);
+		bench_write_file(name, 100, 100);
+	}
+	bench.t_start = flog_sim_time();
+	bench.stats_start = flog_sim_get_stats();
+	bench.cache_start = flogfs_read_cache_stats();
+
+	for(uint32_t i = 0; i < nfiles; i += nfiles / 16){
+		snprintf(name, sizeof(name), "o%u", i);
+		BENCH_OP(&bench, flogfs_open_read(&file, name));
+		flogfs_close_read(&file);
+	}
+	bench_end(&bench);
+}
+
+int main(int argc, char ** argv){
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-H") == 0){
+			print_histograms = 1;
+		} else {
+			name_filter = argv[i];
+		}
+	}
+
+	for(uint32_t i = 0; i < sizeof(pattern); i++){
+		pattern[i] = (uint8_t)(i * 31 + (i >> 8));
+	}
+
+	printf("%-28s %8s %9s %9s %9s %10s %8s %8s %6s %8s\n",
+	       "benchmark", "ops", "MB/s", "p50(us)", "p99(us)", "max(us)",
+	       "opens", "programs", "erases", "cached");
+
+	bench_write(16, 1 << 20);
+	bench_write(100, 1 << 20);
+	bench_write(BENCH_TAIL_DATA - 1, 1 << 20);
+	bench_write(BENCH_TAIL_DATA, 1 << 20);
+	bench_write(BENCH_TAIL_DATA + 1, 1 << 20);
+	bench_write(FS_SECTOR_SIZE - 1, 1 << 20);
+	bench_write(FS_SECTOR_SIZE, 1 << 20);
+	bench_write(FS_SECTOR_SIZE + 1, 1 << 20);
+	bench_write(4096, 1 << 20);
+
+	bench_producer(FS_SECTOR_SIZE, 100, 1 << 20);
+	bench_producer(FS_SECTOR_SIZE, 300, 1 << 20);
+
+	bench_read(16, 1 << 20);
+	bench_read(FS_SECTOR_SIZE, 1 << 20);
+	bench_read(4096, 1 << 20);
+
+	bench_seek(1024 * 1024);
+	bench_seek(8 * 1024 * 1024);
+
+	bench_open_write(64 * 1024);
+	bench_open_write(4 * 1024 * 1024);
+
+	bench_rm(64 * 1024);
+	bench_rm(4 * 1024 * 1024);
+
+	bench_open_read(64);
+	bench_open_read(512);
+
+	bench_ls(64);
+	bench_ls(512);
+
+	bench_mount(10, 0);
+	bench_mount(90, 0);
+	bench_mount(10, 1);
+	bench_mount(90, 1);
+
+	flog_sim_deinit();
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,578 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_stress.c
+ * @author Ben Nahill <bnahill@gmail.com>
+ * @ingroup FLogFS
+ *
+ * @brief Multi-threaded stress test of the public interface on the simulator
+ *
+ * Build the same way as flogfs_bench.c, with -lpthread. It only uses
+ * pthreads, so it builds as C99 or C++ too.
+ *
+ * Each pass runs a number of logger threads, each appending records to its
+ * own file, alongside a reader thread which keeps reading a large file in
+ * big chunks. Latencies and throughput are wall-clock time on the host, so
+ * they vary from run to run. Every file is checked afterwards and the exit
+ * status is nonzero if anything was lost or mixed up.
+ *
+ * The wall-clock max includes time the host scheduler spent running other
+ * threads, either the caller's or that of a thread preempted while holding a
+ * lock. With more threads than cores this is a whole timeslice, several
+ * milliseconds, and it says nothing about FLogFS. The cpu column is the most
+ * CPU time any one write took in the calling thread, which is the longest the
+ * write itself kept the flash.
+ *
+ * With FS_NUM_VOLUMES, a pass runs one logger on each volume at once.
+ *
+ * The last pass fills the volume, removes every file and loses power, a few
+ * times over. The free blocks counted by a clean mount (restored from the
+ * checkpoint) and by a mount which scans every block must both match the
+ * count after formatting.
+ *
+ * Usage: flogfs_stress [max loggers] [records per logger]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "flogfs.h"
+#include "flogfs_private.h"
+#include "flogfs_sim.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! The size of the file read by the reader thread
+#define STRESS_BULK_SIZE   (4 * 1024 * 1024)
+//! The size of each read by the reader thread
+#define STRESS_BULK_READ   (256 * 1024)
+//! The largest logger record
+#define STRESS_MAX_RECORD  (300)
+//! The largest number of logger threads
+#define STRESS_MAX_LOGGERS (32)
+
+/*!
+ @brief The state of one logger thread
+ */
+typedef struct {
+	pthread_t thread;
+	uint32_t index;
+	//! The volume to log to
+	uint8_t volume;
+	uint32_t records;
+	uint32_t bytes;
+	//! Wall-clock time of each flogfs_write() in nanoseconds
+	uint64_t * latencies;
+	//! The most CPU time of any flogfs_write() in nanoseconds
+	uint64_t max_cpu;
+	uint_fast8_t failed;
+} stress_logger_t;
+
+/*!
+ @brief The state of the reader thread
+ */
+typedef struct {
+	pthread_t thread;
+	uint64_t bytes;
+	uint_fast8_t failed;
+} stress_reader_t;
+
+//! Set once every logger has finished, to stop the reader
+static uint_fast8_t loggers_done;
+static pthread_mutex_t loggers_done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t stress_clock(clockid_t clock){
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t stress_now(){
+	return stress_clock(CLOCK_MONOTONIC);
+}
+
+static void stress_set_done(uint_fast8_t done){
+	pthread_mutex_lock(&loggers_done_lock);
+	loggers_done = done;
+	pthread_mutex_unlock(&loggers_done_lock);
+}
+
+static uint_fast8_t stress_done(){
+	uint_fast8_t done;
+	pthread_mutex_lock(&loggers_done_lock);
+	done = loggers_done;
+	pthread_mutex_unlock(&loggers_done_lock);
+	return done;
+}
+
+//! The expected contents of each file, different for every file
+static inline uint8_t stress_pattern(uint32_t file, uint32_t i){
+	return (uint8_t)(file * 37 + i * 13 + (i >> 8));
+}
+
+//! The length of a logger's nth record, from 1 to STRESS_MAX_RECORD
+static inline uint32_t stress_record_size(uint32_t logger, uint32_t n){
+	return 1 + (n * 97 + logger * 31) % STRESS_MAX_RECORD;
+}
+
+static int stress_compare(void const * a, void const * b){
+	uint64_t const x = *(uint64_t const *)a;
+	uint64_t const y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static void * stress_logger(void * arg){
+	stress_logger_t * const logger = (stress_logger_t *)arg;
+	flog_write_file_t file;
+	uint8_t record[STRESS_MAX_RECORD];
+	char name[16];
+
+#if FS_NUM_VOLUMES > 1
+	flogfs_select(logger->volume);
+#endif
+	snprintf(name, sizeof(name), "log%u", logger->index);
+	if(flogfs_open_write(&file, name) != FLOG_SUCCESS){
+		logger->failed = 1;
+		return NULL;
+	}
+	for(uint32_t n = 0; n < logger->records; n++){
+		uint32_t const size = stress_record_size(logger->index, n);
+		uint64_t t0, cpu0, cpu;
+		uint32_t written;
+		for(uint32_t i = 0; i < size; i++){
+			record[i] = stress_pattern(logger->index + 1, logger->bytes + i);
+		}
+		cpu0 = stress_clock(CLOCK_THREAD_CPUTIME_ID);
+		t0 = stress_now();
+		written = flogfs_write(&file, record, size);
+		logger->latencies[n] = stress_now() - t0;
+		cpu = stress_clock(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+		if(cpu > logger->max_cpu){
+			logger->max_cpu = cpu;
+		}
+		if(written != size){
+			logger->failed = 1;
+			break;
+		}
+		logger->bytes += size;
+	}
+	if(flogfs_close_write(&file) != FLOG_SUCCESS){
+		logger->failed = 1;
+	}
+	return NULL;
+}
+
+static void * stress_reader(void * arg){
+	stress_reader_t * const reader = (stress_reader_t *)arg;
+	static uint8_t buffer[STRESS_BULK_READ];
+	flog_read_file_t file;
+
+	while(!stress_done()){
+		uint32_t offset = 0;
+		if(flogfs_open_read(&file, "bulk") != FLOG_SUCCESS){
+			reader->failed = 1;
+			return NULL;
+		}
+		while(!stress_done() && (offset < STRESS_BULK_SIZE)){
+			uint32_t const n = flogfs_read(&file, buffer, sizeof(buffer));
+			if(n == 0){
+				reader->failed = 1;
+				break;
+			}
+			for(uint32_t i = 0; i < n; i++){
+				if(buffer[i] != stress_pattern(0, offset + i)){
+					reader->failed = 1;
+					break;
+				}
+			}
+			offset += n;
+			reader->bytes += n;
+		}
+		flogfs_close_read(&file);
+		if(reader->failed){
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*!
+ @brief Check that a file holds exactly what was written to it
+ */
+static uint_fast8_t stress_verify(char const * name, uint32_t pattern,
+                                  uint32_t size){
+	static uint8_t buffer[4096];
+	flog_read_file_t file;
+	uint32_t offset = 0;
+	uint32_t n;
+
+	if(flogfs_open_read(&file, name) != FLOG_SUCCESS){
+		return 0;
+	}
+	while((n = flogfs_read(&file, buffer, sizeof(buffer))) > 0){
+		for(uint32_t i = 0; i < n; i++){
+			if(buffer[i] != stress_pattern(pattern, offset + i)){
+				flogfs_close_read(&file);
+				return 0;
+			}
+		}
+		offset += n;
+	}
+	flogfs_close_read(&file);
+	return offset == size;
+}
+
+/*!
+ @brief Run a number of loggers alongside the reader
+ @return Nonzero if everything checked out
+ */
+static uint_fast8_t stress_run(uint32_t nloggers, uint32_t records){
+	static stress_logger_t loggers[STRESS_MAX_LOGGERS];
+	static uint8_t chunk[4096];
+	stress_reader_t reader;
+	flog_write_file_t bulk;
+	uint64_t * latencies;
+	uint64_t t_start, elapsed, bytes = 0, max_cpu = 0;
+	uint_fast8_t ok = 1;
+	char name[16];
+
+	if((flog_sim_init(NULL) != FLOG_SUCCESS) ||
+	   (flogfs_init() != FLOG_SUCCESS) ||
+	   (flogfs_format() != FLOG_SUCCESS) ||
+	   (flogfs_mount() != FLOG_SUCCESS)){
+		fprintf(stderr, "Failed to prepare volume\n");
+		exit(1);
+	}
+
+	// The file for the reader
+	flogfs_open_write(&bulk, "bulk");
+	for(uint32_t offset = 0; offset < STRESS_BULK_SIZE;
+	    offset += sizeof(chunk)){
+		for(uint32_t i = 0; i < sizeof(chunk); i++){
+			chunk[i] = stress_pattern(0, offset + i);
+		}
+		flogfs_write(&bulk, chunk, sizeof(chunk));
+	}
+	flogfs_close_write(&bulk);
+
+	latencies = (uint64_t *)malloc((size_t)nloggers * records *
+	                               sizeof(uint64_t));
+	if(latencies == NULL){
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	stress_set_done(0);
+	memset(&reader, 0, sizeof(reader));
+	pthread_create(&reader.thread, NULL, stress_reader, &reader);
+
+	t_start = stress_now();
+	for(uint32_t i = 0; i < nloggers; i++){
+		memset(&loggers[i], 0, sizeof(loggers[i]));
+		loggers[i].index = i;
+		loggers[i].records = records;
+		loggers[i].latencies = latencies + (size_t)i * records;
+		pthread_create(&loggers[i].thread, NULL, stress_logger, &loggers[i]);
+	}
+	for(uint32_t i = 0; i < nloggers; i++){
+		pthread_join(loggers[i].thread, NULL);
+		bytes += loggers[i].bytes;
+		if(loggers[i].max_cpu > max_cpu){
+			max_cpu = loggers[i].max_cpu;
+		}
+		if(loggers[i].failed){
+			fprintf(stderr, "log%u: write failed\n", i);
+			ok = 0;
+		}
+	}
+	elapsed = stress_now() - t_start;
+	stress_set_done(1);
+	pthread_join(reader.thread, NULL);
+	if(reader.failed){
+		fprintf(stderr, "bulk: read failed\n");
+		ok = 0;
+	}
+
+	// Everything has to have landed where it belongs
+	for(uint32_t i = 0; i < nloggers; i++){
+		snprintf(name, sizeof(name), "log%u", i);
+		if(!stress_verify(name, i + 1, loggers[i].bytes)){
+			fprintf(stderr, "%s: contents don't match\n", name);
+			ok = 0;
+		}
+	}
+	if(!stress_verify("bulk", 0, STRESS_BULK_SIZE)){
+		fprintf(stderr, "bulk: contents don't match\n");
+		ok = 0;
+	}
+
+	qsort(latencies, (size_t)nloggers * records, sizeof(uint64_t),
+	      stress_compare);
+	printf("%8u %10.3f %10.3f %9.1f %9.1f %10.1f %9.1f %s\n",
+	       nloggers,
+	       (double)bytes * 1000.0 / (double)elapsed,
+	       (double)reader.bytes * 1000.0 / (double)elapsed,
+	       latencies[(size_t)nloggers * records / 2] / 1000.0,
+	       latencies[(size_t)nloggers * records * 99 / 100] / 1000.0,
+	       latencies[(size_t)nloggers * records - 1] / 1000.0,
+	       max_cpu / 1000.0,
+	       ok ? "ok" : "FAILED");
+
+	free(latencies);
+	flog_sim_deinit();
+	return ok;
+}
+
+#if FS_NUM_VOLUMES > 1
+/*!
+ @brief Run one logger on every volume at once
+ @return Nonzero if everything checked out
+ */
+static uint_fast8_t stress_volumes(uint32_t records){
+	static stress_logger_t loggers[FS_NUM_VOLUMES];
+	uint64_t * latencies;
+	uint64_t t_start, elapsed, bytes = 0, max_cpu = 0;
+	uint_fast8_t ok = 1;
+	char name[16];
+
+	latencies = (uint64_t *)malloc((size_t)FS_NUM_VOLUMES * records *
+	                               sizeof(uint64_t));
+	if(latencies == NULL){
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for(uint8_t v = 0; v < FS_NUM_VOLUMES; v++){
+		flogfs_select(v);
+		flog_sim_select(v);
+		if((flog_sim_init(NULL) != FLOG_SUCCESS) ||
+		   (flogfs_init() != FLOG_SUCCESS) ||
+		   (flogfs_format() != FLOG_SUCCESS) ||
+		   (flogfs_mount() != FLOG_SUCCESS)){
+			fprintf(stderr, "Failed to prepare volume %u\n", v);
+			exit(1);
+		}
+	}
+
+	t_start = stress_now();
+	for(uint8_t v = 0; v < FS_NUM_VOLUMES; v++){
+		memset(&loggers[v], 0, sizeof(loggers[v]));
+		loggers[v].index = v;
+		loggers[v].volume = v;
+		loggers[v].records = records;
+		loggers[v].latencies = latencies + (size_t)v * records;
+		pthread_create(&loggers[v].thread, NULL, stress_logger, &loggers[v]);
+	}
+	for(uint8_t v = 0; v < FS_NUM_VOLUMES; v++){
+		pthread_join(loggers[v].thread, NULL);
+		bytes += loggers[v].bytes;
+		if(loggers[v].max_cpu > max_cpu){
+			max_cpu = loggers[v].max_cpu;
+		}
+		if(loggers[v].failed){
+			fprintf(stderr, "volume %u: write failed\n", v);
+			ok = 0;
+		}
+	}
+	elapsed = stress_now() - t_start;
+
+	for(uint8_t v = 0; v < FS_NUM_VOLUMES; v++){
+		flogfs_select(v);
+		snprintf(name, sizeof(name), "log%u", v);
+		if(!stress_verify(name, v + 1, loggers[v].bytes)){
+			fprintf(stderr, "volume %u: contents don't match\n", v);
+			ok = 0;
+		}
+		flog_sim_select(v);
+		flog_sim_deinit();
+	}
+	flogfs_select(0);
+	flog_sim_select(0);
+
+	qsort(latencies, (size_t)FS_NUM_VOLUMES * records, sizeof(uint64_t),
+	      stress_compare);
+	printf("%8u %10.3f %9.1f %9.1f %10.1f %9.1f %s\n",
+	       FS_NUM_VOLUMES,
+	       (double)bytes * 1000.0 / (double)elapsed,
+	       latencies[(size_t)FS_NUM_VOLUMES * records / 2] / 1000.0,
+	       latencies[(size_t)FS_NUM_VOLUMES * records * 99 / 100] / 1000.0,
+	       latencies[(size_t)FS_NUM_VOLUMES * records - 1] / 1000.0,
+	       max_cpu / 1000.0,
+	       ok ? "ok" : "FAILED");
+
+	free(latencies);
+	return ok;
+}
+#endif
+
+/*!
+ @brief Fill the volume, remove everything and check no blocks went missing
+ @param cycles The number of times to fill and empty it
+ @return Nonzero if everything checked out
+
+ Each cycle loses power after the files are removed, so the next mount
+ restores the free blocks from the checkpoint. After the queued erases and a
+ compaction, a clean remount has to count as many free blocks as the volume
+ had after formatting, and so does a mount which scans every block.
+ */
+static uint_fast8_t stress_free_blocks(uint32_t cycles){
+	static flog_write_file_t files[4];
+	static uint8_t chunk[3000];
+	static char names[1024][16];
+	flogfs_ls_iterator_t iter;
+	flog_block_idx_t formatted, restored, scanned;
+	uint32_t nfiles = 0, nnames, nopen;
+	uint_fast8_t ok = 1, full;
+
+	if((flog_sim_init(NULL) != FLOG_SUCCESS) ||
+	   (flogfs_init() != FLOG_SUCCESS) ||
+	   (flogfs_format() != FLOG_SUCCESS) ||
+	   (flogfs_mount() != FLOG_SUCCESS)){
+		fprintf(stderr, "Failed to prepare volume\n");
+		exit(1);
+	}
+	formatted = flogfs_free_blocks();
+
+	for(uint32_t c = 0; c < cycles; c++){
+		// Four files at a time until nothing more fits. Every other one is
+		// closed on its tail sector.
+		for(full = 0; !full;){
+			for(nopen = 0; nopen < 4; nopen++){
+				snprintf(names[0], sizeof(names[0]), "fill%u", nfiles++);
+				if(flogfs_open_write(&files[nopen], names[0]) !=
+				   FLOG_SUCCESS){
+					full = 1;
+					break;
+				}
+			}
+			for(uint32_t n = 0; !full && (n < 200); n++){
+				for(uint32_t i = 0; i < nopen; i++){
+					uint32_t size = 1 + (n * 7 + i * 1013) % sizeof(chunk);
+					if(flogfs_write(&files[i], chunk, size) != size){
+						full = 1;
+						break;
+					}
+				}
+			}
+			for(uint32_t i = 0; i < nopen; i++){
+				while(!full && (i & 1) &&
+				      (files[i].sector != FLOG_TAIL_SECTOR)){
+					full = flogfs_write(&files[i], chunk, 100) != 100;
+				}
+				flogfs_close_write(&files[i]);
+			}
+		}
+
+		nnames = 0;
+		flogfs_start_ls(&iter);
+		while((nnames < 1024) && flogfs_ls_iterate(&iter, names[nnames])){
+			nnames++;
+		}
+		flogfs_stop_ls(&iter);
+		for(uint32_t i = 0; i < nnames; i++){
+			flogfs_rm(names[i]);
+		}
+
+		// Lose power with everything logged but nothing erased yet
+		if((flog_sim_power_on() != FLOG_SUCCESS) ||
+		   (flogfs_init() != FLOG_SUCCESS) ||
+		   (flogfs_mount() != FLOG_SUCCESS)){
+			fprintf(stderr, "cycle %u: mount failed\n", c);
+			ok = 0;
+			break;
+		}
+		while(flogfs_maintain(100));
+		flogfs_compact_inodes();
+
+		if((flogfs_unmount() != FLOG_SUCCESS) ||
+		   (flogfs_mount() != FLOG_SUCCESS)){
+			fprintf(stderr, "cycle %u: remount failed\n", c);
+			ok = 0;
+			break;
+		}
+		restored = flogfs_free_blocks();
+		if((flogfs_unmount() != FLOG_SUCCESS) ||
+		   (flogfs_mount_scan() != FLOG_SUCCESS)){
+			fprintf(stderr, "cycle %u: scan failed\n", c);
+			ok = 0;
+			break;
+		}
+		scanned = flogfs_free_blocks();
+
+		if((restored != formatted) || (scanned != formatted)){
+			ok = 0;
+		}
+		printf("%8u %8u %8u %8u %8u %s\n", c, nnames, formatted, restored,
+		       scanned, ((restored == formatted) && (scanned == formatted)) ?
+		       "ok" : "FAILED");
+	}
+
+	flog_sim_deinit();
+	return ok;
+}
+
+int main(int argc, char ** argv){
+	uint32_t max_loggers = 8;
+	uint32_t records = 4000;
+	uint_fast8_t ok = 1;
+
+	if(argc > 1){
+		max_loggers = (uint32_t)atoi(argv[1]);
+	}
+	if(argc > 2){
+		records = (uint32_t)atoi(argv[2]);
+	}
+	if((max_loggers == 0) || (max_loggers > STRESS_MAX_LOGGERS) ||
+	   (records == 0)){
+		fprintf(stderr, "Usage: %s [max loggers] [records per logger]\n",
+		        argv[0]);
+		return 1;
+	}
+
+	printf("%8s %10s %10s %9s %9s %10s %9s\n",
+	       "loggers", "log MB/s", "read MB/s", "p50(us)", "p99(us)",
+	       "max(us)", "cpu(us)");
+	for(uint32_t n = 1; n <= max_loggers; n *= 2){
+		ok = stress_run(n, records) && ok;
+	}
+#if FS_NUM_VOLUMES > 1
+	printf("\n%8s %10s %9s %9s %10s %9s\n",
+	       "volumes", "log MB/s", "p50(us)", "p99(us)", "max(us)", "cpu(us)");
+	ok = stress_volumes(records) && ok;
+#endif
+	printf("\n%8s %8s %8s %8s %8s\n",
+	       "cycle", "files", "format", "mount", "scan");
+	ok = stress_free_blocks(3) && ok;
+	return ok ? 0 : 1;
+}
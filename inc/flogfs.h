@@ -64,6 +64,21 @@ either expressed or implied, of the FLogFS Project.
 
 #include "flogfs_conf.h"
 
+#ifndef FS_SEEK_INDEX_SIZE
+#define FS_SEEK_INDEX_SIZE (0)
+#endif
+
+#ifndef FS_PAGE_WRITE_BUFFER
+#define FS_PAGE_WRITE_BUFFER (0)
+#endif
+
+//! The number of sectors buffered by each write file
+#if FS_PAGE_WRITE_BUFFER
+#define FLOG_WRITE_BUFFER_SECTORS FS_SECTORS_PER_PAGE
+#else
+#define FLOG_WRITE_BUFFER_SECTORS 1
+#endif
+
 
 #if !FLOG_BUILD_CPP
 #ifdef __cplusplus
@@ -110,12 +125,40 @@ typedef struct {
 	//! The current sector -- If this is
 	//! FS_SECTORS_PER_PAGE * FS_PAGES_PER_BLOCK, at end of block
 	uint16_t sector;
+	//! The compaction generation when used to list files
+	uint16_t generation;
+#if FS_NUM_VOLUMES > 1
+	//! The volume, when used to list files
+	uint8_t volume;
+#endif
 } flog_inode_iterator_t;
 
 typedef flog_inode_iterator_t flogfs_ls_iterator_t;
 
 #define FLOG_RESULT(x) ((x)?FLOG_SUCCESS:FLOG_FAILURE)
 
+/*!
+ @brief Counts of metadata reads by where they were found
+ */
+typedef struct {
+	//! Reads served from the read cache in RAM
+	uint32_t hits;
+	//! Reads of the page already in the flash cache register
+	uint32_t register_hits;
+	//! Reads which had to load a page from the array
+	uint32_t misses;
+} flog_read_cache_stats_t;
+
+/*!
+ @brief A block of a file and where it starts, for seeking
+ */
+typedef struct {
+	//! The block index
+	flog_block_idx_t block;
+	//! Offset of the first byte in the block from the start of the file
+	uint32_t offset;
+} flog_seek_index_entry_t;
+
 /*!
  @brief The state of a currently-open file
 
@@ -125,6 +168,10 @@ typedef flog_inode_iterator_t flogfs_ls_iterator_t;
 typedef struct flog_read_file_t {
 	//! Offset of read head from the start of the file
 	uint32_t read_head;
+#if FS_NUM_VOLUMES > 1
+	//! The volume the file was opened on
+	uint8_t volume;
+#endif
 	//! Block index of read head
 	uint16_t block;
 	//! Sector index of read head
@@ -135,10 +182,56 @@ typedef struct flog_read_file_t {
 	uint16_t sector_remaining_bytes;
 	
 	uint32_t id;
+
+	//! The first block of the file
+	uint16_t first_block;
+	//! The position of the current block in the file's chain
+	uint16_t block_number;
+	//! Offset of the first byte of the current block from the start of the file
+	uint32_t block_start;
+
+#if FS_SEEK_INDEX_SIZE
+	//! Every seek_stride-th block of the file seen so far, in order
+	flog_seek_index_entry_t seek_index[FS_SEEK_INDEX_SIZE];
+	//! The number of entries in seek_index
+	uint16_t seek_index_n;
+	//! The distance in blocks between entries of seek_index
+	uint16_t seek_stride;
+#endif
+
+#if FS_READ_AHEAD
+	//! The number of pages read through in a row since the last seek
+	uint8_t sequential_pages;
+#endif
 	
 	struct flog_read_file_t * next;
 } flog_read_file_t;
 
+/*!
+ @brief A function to be handed file data in place by flogfs_read_visit()
+ @param context The context given to flogfs_read_visit()
+ @param data The data, only valid until this returns
+ @param n The number of bytes at data, never more than one page
+ @retval FLOG_SUCCESS to keep reading
+ @retval FLOG_FAILURE to stop after this data
+
+ The data counts as read either way. This is called with the flash held, so it
+ must be quick and must not call back into the file system.
+ */
+typedef flog_result_t (*flogfs_read_visitor_t)(void * context,
+                                               uint8_t const * data,
+                                               uint16_t n);
+
+/*!
+ @brief One piece of a record for flogfs_writev()
+ */
+typedef struct {
+	//! The data
+	void const * data;
+	//! The number of bytes at data
+	uint32_t nbytes;
+} flog_iovec_t;
+
 /*!
  @brief An instance of a file opened for writing.
 
@@ -149,6 +242,10 @@ typedef struct flog_read_file_t {
 typedef struct flog_write_file_t {
 	//! Offset of write head from start of file
 	uint32_t write_head;
+#if FS_NUM_VOLUMES > 1
+	//! The volume the file was opened on
+	uint8_t volume;
+#endif
 	//! Block index of write head
 	uint16_t block;
 	//! Sector index of write head
@@ -158,17 +255,65 @@ typedef struct flog_write_file_t {
 	//! The number of bytes remaining in the sector before forcing a cache flush
 	uint16_t sector_remaining_bytes;
 	//! Bytes in block (so far)
-	uint16_t bytes_in_block;
+	uint32_t bytes_in_block;
 	uint32_t block_age;
 	uint32_t id;
-	
-	int32_t base_threshold;
-
-	uint8_t sector_buffer[FS_SECTOR_SIZE];
+	//! write_head as of the last flogfs_maintain(), to tell when buffered data
+	//! has gone stale
+	uint32_t maintain_head;
+
+#if FS_WRITE_BUFFER_POOL_SIZE
+	//! The buffer borrowed from the pool while data is waiting, or NULL
+	uint8_t * sector_buffer;
+#else
+	//! The current sector, at its place in the page with FS_PAGE_WRITE_BUFFER
+	uint8_t sector_buffer[FS_SECTOR_SIZE * FLOG_WRITE_BUFFER_SECTORS];
+#endif
+#if FS_PAGE_WRITE_BUFFER
+	//! The number of bytes in each full sector of the page waiting to be
+	//! programmed
+	flog_sector_nbytes_t page_nbytes[FS_SECTORS_PER_PAGE];
+	//! The first sector waiting to be programmed
+	uint16_t page_sector;
+	//! The number of sectors from page_sector waiting to be programmed
+	uint16_t page_n;
+#endif
 	
 	struct flog_write_file_t * next;
 } flog_write_file_t;
 
+#if FS_NUM_VOLUMES > 1
+/*!
+ @brief Choose the volume used by calls from this thread
+ @param volume The volume, from 0 to FS_NUM_VOLUMES - 1
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if there is no such volume
+
+ Each thread starts out on volume 0. Every volume has its own state and locks
+ and is reached through its own flash (see flash_select()), so different
+ volumes can be used from different threads at the same time. Each one has to
+ be initialized and mounted on its own.
+
+ Calls on an open file or ls iterator always go to the volume it was opened
+ on, whichever is selected.
+
+ The selection is only per thread with thread-local storage (FLOG_THREAD_LOCAL
+ in flogfs_private.h). Without it there is one selection for all threads and
+ the current volume is switched by every call, so all calls on every volume
+ have to come from a single thread, or be serialized by the application.
+
+ Every volume shares the geometry in flogfs_conf.h (FS_NUM_BLOCKS,
+ FS_PAGES_PER_BLOCK, FS_SECTOR_SIZE, ...) and the features built in, so the
+ flashes behind them have to be the same size.
+ */
+flog_result_t flogfs_select(uint8_t volume);
+
+/*!
+ @brief Get the volume used by calls from this thread
+ */
+uint8_t flogfs_selected();
+#endif
+
 /*!
  @brief Initialize flogfs filesystem structures
  */
@@ -181,9 +326,51 @@ flog_result_t flogfs_format();
 
 /*!
  @brief Mount the FLogFS filesystem and prepare it for use
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if the volume isn't formatted, or was formatted by a
+                      version of FLogFS with another layout on flash and has
+                      to be formatted again
  */
 flog_result_t flogfs_mount();
 
+/*!
+ @brief Mount the file system from a scan of every block
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if it is already mounted
+
+ This ignores the checkpoint, in case the allocator state it holds is
+ suspect, and writes a new one from the scan. The old records are killed
+ first, so if power is lost before then the next mount scans as well.
+ */
+flog_result_t flogfs_mount_scan();
+
+/*!
+ @brief Unmount the file system
+
+ This writes a checkpoint of the allocator state so the next mount doesn't
+ have to scan every block.
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if files are still open for writing
+ */
+flog_result_t flogfs_unmount();
+
+/*!
+ @brief Rewrite the inode table without the entries of deleted files
+
+ Deleted files otherwise keep their entries forever, slowing down every
+ lookup, listing and mount. The live entries are copied to a new chain and the
+ old one is released. This is safe to interrupt; mount finishes or undoes it.
+
+ With FS_ERASE_QUEUE_SIZE, files whose blocks are still waiting to be erased
+ keep their entries until a later compaction. Nothing is erased here.
+
+ A listing started with flogfs_start_ls() before a compaction ends at its next
+ flogfs_ls_iterate(), which returns 0. Start it over to see the rest.
+ @retval FLOG_SUCCESS if successful or there was nothing to do
+ @retval FLOG_FAILURE if the file system isn't mounted or is out of space
+ */
+flog_result_t flogfs_compact_inodes();
+
 /*!
  @brief Open a file to read
  @param file The file structure to use
@@ -225,28 +412,117 @@ flog_result_t flogfs_close_write(flog_write_file_t * file);
 /*!
  @brief Remove a file from the filesystem
  @param filename The name of the file
+
+ With FS_ERASE_QUEUE_SIZE, the blocks of the file are only queued to be erased.
+ They are erased by flogfs_maintain() or when an allocation runs out of free
+ blocks.
  */
 flog_result_t flogfs_rm(char const * filename);
 
+/*!
+ @brief Do some housekeeping that would otherwise stall a later call
+ @param budget The most units of work to do. Each is about one program or
+               erase, except a new checkpoint record which is a few dozen.
+ @return An estimate of the units of work left. 0 means there is nothing to do.
+         Each deleted file waiting to be erased counts once, however many
+         blocks it has left, so the estimate can fall short.
+
+ This is meant to be called periodically from an idle thread. In order, it:
+ - Commits the buffered data of write files which haven't been written since
+   the previous call
+ - Starts a new checkpoint record if the log is nearly full, instead of
+   leaving it to the allocation that fills it
+ - Erases the blocks of deleted files (with FS_ERASE_QUEUE_SIZE)
+ */
+uint16_t flogfs_maintain(uint16_t budget);
+
+/*!
+ @brief Get the read cache counters
+ @return The number of metadata reads served at each level since mounting
+
+ Only headers (inode entries, block and sector headers) are counted, not file
+ data. The read cache is sized with FS_READ_CACHE_SIZE. Without it, every
+ read is either a register hit or a miss.
+ */
+flog_read_cache_stats_t flogfs_read_cache_stats();
+
+/*!
+ @brief Get the number of blocks the allocator can hand out
+ */
+flog_block_idx_t flogfs_free_blocks();
+
 /*!
  @brief Read data from an open file
  @param file The file structure to read from
  @param dst The destination for the data
  @param nbytes The number of bytes to try to read
  @returns The number of bytes read
+
+ The flash is only held for one page at a time, so other files can be read
+ and written from other threads in the meantime. One file must not be used
+ from two threads at once.
  */
 uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes);
 
+#if FS_ZERO_COPY_READ
+/*!
+ @brief Read data from an open file without copying it
+ @param file The file structure to read from
+ @param nbytes The number of bytes to try to read
+ @param visitor Called with each run of data where it sits in the flash cache
+ @param context Passed to the visitor
+ @returns The number of bytes read
+
+ This reads the same data as flogfs_read() but hands it to the visitor in
+ runs of up to one page instead of copying it into a buffer. It stops early if
+ the visitor returns FLOG_FAILURE.
+ */
+uint32_t flogfs_read_visit(flog_read_file_t * file, uint32_t nbytes,
+                           flogfs_read_visitor_t visitor, void * context);
+#endif
+
+/*!
+ @brief Move the read head of an open file
+ @param file The file structure to seek
+ @param index The offset from the start of the file
+ @retval FLOG_SUCCESS if successful
+ @retval FLOG_FAILURE if the file isn't that long (the read head is left at the
+                      end of the file)
+
+ This costs one read per block skipped. With FS_SEEK_INDEX_SIZE set, blocks
+ visited by earlier reads and seeks are remembered so that most of those reads
+ are skipped too.
+ */
+flog_result_t flogfs_seek(flog_read_file_t * file, uint32_t index);
+
 /*!
  @brief Write data to an open file
  @param file The file structure to write to
  @param src The data source
  @param nbytes The number of bytes to try to write
  @returns The number of bytes written
+
+ As with flogfs_read(), other files can be used from other threads in the
+ meantime, but not this one.
  */
 uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
                       uint32_t nbytes);
 
+/*!
+ @brief Write a record made of several pieces to an open file
+ @param file The file structure to write to
+ @param iov The pieces, in order
+ @param iovcnt The number of pieces
+ @returns The number of bytes written
+
+ This is the same as calling flogfs_write() for each piece, but the flash is
+ held for the whole record. Sectors which fill up are committed on the way, so
+ nothing else can be written or flushed in the middle of it. Long records hold
+ up other threads for longer than flogfs_write() would.
+ */
+uint32_t flogfs_writev(flog_write_file_t * file, flog_iovec_t const * iov,
+                       uint16_t iovcnt);
+
 /*!
  @brief Check if a file exists in the filesystem
  @param filename The 0-terminated filename to check for
@@ -264,7 +540,8 @@ void flogfs_start_ls(flogfs_ls_iterator_t * iter);
  @brief Read another filename
  @param[out] fname_dst A destination to copy the filename
  @retval 1 Successful
- @retval 0 This is the end of the data
+ @retval 0 This is the end of the data, or flogfs_compact_inodes() has run
+           since flogfs_start_ls()
  */
 uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst);
 
@@ -58,8 +58,79 @@ either expressed or implied, of the FLogFS Project.
 
 #define FS_SECTORS_PER_BLOCK (FS_SECTORS_PER_PAGE * FS_PAGES_PER_BLOCK)
 
-//! The number of blocks to preallocate
-#define FS_PREALLOCATE_SIZE  (10)
+//! The number of files to index in RAM by name (0 to always search the inodes)
+#define FS_FILE_INDEX_SIZE   (0)
+
+//! The number of blocks each read file remembers for seeking (0 for none)
+#define FS_SEEK_INDEX_SIZE   (0)
+
+//! The number of files whose end is remembered for appending (0 for none)
+#define FS_TAIL_HINT_SIZE    (4)
+
+//! Whether write files buffer a whole page so that it's programmed once
+//! (FS_SECTOR_SIZE * (FS_SECTORS_PER_PAGE - 1) more bytes per write file)
+#define FS_PAGE_WRITE_BUFFER (0)
+
+//! The number of write buffers shared by all write files, which borrow one
+//! only while they have data waiting (0 for a buffer in every write file)
+#define FS_WRITE_BUFFER_POOL_SIZE (0)
+
+//! The number of volumes, each on its own flash with this geometry, which can
+//! be mounted at once (needs flash_select() in flogfs_conf_implement.h, and
+//! thread-local storage to use them from several threads)
+#define FS_NUM_VOLUMES       (1)
+
+//! The number of chips the pages of each block are striped across, page p on
+//! chip p / FS_PLANES % FS_STRIPE_CHIPS, so a page is loaded into one chip
+//! while another programs (needs FS_ASYNC_FLASH and flash_wait_chip() in
+//! flogfs_conf_implement.h)
+#define FS_STRIPE_CHIPS      (1)
+
+//! The number of planes each block spans, one physical block on each, with
+//! page p on plane p % FS_PLANES so a run of pages takes a single multi-plane
+//! program (needs FS_ASYNC_FLASH and flash_commit_plane() in
+//! flogfs_conf_implement.h)
+#define FS_PLANES            (1)
+
+//! Whether file data pages are filled without reading them first and
+//! committed with cache programs, so the next page loads while one programs
+//! (needs flash_load_page() and flash_commit_cache() in
+//! flogfs_conf_implement.h)
+#define FS_CACHE_PROGRAM     (0)
+
+//! Whether the flash driver protects the data and user spare bytes of each
+//! sector with flogfs_ecc.c, for parts without ECC of their own (only used by
+//! flogfs_conf_implement.h, which must link flogfs_ecc.c)
+#define FS_SOFTWARE_ECC      (0)
+
+//! Whether file data programs are left running when a call returns (needs
+//! flash_commit_start() and flash_wait() in flogfs_conf_implement.h)
+#define FS_ASYNC_FLASH       (0)
+
+//! The number of deleted files whose blocks can wait to be erased (0 to erase
+//! them in flogfs_rm())
+#define FS_ERASE_QUEUE_SIZE  (4)
+
+//! The number of blocks which can be allocated to write files before they're
+//! started. Each file can start its new block when it has a full sector rather
+//! than when another file needs a block.
+#define FS_DIRTY_BLOCKS      (4)
+
+//! Whether free blocks are also kept in a heap by age (2 bytes per block), so
+//! an allocation takes the youngest without looking at every free block
+#define FS_FREE_BLOCK_HEAP   (0)
+
+//! The number of sector headers kept in RAM for reads of metadata (0 for
+//! none, about 70 bytes each)
+#define FS_READ_CACHE_SIZE   (16)
+
+//! Whether reading a file starts loading the page after the one being read
+//! (needs flash_read_ahead() in flogfs_conf_implement.h)
+#define FS_READ_AHEAD        (0)
+
+//! Whether flogfs_read_visit() is available to read files in place
+//! (needs flash_map_sector() in flogfs_conf_implement.h)
+#define FS_ZERO_COPY_READ    (0)
 
 
 //! @} // FLogConf
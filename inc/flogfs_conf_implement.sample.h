@@ -77,6 +77,15 @@ static inline void flash_unlock(){
 	flash.unlock();
 }
 
+/*!
+ @brief Direct the calling thread's flash accesses to the flash of a volume
+
+ Only needed with FS_NUM_VOLUMES. This driver has a single chip so it does
+ nothing.
+ */
+static inline void flash_select(uint8_t volume){
+}
+
 static inline flog_result_t flash_open_page(uint16_t block, uint16_t page){
 	flash_block = block;
 	flash_page = page;
@@ -127,18 +136,103 @@ static inline void flash_commit(){
 	flash.page_commit();
 }
 
+/*!
+ @brief Start committing the active page without waiting for it to finish
+
+ Only needed with FS_ASYNC_FLASH. Nothing else may be done with the flash until
+ flash_wait() is called. This driver has no split program so it just blocks.
+ */
+static inline void flash_commit_start(){
+	flash_commit();
+}
+
+/*!
+ @brief Load the active page into its plane for a multi-plane program
+
+ Only needed with FS_PLANES. This driver has no multi-plane program so it
+ starts committing the page on its own.
+ */
+static inline void flash_commit_plane(){
+	flash_commit_start();
+}
+
+/*!
+ @brief Point the cache register at a page to be programmed without reading it
+
+ Only needed with FS_CACHE_PROGRAM. This driver has no separate load so it
+ reads the page like flash_open_page().
+ */
+static inline flog_result_t flash_load_page(uint16_t block, uint16_t page){
+	return flash_open_page(block, page);
+}
+
+/*!
+ @brief Start committing the active page with a cache program
+
+ Only needed with FS_CACHE_PROGRAM. This driver has no cache program so it
+ starts an ordinary one.
+ */
+static inline void flash_commit_cache(){
+	flash_commit_start();
+}
+
+/*!
+ @brief Wait for a program started with flash_commit_start()
+ @return The result of the program
+ */
+static inline flog_result_t flash_wait(){
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Wait for a program started with flash_commit_start() on one chip
+ @return The result of the program
+
+ Only needed with FS_STRIPE_CHIPS. This driver has a single chip so it waits
+ like flash_wait().
+ */
+static inline flog_result_t flash_wait_chip(uint8_t chip){
+	return flash_wait();
+}
+
+/*!
+ @brief Start loading a page without disturbing the flash cache
+
+ Only needed with FS_READ_AHEAD. This driver has no cache read so it does
+ nothing.
+ */
+static inline void flash_read_ahead(uint16_t block, uint16_t page){
+}
+
 /*!
  @brief Read data from the flash cache (current page only)
  @param dst The destination buffer to fill
  @param chunk_in_page The chunk index within the current page
  @param offset The offset data to retrieve
- @param n The number of bytes to transfer
+ @param n The number of bytes to transfer. This may run on into the
+          following sectors of the page.
  @return The success or failure of the operation
  */
 static inline flog_result_t flash_read_sector(uint8_t * dst, uint8_t sector, uint16_t offset, uint16_t n){
 	return FLOG_RESULT(flash.page_read_continued(dst, FS_SECTOR_SIZE * sector + offset, n));
 }
 
+/*!
+ @brief Get the address of data in the flash cache (current page only)
+ @param sector The sector index within the current page
+ @param offset The offset of the data within the sector
+ @param n The number of bytes wanted, which may run on as with
+          flash_read_sector()
+ @return The data, valid until the flash cache changes, or NULL if it can't be
+         reached in place
+
+ Only needed with FS_ZERO_COPY_READ. This driver has no page buffer in RAM so
+ it always returns NULL.
+ */
+static inline uint8_t const * flash_map_sector(uint8_t sector, uint16_t offset, uint16_t n){
+	return NULL;
+}
+
 static inline flog_result_t flash_read_spare(uint8_t * dst, uint8_t sector){
 	return FLOG_RESULT(flash.page_read_continued(dst, FS_SECTOR_SIZE * sector, 4));
 }
@@ -0,0 +1,538 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_conf_implement.h
+ * @author Ben Nahill <bnahill@gmail.com>
+ * @ingroup FLogFS
+ *
+ * @brief Host implementation of the flash interface using flogfs_sim.c
+ */
+
+#include "flogfs.h"
+#include "flogfs_sim.h"
+#if FS_SOFTWARE_ECC
+#include "flogfs_ecc.h"
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t flash_spare_t[FLOG_SIM_PAGE_SPARE_SIZE];
+
+typedef pthread_mutex_t fs_lock_t;
+
+
+static inline void fs_lock_init(fs_lock_t * lock){
+	pthread_mutex_init(lock, NULL);
+}
+
+static inline void fs_lock(fs_lock_t * lock){
+	pthread_mutex_lock(lock);
+}
+
+static inline void fs_unlock(fs_lock_t * lock){
+	pthread_mutex_unlock(lock);
+}
+
+//! Per thread, since threads on different volumes hold different flash locks
+static FLOG_THREAD_LOCAL flash_spare_t flog_spare_buffer;
+
+#if FS_SOFTWARE_ECC
+#if FS_SECTORS_PER_PAGE > 8
+#error "The ECC state only has room for 8 sectors per page"
+#endif
+
+/*!
+ @brief What the software ECC knows about the page in the cache register
+
+ The simulated part has no ECC of its own, so each sector keeps codes for its
+ data and its user spare bytes in the rest of its spare area. The data code is
+ built up from the bytes as they're written and goes into the register just
+ before the page is committed. Each sector is checked the first time it's read
+ after the page is opened, and its spare bytes every time they're read.
+
+ Checking a sector takes all of it out of the register, so the last one is
+ kept to serve reads of the rest of it.
+ */
+typedef struct {
+	//! Sectors whose data has been written since the page was opened
+	uint8_t written;
+	//! Sectors whose spare bytes have been written since then
+	uint8_t spare_written;
+	//! Sectors whose data in the register is known to be good
+	uint8_t checked;
+	//! The bit of the sector held in buffer, if any
+	uint8_t buffered;
+	flog_ecc_state_t data[FS_SECTORS_PER_PAGE];
+	uint8_t spare[FS_SECTORS_PER_PAGE][4];
+	uint8_t buffer[FS_SECTOR_SIZE];
+} flog_ecc_page_t;
+
+//! One for each volume, since each has its own cache register
+static flog_ecc_page_t flog_ecc_pages[FS_NUM_VOLUMES];
+//! The one for the volume the calling thread is working on
+static FLOG_THREAD_LOCAL flog_ecc_page_t * flog_ecc_page = &flog_ecc_pages[0];
+
+//! Forget the page in the register when another one is loaded
+static inline void flash_ecc_reset(){
+	for(uint8_t sector = 0; sector < FS_SECTORS_PER_PAGE; sector++){
+		if(flog_ecc_page->written & (1 << sector)){
+			flog_ecc_start(&flog_ecc_page->data[sector]);
+		}
+	}
+	flog_ecc_page->written = 0;
+	flog_ecc_page->spare_written = 0;
+	flog_ecc_page->checked = 0;
+	flog_ecc_page->buffered = 0;
+}
+
+static inline void flash_ecc_write_code(uint32_t code, uint16_t offset,
+                                        uint8_t bytes){
+	uint8_t buffer[4];
+	for(uint8_t i = 0; i < bytes; i++){
+		buffer[i] = code >> (8 * i);
+	}
+	flog_sim_write(buffer, offset, bytes);
+}
+
+static inline uint32_t flash_ecc_read_code(uint8_t const * buffer,
+                                           uint8_t bytes){
+	uint32_t code = 0;
+	for(uint8_t i = 0; i < bytes; i++){
+		code |= (uint32_t)buffer[i] << (8 * i);
+	}
+	return code;
+}
+
+/*!
+ @brief Write the codes of everything written to the page into the register
+ */
+static inline void flash_ecc_commit(){
+	for(uint8_t sector = 0; sector < FS_SECTORS_PER_PAGE; sector++){
+		if(flog_ecc_page->written & (1 << sector)){
+			flog_ecc_state_t * const state = &flog_ecc_page->data[sector];
+			flash_ecc_write_code(flog_ecc_finish(state, FS_SECTOR_SIZE),
+			                     FLOG_SIM_DATA_ECC_OFFSET(sector),
+			                     flog_ecc_bytes(FS_SECTOR_SIZE));
+			flog_ecc_start(state);
+		}
+		if(flog_ecc_page->spare_written & (1 << sector)){
+			flash_ecc_write_code(
+				flog_ecc_calculate(flog_ecc_page->spare[sector], 4),
+				FLOG_SIM_SPARE_ECC_OFFSET(sector), 2);
+		}
+	}
+	// What was just written is what the register holds
+	flog_ecc_page->checked |= flog_ecc_page->written;
+	flog_ecc_page->buffered = 0;
+	flog_ecc_page->written = 0;
+	flog_ecc_page->spare_written = 0;
+}
+
+/*!
+ @brief Check the data of a sector in the register the first time it's read
+ @param sector The sector
+ @param data Returns the sector, checked and corrected, if it's in the buffer
+             now, or NULL if it has to be read from the register
+ @retval FLOG_SUCCESS unless there were too many errors to correct
+
+ A bit that gets corrected is also corrected in the register. Sectors written
+ since the page was opened hold what FLogFS gave them, so there is nothing to
+ check.
+ */
+static inline flog_result_t flash_ecc_check_sector(uint8_t sector,
+                                                   uint8_t const ** data){
+	uint8_t code[4];
+	uint8_t const bytes = flog_ecc_bytes(FS_SECTOR_SIZE);
+	uint8_t * const buffer = flog_ecc_page->buffer;
+	uint16_t bit;
+	flog_flash_read_result_t result;
+
+	*data = NULL;
+	if(sector >= FS_SECTORS_PER_PAGE){
+		return FLOG_SUCCESS;
+	}
+	if(flog_ecc_page->buffered & (1 << sector)){
+		*data = buffer;
+		return FLOG_SUCCESS;
+	}
+	if((flog_ecc_page->checked | flog_ecc_page->written) & (1 << sector)){
+		return FLOG_SUCCESS;
+	}
+
+	flog_ecc_page->buffered = 0;
+	if(!flog_sim_read(code, FLOG_SIM_DATA_ECC_OFFSET(sector), bytes) ||
+	   !flog_sim_read(buffer, FS_SECTOR_SIZE * sector, FS_SECTOR_SIZE)){
+		return FLOG_FAILURE;
+	}
+	*data = buffer;
+
+	result = flog_ecc_check(flash_ecc_read_code(code, bytes),
+	                        flog_ecc_calculate(buffer, FS_SECTOR_SIZE),
+	                        FS_SECTOR_SIZE, &bit);
+	flog_sim_ecc_result(result);
+	if(result == FLOG_FLASH_ERR_DETECT){
+		return FLOG_FAILURE;
+	}
+	if((result == FLOG_FLASH_ERR_CORRECT) && (bit != FLOG_ECC_CODE_BIT)){
+		buffer[bit / 8] ^= 1 << (bit % 8);
+		flog_sim_write(&buffer[bit / 8], FS_SECTOR_SIZE * sector + bit / 8, 1);
+	}
+	flog_ecc_page->checked |= 1 << sector;
+	flog_ecc_page->buffered = 1 << sector;
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Check the spare bytes of a sector, correcting them in place
+ @param spare The 4 spare bytes followed by their code
+ */
+static inline flog_result_t flash_ecc_check_spare(uint8_t * spare,
+                                                  uint8_t sector){
+	flog_flash_read_result_t result;
+
+	if(flog_ecc_page->spare_written & (1 << sector)){
+		return FLOG_SUCCESS;
+	}
+	result = flog_ecc_correct(spare, 4, flash_ecc_read_code(spare + 4, 2));
+	flog_sim_ecc_result(result);
+	return FLOG_RESULT(result != FLOG_FLASH_ERR_DETECT);
+}
+#endif
+
+static inline flog_result_t flash_init(){
+#if FS_SOFTWARE_ECC
+	flash_ecc_reset();
+#endif
+	return flog_sim_power_on();
+}
+
+static inline void flash_lock(){
+	flog_sim_lock();
+}
+
+static inline void flash_unlock(){
+	flog_sim_unlock();
+}
+
+/*!
+ @brief Direct the calling thread's flash accesses to the flash of a volume
+
+ Only needed with FS_NUM_VOLUMES. This is called whenever the thread starts
+ working on a volume, before anything else (including flash_lock()). Each
+ volume gets its own simulated part.
+ */
+static inline void flash_select(uint8_t volume){
+	flog_sim_select(volume);
+#if FS_SOFTWARE_ECC
+	flog_ecc_page = &flog_ecc_pages[volume];
+#endif
+}
+
+static inline flog_result_t flash_open_page(uint16_t block, uint16_t page){
+#if FS_SOFTWARE_ECC
+	flash_ecc_reset();
+#endif
+	return flog_sim_open_page(block, page);
+}
+
+static inline void flash_close_page(){
+#if FS_SOFTWARE_ECC
+	flash_ecc_reset();
+#endif
+	flog_sim_close_page();
+}
+
+static inline flog_result_t flash_erase_block(uint16_t block){
+	return flog_sim_erase_block(block);
+}
+
+static inline flog_result_t flash_get_spares(){
+#if FS_SOFTWARE_ECC
+	flog_result_t result = flog_sim_read(flog_spare_buffer,
+	                                     FLOG_SIM_PAGE_DATA_SIZE,
+	                                     sizeof(flog_spare_buffer));
+	for(uint8_t sector = 0; sector < FS_SECTORS_PER_PAGE; sector++){
+		uint8_t * const spare =
+			&flog_spare_buffer[sector * FLOG_SIM_SPARE_PER_SECTOR + 4];
+		if(!flash_ecc_check_spare(spare, sector)){
+			result = FLOG_FAILURE;
+		}
+	}
+	return result;
+#else
+	return flog_sim_read(flog_spare_buffer, FLOG_SIM_PAGE_DATA_SIZE,
+	                     sizeof(flog_spare_buffer));
+#endif
+}
+
+static inline uint8_t * flash_spare(uint8_t sector){
+	return &flog_spare_buffer[sector * FLOG_SIM_SPARE_PER_SECTOR + 4];
+}
+
+static inline flog_result_t flash_block_is_bad(){
+	uint8_t buffer;
+	flog_sim_read(&buffer, FLOG_SIM_BAD_BLOCK_OFFSET, 1);
+	return FLOG_RESULT(buffer == 0);
+}
+
+static inline void flash_set_bad_block(){
+	uint8_t const buffer = 0;
+	flog_sim_write(&buffer, FLOG_SIM_BAD_BLOCK_OFFSET, 1);
+	flog_sim_commit();
+}
+
+/*!
+ @brief Commit the changes to the active page
+ */
+static inline void flash_commit(){
+#if FS_SOFTWARE_ECC
+	flash_ecc_commit();
+#endif
+	flog_sim_commit();
+}
+
+/*!
+ @brief Start committing the active page without waiting for it to finish
+
+ Nothing else may be done with the flash until flash_wait() is called.
+ */
+static inline void flash_commit_start(){
+#if FS_SOFTWARE_ECC
+	flash_ecc_commit();
+#endif
+	flog_sim_commit_start();
+}
+
+/*!
+ @brief Load the active page into its plane for a multi-plane program
+
+ Only needed with FS_PLANES. The page goes out in one program with the page of
+ the next plane when that is committed with flash_commit_start(). Anything
+ else on the chip (including flash_wait()) programs it on its own first.
+ */
+static inline void flash_commit_plane(){
+#if FS_SOFTWARE_ECC
+	flash_ecc_commit();
+#endif
+	flog_sim_commit_plane();
+}
+
+/*!
+ @brief Point the cache register at a page to be programmed without reading it
+
+ Only needed with FS_CACHE_PROGRAM. The register starts out erased, so only
+ what gets written is programmed. A cache program still running on the chip
+ doesn't have to finish first.
+ */
+static inline flog_result_t flash_load_page(uint16_t block, uint16_t page){
+#if FS_SOFTWARE_ECC
+	flash_ecc_reset();
+#endif
+	return flog_sim_load_page(block, page);
+}
+
+/*!
+ @brief Start committing the active page with a cache program
+
+ Only needed with FS_CACHE_PROGRAM. The program starts when the one before it
+ on the chip finishes, and the cache register is free for flash_load_page()
+ from then on. Anything else has to wait with flash_wait() as usual.
+ */
+static inline void flash_commit_cache(){
+#if FS_SOFTWARE_ECC
+	flash_ecc_commit();
+#endif
+	flog_sim_commit_cache();
+}
+
+/*!
+ @brief Wait for a program started with flash_commit_start()
+ @return The result of the program
+ */
+static inline flog_result_t flash_wait(){
+	return flog_sim_wait();
+}
+
+/*!
+ @brief Wait for a program started with flash_commit_start() on one chip
+ @return The result of the program
+
+ Only needed with FS_STRIPE_CHIPS. Programs on the other chips keep running.
+ */
+static inline flog_result_t flash_wait_chip(uint8_t chip){
+	return flog_sim_wait_chip(chip);
+}
+
+/*!
+ @brief Start loading a page without disturbing the flash cache
+
+ Only needed with FS_READ_AHEAD. The page which is open can still be read in
+ the meantime and flash_open_page() of the new page picks it up.
+ */
+static inline void flash_read_ahead(uint16_t block, uint16_t page){
+	flog_sim_read_ahead(block, page);
+}
+
+/*!
+ @brief Read data from the flash cache (current page only)
+ @param dst The destination buffer to fill
+ @param sector The sector index within the current page
+ @param offset The offset data to retrieve
+ @param n The number of bytes to transfer. This may run on into the
+          following sectors of the page.
+ @return The success or failure of the operation
+ */
+static inline flog_result_t flash_read_sector(uint8_t * dst, uint8_t sector, uint16_t offset, uint16_t n){
+#if FS_SOFTWARE_ECC
+	flog_result_t result = FLOG_SUCCESS;
+
+	sector = sector % FS_SECTORS_PER_PAGE + offset / FS_SECTOR_SIZE;
+	offset %= FS_SECTOR_SIZE;
+	while(n){
+		uint16_t const chunk = (n < FS_SECTOR_SIZE - offset) ?
+		                       n : FS_SECTOR_SIZE - offset;
+		uint8_t const * data;
+		if(!flash_ecc_check_sector(sector, &data)){
+			result = FLOG_FAILURE;
+		}
+		if(data){
+			memcpy(dst, data + offset, chunk);
+		} else if(!flog_sim_read(dst, FS_SECTOR_SIZE * sector + offset, chunk)){
+			result = FLOG_FAILURE;
+		}
+		dst += chunk;
+		n -= chunk;
+		offset = 0;
+		sector += 1;
+	}
+	return result;
+#else
+	return flog_sim_read(dst, FS_SECTOR_SIZE * (sector % FS_SECTORS_PER_PAGE) + offset, n);
+#endif
+}
+
+/*!
+ @brief Get the address of data in the flash cache (current page only)
+ @param sector The sector index within the current page
+ @param offset The offset of the data within the sector
+ @param n The number of bytes wanted, which may run on as with
+          flash_read_sector()
+ @return The data, valid until the flash cache changes, or NULL if it can't be
+         reached in place
+
+ Only needed with FS_ZERO_COPY_READ.
+ */
+static inline uint8_t const * flash_map_sector(uint8_t sector, uint16_t offset, uint16_t n){
+#if FS_SOFTWARE_ECC
+	uint8_t const * data;
+
+	sector = sector % FS_SECTORS_PER_PAGE + offset / FS_SECTOR_SIZE;
+	offset %= FS_SECTOR_SIZE;
+	if(offset + n <= FS_SECTOR_SIZE){
+		if(!flash_ecc_check_sector(sector, &data)){
+			return NULL;
+		}
+		if(data){
+			return data + offset;
+		}
+	} else {
+		// Only the register has all of it
+		uint8_t const last = sector + (offset + n - 1) / FS_SECTOR_SIZE;
+		for(uint8_t s = sector; s <= last; s++){
+			if(!flash_ecc_check_sector(s, &data)){
+				return NULL;
+			}
+		}
+	}
+	return flog_sim_map(FS_SECTOR_SIZE * sector + offset, n);
+#else
+	return flog_sim_map(FS_SECTOR_SIZE * (sector % FS_SECTORS_PER_PAGE) + offset, n);
+#endif
+}
+
+static inline flog_result_t flash_read_spare(uint8_t * dst, uint8_t sector){
+#if FS_SOFTWARE_ECC
+	uint8_t spare[6];
+	flog_result_t result;
+
+	sector %= FS_SECTORS_PER_PAGE;
+	result = flog_sim_read(spare, FLOG_SIM_SPARE_OFFSET(sector), sizeof(spare));
+	if(result){
+		result = flash_ecc_check_spare(spare, sector);
+	}
+	memcpy(dst, spare, 4);
+	return result;
+#else
+	return flog_sim_read(dst, FLOG_SIM_SPARE_OFFSET(sector % FS_SECTORS_PER_PAGE), 4);
+#endif
+}
+
+/*!
+ @brief Write sector data to the flash cache
+ @param src A pointer to the data to transfer
+ @param sector The sector index within the current page
+ @param offset The offset to write the data
+ @param n The number of bytes to write
+ */
+static inline void flash_write_sector(uint8_t const * src, uint8_t sector, uint16_t offset, uint16_t n){
+#if FS_SOFTWARE_ECC
+	sector %= FS_SECTORS_PER_PAGE;
+	flog_ecc_update(&flog_ecc_page->data[sector], src, offset, n);
+	flog_ecc_page->written |= 1 << sector;
+	flog_ecc_page->buffered &= ~(1 << sector);
+#endif
+	flog_sim_write(src, FS_SECTOR_SIZE * (sector % FS_SECTORS_PER_PAGE) + offset, n);
+}
+
+
+/*!
+ @brief Write the spare data for a sector
+ @param sector The sector index within the current page
+
+ @note This doesn't commit the transaction
+ */
+static inline void flash_write_spare(uint8_t const * src, uint8_t sector){
+#if FS_SOFTWARE_ECC
+	sector %= FS_SECTORS_PER_PAGE;
+	memcpy(flog_ecc_page->spare[sector], src, 4);
+	flog_ecc_page->spare_written |= 1 << sector;
+#endif
+	flog_sim_write(src, FLOG_SIM_SPARE_OFFSET(sector % FS_SECTORS_PER_PAGE), 4);
+}
+
+static inline void flash_debug_warn(char const * msg){
+	fprintf(stderr, "Warning: %s\n", msg);
+}
+
+static inline void flash_debug_error(char const * msg){
+	fprintf(stderr, "Error: %s\n", msg);
+}
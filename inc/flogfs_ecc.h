@@ -0,0 +1,166 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_ecc.h
+ * @author Ben Nahill <bnahill@gmail.com>
+ *
+ * @ingroup FLogFS
+ *
+ * @brief Software ECC for flash without ECC of its own
+ *
+ * This is a Hamming code like the one SmartMedia used. It corrects any one
+ * flipped bit in a sector and detects any two, which is what the on-die ECC of
+ * parts like the MT29F gives. A sector of 2^n bytes takes 2n + 6 bits of code:
+ * 3 bytes for 512 bytes of data and 2 bytes for the 4 user spare bytes.
+ *
+ * The code is taken over the inverted data and stored inverted. An erased
+ * sector then checks out with its erased code, and bytes which are still
+ * erased don't change the code at all, so it can be built up from just the
+ * bytes written to a sector, in any order.
+ *
+ * All of the work is in flog_ecc_update(). It uses SSE2 or NEON when the
+ * compiler targets them and a 64-bit scalar loop otherwise, with tables for
+ * the parities at the end.
+ */
+
+#ifndef __FLOGFS_ECC_H_
+#define __FLOGFS_ECC_H_
+
+#include "flogfs.h"
+
+#if !FLOG_BUILD_CPP
+#ifdef __cplusplus
+extern "C" {
+#endif
+#endif
+
+//! @addtogroup FLogECC
+//! @{
+
+//! The largest sector size supported, as a power of two
+#define FLOG_ECC_MAX_OFFSET_BITS (12)
+
+//! The bit given by flog_ecc_check() when the flipped bit was in the code
+#define FLOG_ECC_CODE_BIT        (0xFFFF)
+
+/*!
+ @brief The running parities of a sector
+ */
+typedef struct {
+	//! XOR of every (inverted) byte
+	uint8_t column;
+	//! XOR of the (inverted) bytes whose offset has each bit set
+	uint8_t lines[FLOG_ECC_MAX_OFFSET_BITS];
+} flog_ecc_state_t;
+
+/*!
+ @brief Get the number of code bytes for a sector
+ @param size The sector size, a power of two
+ */
+uint8_t flog_ecc_bytes(uint16_t size);
+
+/*!
+ @brief Start a sector which is completely erased
+ */
+void flog_ecc_start(flog_ecc_state_t * state);
+
+/*!
+ @brief Add bytes written to a sector
+ @param state The sector
+ @param data The bytes
+ @param offset The offset of the bytes in the sector
+ @param n The number of bytes
+
+ Each byte may only be added once. Those never added are taken as erased.
+ */
+void flog_ecc_update(flog_ecc_state_t * state, uint8_t const * data,
+                     uint16_t offset, uint16_t n);
+
+/*!
+ @brief flog_ecc_update() without any vector instructions
+
+ This is the fallback when there are none. It's only public to compare them.
+ */
+void flog_ecc_update_scalar(flog_ecc_state_t * state, uint8_t const * data,
+                            uint16_t offset, uint16_t n);
+
+/*!
+ @brief Get the name of the kernel behind flog_ecc_update()
+ */
+char const * flog_ecc_kernel();
+
+/*!
+ @brief Get the code of a sector, as it's stored
+ @param state The sector
+ @param size The sector size, a power of two
+ @return The code, to be stored in flog_ecc_bytes() bytes starting from the
+         least significant
+ */
+uint32_t flog_ecc_finish(flog_ecc_state_t const * state, uint16_t size);
+
+/*!
+ @brief Get the code of a whole sector, as it's stored
+ */
+uint32_t flog_ecc_calculate(uint8_t const * data, uint16_t size);
+
+/*!
+ @brief Compare a stored code with the one calculated from what was read
+ @param stored The code read back with the sector
+ @param calculated The code of the data read back
+ @param size The sector size, a power of two
+ @param bit Returns the index of the flipped bit (byte * 8 + bit) for
+            FLOG_FLASH_ERR_CORRECT, or FLOG_ECC_CODE_BIT if the data is fine
+            and the flipped bit was in the code
+ @retval FLOG_FLASH_SUCCESS if they match
+ @retval FLOG_FLASH_ERR_CORRECT if one bit was flipped
+ @retval FLOG_FLASH_ERR_DETECT if there are more errors than can be corrected
+ */
+flog_flash_read_result_t flog_ecc_check(uint32_t stored, uint32_t calculated,
+                                        uint16_t size, uint16_t * bit);
+
+/*!
+ @brief Check a whole sector, correcting it in place if it can be
+ @param data The sector
+ @param size The sector size, a power of two
+ @param stored The code read back with the sector
+ @return As for flog_ecc_check()
+ */
+flog_flash_read_result_t flog_ecc_correct(uint8_t * data, uint16_t size,
+                                          uint32_t stored);
+
+//! @} // FLogECC
+
+#if !FLOG_BUILD_CPP
+#ifdef __cplusplus
+};
+#endif
+#endif
+
+#endif // __FLOGFS_ECC_H_
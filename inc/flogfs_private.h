@@ -43,6 +43,8 @@ either expressed or implied, of the FLogFS Project.
 #include "flogfs.h"
 #include "flogfs_conf.h"
 
+#include <assert.h>
+
 // KDevelop wants to be a jerk about the __restrict__ keyword
 // #ifdef USE_RESTRICT
 // 	#if defined(__GNUG__)
@@ -70,6 +72,87 @@ either expressed or implied, of the FLogFS Project.
 #define MIN(a,b) ((a > b) ? b : a)
 
 
+// Defaults for the optional features in flogfs_conf.h
+
+#ifndef FS_FILE_INDEX_SIZE
+#define FS_FILE_INDEX_SIZE (0)
+#endif
+
+#ifndef FS_TAIL_HINT_SIZE
+#define FS_TAIL_HINT_SIZE (0)
+#endif
+
+#ifndef FS_ASYNC_FLASH
+#define FS_ASYNC_FLASH (0)
+#endif
+
+#ifndef FS_ERASE_QUEUE_SIZE
+#define FS_ERASE_QUEUE_SIZE (0)
+#endif
+
+#ifndef FS_DIRTY_BLOCKS
+#define FS_DIRTY_BLOCKS (1)
+#endif
+
+#ifndef FS_FREE_BLOCK_HEAP
+#define FS_FREE_BLOCK_HEAP (0)
+#endif
+
+#ifndef FS_READ_CACHE_SIZE
+#define FS_READ_CACHE_SIZE (0)
+#endif
+
+#ifndef FS_READ_AHEAD
+#define FS_READ_AHEAD (0)
+#endif
+
+#ifndef FS_ZERO_COPY_READ
+#define FS_ZERO_COPY_READ (0)
+#endif
+
+#ifndef FS_WRITE_BUFFER_POOL_SIZE
+#define FS_WRITE_BUFFER_POOL_SIZE (0)
+#endif
+
+#ifndef FS_NUM_VOLUMES
+#define FS_NUM_VOLUMES (1)
+#endif
+
+#ifndef FS_STRIPE_CHIPS
+#define FS_STRIPE_CHIPS (1)
+#endif
+
+#if FS_STRIPE_CHIPS > 8
+#error "FS_STRIPE_CHIPS can be at most 8"
+#endif
+
+#ifndef FS_PLANES
+#define FS_PLANES (1)
+#endif
+
+#ifndef FS_CACHE_PROGRAM
+#define FS_CACHE_PROGRAM (0)
+#endif
+
+#ifndef FS_SOFTWARE_ECC
+#define FS_SOFTWARE_ECC (0)
+#endif
+
+//! Storage class of the per-thread volume selection (with FS_NUM_VOLUMES).
+//! Without thread-local storage, or when flogfs_conf.h defines it empty, the
+//! selection is a plain global shared by every thread (see flogfs_select()).
+#ifndef FLOG_THREAD_LOCAL
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define FLOG_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+      !defined(__STDC_NO_THREADS__)
+#define FLOG_THREAD_LOCAL _Thread_local
+#else
+#define FLOG_THREAD_LOCAL
+#endif
+#endif
+
+
 //! @addtogroup FLogPrivate
 //! @{
 
@@ -87,7 +170,9 @@ typedef enum {
 	FLOG_BLOCK_TYPE_ERROR = 0,
 	FLOG_BLOCK_TYPE_UNALLOCATED = 0xFF,
 	FLOG_BLOCK_TYPE_INODE = 1,
-	FLOG_BLOCK_TYPE_FILE = 2
+	FLOG_BLOCK_TYPE_FILE = 2,
+	FLOG_BLOCK_TYPE_AGE_TABLE = 3,
+	FLOG_BLOCK_TYPE_CHECKPOINT = 4
 } flog_block_type_t;
 
 //! @name Invalid values
@@ -116,6 +201,10 @@ typedef struct {
 	flog_block_age_t next_age;
 } flog_block_stat_sector_t;
 
+//! The layout of the volume on flash, bumped whenever it changes. Inode blocks
+//! written before there was one read back as erased, 0xFFFFFFFF.
+#define FLOG_FORMAT_VERSION (2)
+
 //! @defgroup FLogInodeBlockStructs Inode block structures
 //! @brief Descriptions of the data in inode blocks
 //! @{
@@ -123,6 +212,11 @@ typedef struct {
 	//flog_block_age_t age;
 	flog_timestamp_t timestamp;
 	flog_block_idx_t previous;
+	//! The maximum file ID when the block was started, so that IDs of files
+	//! dropped by compaction are never reused
+	flog_file_id_t max_file_id;
+	//! FLOG_FORMAT_VERSION, checked in the first block when mounting
+	uint32_t version;
 } flog_inode_init_sector_t;
 
 typedef struct {
@@ -131,12 +225,22 @@ typedef struct {
 	inode_index_t inode_index;
 } flog_inode_init_sector_spare_t;
 
+/*!
+ @brief Written to the first inode block once its chain has been replaced
+ */
 typedef struct {
 	flog_timestamp_t timestamp;
 	flog_block_idx_t replacement_id;
 	flog_block_age_t replacement_age;
 } flog_inode_invalidation_sector_t;
 
+typedef struct {
+	//! flog_copy_complete_marker if the replacement is complete
+	uint8_t copy_complete_marker;
+	uint8_t nothing;
+	uint16_t reserved;
+} flog_inode_invalidation_sector_spare_t;
+
 typedef struct {
 	flog_file_id_t file_id;
 	flog_block_idx_t first_block;
@@ -193,7 +297,8 @@ typedef struct {
 	flog_block_idx_t next_block;
 	flog_block_age_t next_age;
 	flog_timestamp_t timestamp;
-	flog_sector_nbytes_t bytes_in_block;
+	//! Number of file bytes in this block (a block holds more than 64k)
+	uint32_t bytes_in_block;
 } flog_file_tail_sector_header_t;
 
 typedef struct {
@@ -201,6 +306,12 @@ typedef struct {
 	uint8_t data[FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t)];
 } flog_file_tail_sector_t;
 
+//! The number of file bytes in a block with every sector full
+#define FLOG_FILE_BLOCK_CAPACITY \
+	((FS_SECTORS_PER_BLOCK - 1) * FS_SECTOR_SIZE - \
+	 sizeof(flog_file_init_sector_header_t) - \
+	 sizeof(flog_file_tail_sector_header_t))
+
 typedef struct {
 	uint8_t type_id;
 	uint8_t nothing;
@@ -215,6 +326,180 @@ typedef struct {
 //! @}
 
 
+//! @defgroup FLogCheckpointStructs Checkpoint block structures
+//! @brief Descriptions of the data in checkpoint blocks
+//!
+//! The first two good blocks of a volume are reserved for checkpoints and
+//! used alternately. Each holds one complete record of the allocator state
+//! followed by a log of the allocations and frees made since.
+//! @{
+
+typedef struct {
+	//! Incremented each time a new record is written
+	uint32_t sequence;
+} flog_checkpoint_init_sector_t;
+
+typedef struct {
+	uint8_t type_id;
+	uint8_t nothing;
+	uint16_t reserved;
+} flog_checkpoint_init_sector_spare_t;
+
+typedef struct {
+	//! flog_copy_complete_marker once the record has been written
+	uint8_t complete_marker;
+} flog_checkpoint_commit_sector_t;
+
+/*!
+ @brief Where a file ended when it was last closed
+
+ This lets flogfs_open_write() start at the last block and sector instead of
+ walking the whole file. Data is only ever added, so a hint which has fallen
+ behind is still a valid place to start.
+ */
+typedef struct {
+	//! FLOG_FILE_ID_INVALID for an unused hint
+	flog_file_id_t file_id;
+	flog_block_idx_t block;
+	//! The next sector to be written
+	uint16_t sector;
+	//! The number of file bytes before that sector in the block
+	uint32_t bytes_in_block;
+	//! The size of the file
+	uint32_t write_head;
+} flog_tail_hint_t;
+
+/*!
+ @brief A deleted file whose blocks haven't all been erased yet
+
+ The chain is erased from its first block, so block is always the first one
+ left.
+ */
+typedef struct {
+	flog_file_id_t file_id;
+	//! The next block to erase
+	flog_block_idx_t block;
+} flog_erase_queue_entry_t;
+
+typedef struct {
+	flog_timestamp_t t;
+	flog_file_id_t max_file_id;
+	flog_block_idx_t inode0;
+	flog_block_idx_t num_free_blocks;
+	uint32_t free_block_sum;
+	//! The new inode chain of an unfinished compaction
+	flog_block_idx_t compact_new_inode0;
+	//! The replaced inode chain of an unfinished compaction
+	flog_block_idx_t compact_old_inode0;
+#if FS_TAIL_HINT_SIZE
+	flog_tail_hint_t tail_hints[FS_TAIL_HINT_SIZE];
+#endif
+#if FS_ERASE_QUEUE_SIZE
+	uint16_t erase_queue_n;
+	flog_erase_queue_entry_t erase_queue[FS_ERASE_QUEUE_SIZE];
+#endif
+} flog_checkpoint_header_t;
+
+typedef enum {
+	FLOG_CHECKPOINT_DELTA_ALLOC = 1,
+	FLOG_CHECKPOINT_DELTA_FREE = 2,
+	//! The inode chain starting at previous was replaced by block
+	FLOG_CHECKPOINT_DELTA_INODE0 = 3,
+	//! The file owner was deleted and its chain starting at block queued
+	FLOG_CHECKPOINT_DELTA_DELETE = 4,
+	//! block of the queued file owner is about to be erased. previous is the
+	//! block after it. An invalid block drops owner from the queue.
+	FLOG_CHECKPOINT_DELTA_ERASE = 5
+} flog_checkpoint_delta_type_t;
+
+/*!
+ @brief A change to the allocator state since the record
+
+ One of these is written to each sector following the record. ALLOC entries
+ are written before the new block is referenced anywhere; FREE entries after
+ the block has been erased. ERASE entries are written before the erase so
+ that the rest of the chain can still be found if it's cut short.
+ */
+typedef struct {
+	uint8_t delta_type;
+	//! The block type of an allocation
+	uint8_t block_type;
+	flog_block_idx_t block;
+	//! The age of the block while free
+	flog_block_age_t age;
+	flog_timestamp_t timestamp;
+	//! The file ID for a file block ALLOC, DELETE or ERASE
+	uint32_t owner;
+	//! The block whose tail will point to this one, if any (the next block
+	//! for ERASE)
+	flog_block_idx_t previous;
+	//! Inverted sum of the preceding bytes to catch torn writes
+	uint16_t check;
+} flog_checkpoint_delta_t;
+
+//! Bytes of free block bitmap
+#define FLOG_CHECKPOINT_BITMAP_SIZE ((FS_NUM_BLOCKS + 7) / 8)
+//! Sectors needed for the bitmap
+#define FLOG_CHECKPOINT_BITMAP_SECTORS \
+	((FLOG_CHECKPOINT_BITMAP_SIZE + FS_SECTOR_SIZE - 1) / FS_SECTOR_SIZE)
+//! The first sector of the first delta, rounded up to a page
+#define FLOG_CHECKPOINT_FIRST_DELTA_SECTOR \
+	(((FLOG_CHECKPOINT_RECORD_SECTOR + 1 + FLOG_CHECKPOINT_BITMAP_SECTORS + \
+	   FS_SECTORS_PER_PAGE - 1) / FS_SECTORS_PER_PAGE) * FS_SECTORS_PER_PAGE)
+
+//! Free delta sectors below which flogfs_maintain() starts a new record
+#define FLOG_CHECKPOINT_LOW_WATER (FS_SECTORS_PER_BLOCK / 8)
+
+//! @}
+
+
+//! @defgroup FLogAgeTableStructs Block age table structures
+//! @brief Descriptions of the data in block age table blocks
+//!
+//! The two good blocks following the checkpoint blocks hold the age of every
+//! block. Each checkpoint record is paired with the table of the same index
+//! and sequence number.
+//! @{
+
+typedef struct {
+	//! The sequence number of the checkpoint record this belongs to
+	uint32_t sequence;
+} flog_age_table_init_sector_t;
+
+typedef struct {
+	uint8_t type_id;
+	uint8_t nothing;
+	//! The number of entries in this sector
+	uint16_t nentries;
+} flog_age_table_sector_spare_t;
+
+/*!
+ @brief A block index and its age, packed as 2 and 3 little-endian bytes
+ */
+typedef struct {
+	uint8_t block[2];
+	uint8_t age[3];
+} flog_age_table_entry_t;
+
+//! The largest age which can be stored
+#define FLOG_AGE_TABLE_MAX_AGE (0xFFFFFF)
+#define FLOG_AGE_TABLE_ENTRIES_PER_SECTOR (FS_SECTOR_SIZE / 5)
+//! Sectors needed for the whole table
+#define FLOG_AGE_TABLE_SECTORS \
+	((FS_NUM_BLOCKS + FLOG_AGE_TABLE_ENTRIES_PER_SECTOR - 1) / \
+	 FLOG_AGE_TABLE_ENTRIES_PER_SECTOR)
+
+#if (FLOG_AGE_TABLE_SECTORS + 4) > FS_SECTORS_PER_BLOCK
+#error "The block age table doesn't fit in one block"
+#endif
+
+static_assert(sizeof(flog_checkpoint_header_t) <= FS_SECTOR_SIZE,
+              "The checkpoint record doesn't fit in one sector. Use fewer "
+              "FS_TAIL_HINT_SIZE or FS_ERASE_QUEUE_SIZE entries.");
+
+//! @}
+
+
 //! @name Special sector indices
 //! @{
 typedef enum {
@@ -222,7 +507,12 @@ typedef enum {
 	FLOG_INIT_SECTOR               = (1),
 	FLOG_TAIL_SECTOR               = (3),
 	FLOG_FILE_FIRST_DATA_SECTOR    = (2),
-	FLOG_INODE_FIRST_ENTRY_SECTOR  = (4)
+	FLOG_INODE_FIRST_ENTRY_SECTOR  = (4),
+	FLOG_INODE_INVALIDATION_SECTOR = (2),
+	FLOG_CHECKPOINT_COMMIT_SECTOR  = (2),
+	FLOG_CHECKPOINT_RECORD_SECTOR  = (4),
+	FLOG_AGE_TABLE_COMMIT_SECTOR   = (2),
+	FLOG_AGE_TABLE_FIRST_SECTOR    = (4)
 } flog_sector_special_idx_t;
 //! @}
 
@@ -0,0 +1,275 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_sim.h
+ * @author Ben Nahill <bnahill@gmail.com>
+ *
+ * @ingroup FLogFS
+ *
+ * @brief A RAM-backed NAND simulator for running FLogFS on a host
+ *
+ * The simulated part follows the MT29F1 layout the sample backend was written
+ * against: each page is FS_SECTORS_PER_PAGE data sectors followed by a spare
+ * area of 16 bytes per sector, with the bad block marker in the first spare
+ * byte of page 0. Accesses go through a single cache register the same way
+ * they do on the real chip. Erased bits read as 1 and programming can only
+ * clear them.
+ *
+ * Time is simulated rather than measured. Every operation advances a virtual
+ * clock by the configured array and bus latencies, so two runs of the same
+ * workload report exactly the same numbers.
+ *
+ * A program can also be started without waiting for it. The clock only catches
+ * up with it at flog_sim_wait(), so host work done in between (see
+ * flog_sim_advance()) overlaps tPROG the way it would on hardware.
+ *
+ * With FS_STRIPE_CHIPS, the pages of each block are spread over that many
+ * chips, page p on chip p / FS_PLANES % FS_STRIPE_CHIPS. Each chip runs its
+ * own program, so only operations on a busy chip have to wait for it. A block
+ * is erased on every chip at once.
+ *
+ * With FS_PLANES, each block is made of one block on each plane of a chip and
+ * page p is on plane p % FS_PLANES. flog_sim_commit_plane() holds a page in its
+ * plane until the page of the last plane is committed, then all of them take
+ * a single tPROG. Anything else on that chip sends the held pages on their own
+ * first.
+ *
+ * flog_sim_commit_cache() is a cache program. It frees the cache register as
+ * soon as the page moves into the data register, which is when the program
+ * before it finishes, so the next page can be loaded with flog_sim_load_page()
+ * while the array programs.
+ *
+ * In the same way, flog_sim_read_ahead() starts loading a page into the data
+ * register while the cache register can still be read, like the cache read
+ * commands of real parts. Opening that page afterwards only waits for
+ * whatever is left of tR. Anything else ends the read ahead.
+ *
+ * Like the cheaper parts, the simulated one has no ECC of its own. With
+ * FS_SOFTWARE_ECC the HAL keeps codes from flogfs_ecc.c in the rest of the
+ * spare area, and flog_sim_flip_bit() makes errors for it to find.
+ */
+
+#ifndef __FLOGFS_SIM_H_
+#define __FLOGFS_SIM_H_
+
+#include "flogfs.h"
+
+#if !FLOG_BUILD_CPP
+#ifdef __cplusplus
+extern "C" {
+#endif
+#endif
+
+//! @addtogroup FLogSim
+//! @{
+
+//! @name Simulated page layout
+//! @{
+#define FLOG_SIM_SPARE_PER_SECTOR (16)
+#define FLOG_SIM_PAGE_DATA_SIZE   (FS_SECTOR_SIZE * FS_SECTORS_PER_PAGE)
+#define FLOG_SIM_PAGE_SPARE_SIZE  (FLOG_SIM_SPARE_PER_SECTOR * FS_SECTORS_PER_PAGE)
+#define FLOG_SIM_PAGE_SIZE        (FLOG_SIM_PAGE_DATA_SIZE + FLOG_SIM_PAGE_SPARE_SIZE)
+//! Offset of the bad block marker in page 0 of each block
+#define FLOG_SIM_BAD_BLOCK_OFFSET (FLOG_SIM_PAGE_DATA_SIZE)
+//! Offset of the 4 user spare bytes of a sector
+#define FLOG_SIM_SPARE_OFFSET(sector) \
+	(FLOG_SIM_PAGE_DATA_SIZE + (sector) * FLOG_SIM_SPARE_PER_SECTOR + 4)
+//! Offset of the software ECC of the user spare bytes of a sector (2 bytes)
+#define FLOG_SIM_SPARE_ECC_OFFSET(sector) (FLOG_SIM_SPARE_OFFSET(sector) + 4)
+//! Offset of the software ECC of the data of a sector (up to 4 bytes)
+#define FLOG_SIM_DATA_ECC_OFFSET(sector) (FLOG_SIM_SPARE_OFFSET(sector) + 6)
+//! @}
+
+/*!
+ @brief Latency model for the simulated part
+
+ All values are in nanoseconds. The defaults from flog_sim_default_timing()
+ roughly match a 1Gb SLC SPI NAND on a 50MHz quad bus.
+ */
+typedef struct {
+	//! Array to cache register transfer (tR)
+	uint32_t t_read;
+	//! Cache register to array program (tPROG)
+	uint32_t t_prog;
+	//! Block erase (tBERS)
+	uint32_t t_erase;
+	//! Command and address overhead per operation
+	uint32_t t_cmd;
+	//! Bus transfer per byte moved to or from the cache register
+	uint32_t t_byte;
+	//! Number of partial programs allowed per page before it counts as abuse
+	uint8_t  max_partial_programs;
+} flog_sim_timing_t;
+
+/*!
+ @brief Operation counters kept by the simulator
+ */
+typedef struct {
+	//! Pages loaded into the cache register
+	uint32_t page_opens;
+	//! Page programs (commits)
+	uint32_t programs;
+	//! Block erases
+	uint32_t erases;
+	//! Bytes read out of the cache register
+	uint32_t bytes_read;
+	//! Bytes written into the cache register
+	uint32_t bytes_written;
+	//! Programs which exceeded flog_sim_timing_t::max_partial_programs
+	uint32_t nop_violations;
+	//! Programs which tried to set a cleared bit back to 1
+	uint32_t overwrite_violations;
+	//! Programs or erases which targeted a block marked bad
+	uint32_t bad_block_accesses;
+	//! Operations issued before a program started with flog_sim_commit_start()
+	//! was waited for
+	uint32_t busy_violations;
+	//! Pages started with flog_sim_read_ahead()
+	uint32_t read_aheads;
+	//! Page opens which found their page already loaded by a read ahead
+	uint32_t read_ahead_hits;
+	//! Sectors whose software ECC corrected a bit (see flog_sim_ecc_result())
+	uint32_t ecc_corrected;
+	//! Sectors with more errors than their software ECC could correct
+	uint32_t ecc_failed;
+	//! Total simulated time in nanoseconds
+	uint64_t time;
+} flog_sim_stats_t;
+
+/*!
+ @brief Get the default timing model
+ */
+flog_sim_timing_t flog_sim_default_timing();
+
+/*!
+ @brief Create (or recreate) the simulated part, completely erased
+ @param timing The latency model to use. NULL selects the defaults.
+ @retval FLOG_SUCCESS if the backing store could be allocated
+ */
+flog_result_t flog_sim_init(flog_sim_timing_t const * timing);
+
+/*!
+ @brief Release the simulated part
+ */
+void flog_sim_deinit();
+
+/*!
+ @brief Choose the part used by the calling thread
+ @param part The part, from 0 to FS_NUM_VOLUMES - 1
+ @retval FLOG_SUCCESS if there is such a part
+
+ There is one part for each volume, each with its own array, clock and
+ counters, and each thread starts out on part 0. Every other call here only
+ affects the selected part. The HAL selects the part of whichever volume
+ FLogFS is working on.
+ */
+flog_result_t flog_sim_select(uint8_t part);
+
+/*!
+ @brief Change the latency model without touching the array contents
+ */
+void flog_sim_set_timing(flog_sim_timing_t const * timing);
+
+/*!
+ @brief Simulate a power cycle
+
+ The array is preserved but the cache register is lost.
+ @retval FLOG_SUCCESS if the part has been created with flog_sim_init()
+ */
+flog_result_t flog_sim_power_on();
+
+/*!
+ @brief Mark a block as factory-bad
+ */
+void flog_sim_mark_bad(uint16_t block);
+
+/*!
+ @brief Flip one bit of the array, as a worn out cell would
+
+ The page has to be opened again to see it.
+ @param block The block
+ @param page The page within the block
+ @param offset The offset of the byte in the page (spare area included)
+ @param bit The bit within that byte
+ */
+void flog_sim_flip_bit(uint16_t block, uint16_t page, uint16_t offset,
+                       uint8_t bit);
+
+/*!
+ @brief Get a copy of the operation counters
+ */
+flog_sim_stats_t flog_sim_get_stats();
+
+/*!
+ @brief Reset the operation counters (not the clock)
+ */
+void flog_sim_clear_stats();
+
+/*!
+ @brief Get the simulated time in nanoseconds
+ */
+uint64_t flog_sim_time();
+
+/*!
+ @brief Advance the simulated clock by some amount of host-side work
+ */
+void flog_sim_advance(uint64_t ns);
+
+//! @name HAL entry points
+//! These are called by flogfs_conf_implement.sim.h
+//! @{
+void flog_sim_lock();
+void flog_sim_unlock();
+flog_result_t flog_sim_open_page(uint16_t block, uint16_t page);
+void flog_sim_close_page();
+flog_result_t flog_sim_read(uint8_t * dst, uint16_t offset, uint16_t n);
+uint8_t const * flog_sim_map(uint16_t offset, uint16_t n);
+flog_result_t flog_sim_write(uint8_t const * src, uint16_t offset, uint16_t n);
+flog_result_t flog_sim_commit();
+void flog_sim_commit_start();
+void flog_sim_commit_plane();
+void flog_sim_commit_cache();
+flog_result_t flog_sim_load_page(uint16_t block, uint16_t page);
+flog_result_t flog_sim_wait();
+flog_result_t flog_sim_wait_chip(uint8_t chip);
+flog_result_t flog_sim_erase_block(uint16_t block);
+void flog_sim_read_ahead(uint16_t block, uint16_t page);
+void flog_sim_ecc_result(flog_flash_read_result_t result);
+//! @}
+
+//! @} // FLogSim
+
+#if !FLOG_BUILD_CPP
+#ifdef __cplusplus
+};
+#endif
+#endif
+
+#endif // __FLOGFS_SIM_H_
@@ -37,6 +37,7 @@ either expressed or implied, of the FLogFS Project.
 #include "flogfs_private.h"
 #include "flogfs.h"
 
+#include <stddef.h>
 #include <string.h>
 
 #ifndef IS_DOXYGEN
@@ -58,25 +59,80 @@ typedef struct {
 	flog_block_age_t age;
 } flog_block_alloc_t;
 
-typedef struct {
-	//! Block indices and ages
-	flog_block_alloc_t blocks[FS_PREALLOCATE_SIZE];
-	//! The number of entries
-	uint16_t n;
-	//! The sum of all ages
-	flog_block_age_t age_sum;
-} flog_prealloc_list_t;
+/*!
+ @brief A block allocated to a write file which hasn't started it yet
 
+ Until its init sector is written, only the allocation record points to the
+ block. Mounting can only find that among the FS_DIRTY_BLOCKS most recent
+ allocations, so a dirty block is flushed before it gets any older.
+ */
 typedef struct {
 	flog_block_idx_t block;
+	flog_block_age_t age;
+	//! The block whose tail points to it (or FLOG_BLOCK_IDX_INVALID)
+	flog_block_idx_t previous;
 	flog_write_file_t * file;
+	//! The timestamp of its allocation record
+	flog_timestamp_t timestamp;
+	//! flogfs_t::num_allocations as of its allocation
+	uint32_t allocation;
 } flog_dirty_block_t;
 
+//! An allocation found while mounting
+typedef struct {
+	flog_block_idx_t block;
+	flog_block_age_t age;
+	union {
+	flog_file_id_t file_id;
+	flog_block_idx_t previous_inode;
+	};
+	flog_timestamp_t timestamp;
+	flog_block_type_t block_type;
+} flog_allocation_t;
+
 typedef struct {
 	flog_file_id_t file_id;
 	flog_block_idx_t first_block;
 } flog_file_find_result_t;
 
+#if FS_FILE_INDEX_SIZE
+/*!
+ @brief A file in the filename index
+ */
+typedef struct {
+	//! Hash of the filename, 0 for an empty slot
+	uint16_t hash;
+	//! The location of the inode entry
+	flog_block_idx_t inode_block;
+	uint16_t inode_sector;
+	flog_block_idx_t first_block;
+	flog_file_id_t file_id;
+} flog_file_index_entry_t;
+#endif
+
+#if FS_READ_CACHE_SIZE
+//! The number of bytes from the start of each sector kept in the read cache,
+//! enough for the largest header
+#define FLOG_READ_CACHE_BYTES (sizeof(flog_inode_file_allocation_t))
+
+/*!
+ @brief The start of a sector and its spare, kept in RAM
+ */
+typedef struct {
+	//! FLOG_BLOCK_IDX_INVALID for an unused entry
+	flog_block_idx_t block;
+	uint16_t sector;
+	//! flogfs_t::read_cache clock as of the last use, 0 if unused
+	uint32_t last_used;
+	//! The number of bytes of data read so far
+	uint16_t data_bytes;
+	//! Set once spare has been read
+	uint_fast8_t has_spare;
+	uint8_t spare[4];
+	uint8_t data[FLOG_READ_CACHE_BYTES];
+} flog_read_cache_entry_t;
+#endif
+
 /*!
  @brief The complete FLogFS state structure
  */
@@ -94,9 +150,6 @@ typedef struct {
 	//! The average block age in the file system
 	uint32_t mean_block_age;
 
-	//! A list of preallocated blocks for quick access
-	flog_prealloc_list_t prealloc;
-
 	//! The most recent timestamp (sequence number)
 	//! @note To put a stamp on a new operation, you should preincrement. This
 	//! is the timestamp of the most recent operation
@@ -106,17 +159,56 @@ typedef struct {
 	flog_block_idx_t inode0;
 	//! The number of files in the system
 	flog_file_id_t   num_files;
+	//! The number of inode entries belonging to deleted files
+	flog_file_id_t   num_dead_files;
+
+	//! @brief Inode chains of an unfinished flogfs_compact_inodes()
+	//! @note This must be protected under @ref flogfs_t::lock
+	struct {
+	//! A new chain which hasn't replaced flogfs_t::inode0 yet
+	flog_block_idx_t new_inode0;
+	//! A replaced chain which hasn't been released yet
+	flog_block_idx_t old_inode0;
+	//! Bumped whenever a new chain replaces the old one, which ends any
+	//! listing still walking it. Also changed under the flash lock.
+	uint16_t generation;
+	} compaction;
 
 	//! @brief Flash cache status
-	//! @note This must be protected under @ref flogfs_t::lock !
+	//! @note This must be protected under the flash lock
 	struct {
 	flog_block_idx_t current_open_block;
 	uint16_t         current_open_page;
 	uint_fast8_t     page_open;
 	flog_result_t    page_open_result;
+	//! One bit for each chip on which a program started by
+	//! flog_commit_start() may be running
+	uint_fast8_t     busy;
+#if FS_PLANES > 1
+	//! One bit for each chip holding pages for a multi-plane program
+	uint_fast8_t     queued;
+	//! The last page held, which the page of the next plane can join
+	flog_block_idx_t queued_block;
+	uint16_t         queued_page;
+#endif
 	} cache_status;
+
+#if FS_READ_CACHE_SIZE
+	//! @brief Recently read metadata sectors, behind the cache register
+	//! @note This must be protected under the flash lock
+	struct {
+	flog_read_cache_entry_t entries[FS_READ_CACHE_SIZE];
+	//! Incremented on every lookup to order the entries by use
+	uint32_t clock;
+	} read_cache;
+#endif
+	//! @note This must be protected under the flash lock
+	flog_read_cache_stats_t read_cache_stats;
 	
 	uint8_t free_block_bitmap[FS_NUM_BLOCKS / 8];
+	//! The age of each block as of its last erase, in the 3 little-endian
+	//! bytes of a flog_age_table_entry_t. Use flog_known_age() to read it.
+	uint8_t block_age[FS_NUM_BLOCKS][3];
 	
 	flog_block_age_t mean_free_age;
 	uint32_t free_block_sum;
@@ -124,26 +216,150 @@ typedef struct {
 	flog_block_idx_t num_free_blocks;
 	
 
-	//! A lock to serialize some FS operations
+	//! @name Locks
+	//! These are taken in the order lock, the flash lock, allocate_lock and
+	//! then delete_lock (an allocation can erase a deleted block).
+	//!
+	//! Reading and writing file data only takes the flash lock, and only for
+	//! one page (reading) or sector (writing) at a time, so a long transfer
+	//! doesn't hold up other files.
+	//! Each volume has its own locks, and its own flash lock through
+	//! flash_select(), so separate volumes never wait for each other.
+	//! The flash lock also covers the page cache (cache_status), the
+	//! checkpoint log and the erase queue, since nothing touches those
+	//! without going to the flash. A handle's own state is only changed under
+	//! the flash lock too: by calls on that handle, which must not be made
+	//! from two threads at once, or by flushes of its dirty block,
+	//! flogfs_maintain() and another file taking its pooled write buffer.
+	//! @{
+
+	//! Serializes changes to the inode table and the lists of open files
 	fs_lock_t lock;
 	//! A lock to block any allocation-related operations
 	fs_lock_t allocate_lock;
 	//! A lock to serialize deletion operations
 	fs_lock_t delete_lock;
+	//! @}
 
 	flog_timestamp_t t_allocation_ceiling;
 
-	//! The one dirty_block
+#if FS_WRITE_BUFFER_POOL_SIZE
+	//! @brief Write buffers lent to write files with data waiting
+	//! @note This must be protected under the flash lock
+	struct {
+	uint8_t buffers[FS_WRITE_BUFFER_POOL_SIZE]
+	               [FS_SECTOR_SIZE * FLOG_WRITE_BUFFER_SECTORS];
+	//! The file holding each buffer, or NULL if it's free
+	flog_write_file_t * owners[FS_WRITE_BUFFER_POOL_SIZE];
+	//! The buffer to take back next when they're all in use
+	uint16_t next_victim;
+	} write_buffers;
+#endif
+
+	//! @brief Blocks allocated to write files but not started yet
+	//! @note This may only be accessed under @ref flogfs_t::allocate_lock
+	flog_dirty_block_t dirty_blocks[FS_DIRTY_BLOCKS];
+	//! The number of blocks allocated since mounting
 	//! @note This may only be accessed under @ref flogfs_t::allocate_lock
-	flog_dirty_block_t dirty_block;
-	//! The moving allocator head
-	flog_block_idx_t allocate_head;
+	uint32_t num_allocations;
+
+#if FS_FREE_BLOCK_HEAP
+	//! @brief The free blocks in a binary min-heap by age
+	//! @note This must be protected under the flash lock. Allocations also
+	//! hold @ref flogfs_t::allocate_lock, but erases only flogfs_t::delete_lock.
+	struct {
+	flog_block_idx_t blocks[FS_NUM_BLOCKS];
+	uint16_t n;
+	} free_heap;
+#endif
+
+#if FS_FILE_INDEX_SIZE
+	//! @brief Filename index, an open-addressed hash table of valid files
+	//! @note This must be protected under @ref flogfs_t::lock
+	struct {
+	flog_file_index_entry_t entries[FS_FILE_INDEX_SIZE];
+	//! The number of files in entries
+	uint16_t n;
+	//! Set when a file didn't fit so misses must still search the inodes
+	uint_fast8_t overflow;
+	//! The first free inode entry
+	flog_inode_iterator_t inode_tail;
+	} file_index;
+#endif
+
+#if FS_TAIL_HINT_SIZE
+	//! @brief Where recently closed files ended, most recent first
+	//! @note This must be protected under @ref flogfs_t::lock
+	flog_tail_hint_t tail_hints[FS_TAIL_HINT_SIZE];
+#endif
+
+#if FS_ERASE_QUEUE_SIZE
+	//! @brief Deleted files whose blocks are still to be erased, oldest first
+	//! @note This must be protected under the flash lock
+	struct {
+	flog_erase_queue_entry_t entries[FS_ERASE_QUEUE_SIZE];
+	uint16_t n;
+	} erase_queue;
+#endif
+
+	//! @brief Checkpoint status
+	//! @note This must be protected under the flash lock
+	struct {
+	//! The two reserved blocks, FLOG_BLOCK_IDX_INVALID if the volume has none
+	flog_block_idx_t blocks[2];
+	//! The block age table paired with each of blocks
+	flog_block_idx_t age_tables[2];
+	//! The index in blocks of the newest record
+	uint_fast8_t     active;
+	//! Whether the active block holds a complete record to log against
+	uint_fast8_t     valid;
+	//! The sequence number of the newest record
+	uint32_t         sequence;
+	//! The next free delta sector in the active block
+	uint16_t         next_sector;
+	} checkpoint;
 } flogfs_t;
 
 
 
+#if FS_NUM_VOLUMES > 1
+//! Every volume
+static flogfs_t flogfs_volumes[FS_NUM_VOLUMES];
+//! The volume chosen by each thread with flogfs_select()
+static FLOG_THREAD_LOCAL uint8_t flog_selected_volume;
+//! The volume each thread is working on, set by every public call
+static FLOG_THREAD_LOCAL flogfs_t * flog_volume = &flogfs_volumes[0];
+//! Everything else only ever works on the current volume
+#define flogfs (*flog_volume)
+//! The volume an open file or ls iterator belongs to
+#define FLOG_VOLUME_OF(handle) ((handle)->volume)
+#else
 //! A single static instance
 static flogfs_t flogfs;
+#define FLOG_VOLUME_OF(handle) (0)
+#endif
+
+/*!
+ @brief Start working on a volume from this thread
+ @param volume The volume, ignored with only one
+ */
+static inline void flog_enter_volume(uint8_t volume){
+#if FS_NUM_VOLUMES > 1
+	flog_volume = &flogfs_volumes[volume];
+	flash_select(volume);
+#else
+	(void)volume;
+#endif
+}
+
+/*!
+ @brief Start working on the volume selected by this thread
+ */
+static inline void flog_enter_selected_volume(){
+#if FS_NUM_VOLUMES > 1
+	flog_enter_volume(flog_selected_volume);
+#endif
+}
 
 static inline void flog_lock_fs(){fs_lock(&flogfs.lock);}
 static inline void flog_unlock_fs(){fs_unlock(&flogfs.lock);}
@@ -154,22 +370,204 @@ static inline void flog_unlock_allocate(){fs_unlock(&flogfs.allocate_lock);}
 static inline void flog_lock_delete(){fs_lock(&flogfs.delete_lock);}
 static inline void flog_unlock_delete(){fs_unlock(&flogfs.delete_lock);}
 
+static inline uint_fast8_t flog_block_is_free(flog_block_idx_t block){
+	return (flogfs.free_block_bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+static inline void flog_update_mean_free_age(){
+	flogfs.mean_free_age = flogfs.num_free_blocks ?
+	   flogfs.free_block_sum / flogfs.num_free_blocks : 0;
+}
 
 /*!
- @brief Go find a suitable free block to use
- @return A block. The index will be FLOG_BLOCK_IDX_INVALID if invalid.
+ @brief Get the age of a block as of its last erase, without reading it
+ */
+static inline flog_block_age_t flog_known_age(flog_block_idx_t block){
+	return flogfs.block_age[block][0] |
+	       (flogfs.block_age[block][1] << 8) |
+	       ((flog_block_age_t)flogfs.block_age[block][2] << 16);
+}
+
+/*!
+ @brief Remember the age of a block, as far as FLOG_AGE_TABLE_MAX_AGE
+ */
+static inline void flog_set_known_age(flog_block_idx_t block,
+                                      flog_block_age_t age){
+	age = MIN(age, FLOG_AGE_TABLE_MAX_AGE);
+	flogfs.block_age[block][0] = age & 0xFF;
+	flogfs.block_age[block][1] = (age >> 8) & 0xFF;
+	flogfs.block_age[block][2] = age >> 16;
+}
+
+#if FS_FREE_BLOCK_HEAP
+//! The age of the block at a position in the free block heap
+static inline flog_block_age_t flog_free_heap_age(uint16_t i){
+	return flog_known_age(flogfs.free_heap.blocks[i]);
+}
 
- This attempts to claim a block from the block preallocation list and searches
- for a new one of the list is empty
+static inline void flog_free_heap_sift_down(uint16_t i){
+	flog_block_idx_t const block = flogfs.free_heap.blocks[i];
+	flog_block_age_t const age = flog_known_age(block);
 
- @note This requires flogfs_t::allocate_lock
+	while(1){
+		uint16_t child = 2 * i + 1;
+		if(child >= flogfs.free_heap.n){
+			break;
+		}
+		if((child + 1 < flogfs.free_heap.n) &&
+		   (flog_free_heap_age(child + 1) < flog_free_heap_age(child))){
+			child += 1;
+		}
+		if(age <= flog_free_heap_age(child)){
+			break;
+		}
+		flogfs.free_heap.blocks[i] = flogfs.free_heap.blocks[child];
+		i = child;
+	}
+	flogfs.free_heap.blocks[i] = block;
+}
+
+/*!
+ @brief Add a free block to the heap, keyed by its flogfs_t::block_age
+ */
+static inline void flog_free_heap_push(flog_block_idx_t block){
+	flog_block_age_t const age = flog_known_age(block);
+	uint16_t i;
+
+	if(flogfs.free_heap.n == FS_NUM_BLOCKS){
+		return;
+	}
+	for(i = flogfs.free_heap.n++; i > 0; i = (i - 1) / 2){
+		if(flog_free_heap_age((i - 1) / 2) <= age){
+			break;
+		}
+		flogfs.free_heap.blocks[i] = flogfs.free_heap.blocks[(i - 1) / 2];
+	}
+	flogfs.free_heap.blocks[i] = block;
+}
+
+/*!
+ @brief Take the youngest free block from the heap
+ @return The block, FLOG_BLOCK_IDX_INVALID if there are none
+
+ Blocks claimed some other way while mounting may still be in the heap until
+ it's rebuilt, so anything no longer free is skipped.
+ */
+static inline flog_block_idx_t flog_free_heap_pop(){
+	flog_block_idx_t block;
+
+	while(flogfs.free_heap.n){
+		block = flogfs.free_heap.blocks[0];
+		flogfs.free_heap.n -= 1;
+		if(flogfs.free_heap.n){
+			flogfs.free_heap.blocks[0] =
+			   flogfs.free_heap.blocks[flogfs.free_heap.n];
+			flog_free_heap_sift_down(0);
+		}
+		if(flog_block_is_free(block)){
+			return block;
+		}
+	}
+	return FLOG_BLOCK_IDX_INVALID;
+}
+
+/*!
+ @brief Rebuild the heap from the free block bitmap
+ */
+static inline void flog_free_heap_build(){
+	flogfs.free_heap.n = 0;
+	for(flog_block_idx_t block = 0; block < FS_NUM_BLOCKS; block++){
+		if(flog_block_is_free(block)){
+			flogfs.free_heap.blocks[flogfs.free_heap.n++] = block;
+		}
+	}
+	for(uint16_t i = flogfs.free_heap.n / 2; i > 0; i--){
+		flog_free_heap_sift_down(i - 1);
+	}
+}
+#else
+/*!
+ @brief Find the youngest free block by looking at every one
+ @return The block, FLOG_BLOCK_IDX_INVALID if there are none
+ */
+static inline flog_block_idx_t flog_free_block_youngest(){
+	flog_block_idx_t youngest = FLOG_BLOCK_IDX_INVALID;
+	flog_block_age_t youngest_age = FLOG_BLOCK_AGE_INVALID;
+
+	for(flog_block_idx_t i = 0; i < FS_NUM_BLOCKS / 8; i++){
+		if(flogfs.free_block_bitmap[i] == 0){
+			continue;
+		}
+		for(flog_block_idx_t block = i * 8; block < (i + 1) * 8; block++){
+			if(flog_block_is_free(block) &&
+			   (flog_known_age(block) < youngest_age)){
+				youngest = block;
+				youngest_age = flog_known_age(block);
+			}
+		}
+	}
+	return youngest;
+}
+#endif
+
+/*!
+ @brief Remove a block from the free block accounting once it is in use
+
+ With FS_FREE_BLOCK_HEAP, this leaves the block in the heap. After mounting,
+ blocks are only claimed through flog_allocate_block(), which has already
+ taken it out.
+ */
+static inline void flog_claim_free_block(flog_block_idx_t block,
+                                         flog_block_age_t age){
+	if(!flog_block_is_free(block)){
+		return;
+	}
+	flogfs.free_block_bitmap[block / 8] &= ~(1 << (block % 8));
+	flogfs.num_free_blocks -= 1;
+	flogfs.free_block_sum -= age;
+	flog_update_mean_free_age();
+}
+
+/*!
+ @brief Return a block to the free block accounting
+ @param block The block
+ @param age Its age as of the erase that freed it
+ */
+static inline void flog_release_block(flog_block_idx_t block,
+                                      flog_block_age_t age){
+	if(flog_block_is_free(block)){
+		return;
+	}
+	flogfs.free_block_bitmap[block / 8] |= 1 << (block % 8);
+	flog_set_known_age(block, age);
+	flogfs.num_free_blocks += 1;
+	flogfs.free_block_sum += age;
+	flog_update_mean_free_age();
+#if FS_FREE_BLOCK_HEAP
+	flog_free_heap_push(block);
+#endif
+}
+
+/*!
+ @brief Keep flogfs_t::t at the newest valid timestamp seen while mounting
  */
-static flog_block_alloc_t flog_allocate_block(int32_t threshold);
+static inline void flog_update_max_timestamp(flog_timestamp_t timestamp){
+	if((timestamp != FLOG_TIMESTAMP_INVALID) && (timestamp > flogfs.t)){
+		flogfs.t = timestamp;
+	}
+}
+
 
 /*!
- @brief Iterate the block allocation routine and return the result
+ @brief Claim the youngest free block
+ @return A block. The index will be FLOG_BLOCK_IDX_INVALID if invalid.
+
+ The free blocks are kept in a heap by age, so this takes no flash accesses
+ unless deleted files have to be erased to make room.
+
+ @note This requires flogfs_t::allocate_lock
  */
-static flog_block_alloc_t flog_allocate_block_iterate();
+static flog_block_alloc_t flog_allocate_block();
 
 /*!
  @brief Get the next block entry from any valid block
@@ -184,14 +582,6 @@ static inline flog_block_idx_t
 flog_universal_get_next_block(flog_block_idx_t block);
 
 
-/*!
- @brief Perform an iteration of the preallocator. Basically check one block as
- a candidate.
-
- @note This requires the allocation lock, \ref flogfs_t::allocate_lock
- */
-static inline void flog_prealloc_iterate();
-
 /*!
  @brief Find a file inode entry
  @param[in] filename The filename to check for
@@ -216,9 +606,100 @@ static inline flog_result_t flog_open_page(uint16_t block, uint16_t page);
  */
 static inline flog_result_t flog_open_sector(uint16_t block, uint16_t sector);
 
+#if FS_CACHE_PROGRAM
+/*!
+ @brief Start filling the page of a sector for a program without reading it
+
+ A cache program still running on the chip doesn't have to finish first.
+ Nothing can be read from the page until it's opened again.
+ */
+static void flog_load_sector(flog_block_idx_t block, uint16_t sector);
+#endif
 
 static void flog_close_sector();
 
+/*!
+ @brief Commit the open page, leaving it to program in the background if
+ FS_ASYNC_FLASH is set
+
+ Everything which touches the flash after this goes through flog_open_sector()
+ or flog_close_sector(), which wait for it.
+ */
+static void flog_commit_start();
+
+/*!
+ @brief Wait for every program started by flog_commit_start(), if any
+ */
+static void flog_flash_wait();
+
+//! The chip holding a page when blocks are striped (see FS_STRIPE_CHIPS)
+#define FLOG_PAGE_CHIP(page) ((page) / FS_PLANES % FS_STRIPE_CHIPS)
+//! The plane holding a page (see FS_PLANES)
+#define FLOG_PAGE_PLANE(page) ((page) % FS_PLANES)
+
+/*!
+ @brief Wait for a program started by flog_commit_start() on one chip, if any
+ */
+static void flog_flash_wait_chip(uint_fast8_t chip);
+
+#if FS_PLANES > 1
+/*!
+ @brief Check whether a page is the next plane of the multi-plane program
+ waiting on its chip, so it can be opened without sending that out first
+ */
+static uint_fast8_t flog_page_joins_planes(flog_block_idx_t block,
+                                           uint16_t page);
+
+/*!
+ @brief Program any pages held for multi-plane programs on their own
+ */
+static void flog_flash_send_planes();
+#endif
+
+/*!
+ @brief Commit the open page and wait for it
+ */
+static void flog_commit();
+
+/*!
+ @brief Erase a block
+ */
+static flog_result_t flog_erase_block(flog_block_idx_t block);
+
+/*!
+ @brief Read from the start of a sector through the read cache
+ @param block The block
+ @param sector The sector
+ @param dst The destination
+ @param offset The offset in the sector
+ @param n The number of bytes
+
+ This is meant for headers. Reads which don't fit in FLOG_READ_CACHE_BYTES go
+ straight to the flash.
+ */
+static flog_result_t flog_read_cached(flog_block_idx_t block, uint16_t sector,
+                                      void * dst, uint16_t offset, uint16_t n);
+
+/*!
+ @brief Read the spare of a sector through the read cache
+ */
+static flog_result_t flog_read_spare_cached(flog_block_idx_t block,
+                                            uint16_t sector, void * dst);
+
+#if FS_READ_CACHE_SIZE
+/*!
+ @brief Drop the cached sectors of a page
+ @param block The block
+ @param page The page, or FS_PAGES_PER_BLOCK for the whole block
+ */
+static void flog_read_cache_drop(flog_block_idx_t block, uint16_t page);
+#endif
+
+/*!
+ @brief Empty the read cache and clear its counters
+ */
+static void flog_read_cache_reset();
+
 /*!
  @brief Initialize an inode iterator
  @param[in,out] iter The iterator structure
@@ -259,24 +740,66 @@ static flog_result_t flog_inode_prepare_new(flog_inode_iterator_t * iter);
  */
 static inline uint16_t flog_increment_sector(uint16_t sector);
 
-static flog_result_t flog_flush_write(flog_write_file_t * file);
+/*!
+ @brief Get the offset of the first data byte in a file sector
+ */
+static inline uint16_t flog_sector_data_offset(uint16_t sector){
+	switch(sector){
+	case FLOG_TAIL_SECTOR:
+		return sizeof(flog_file_tail_sector_header_t);
+	case FLOG_INIT_SECTOR:
+		return sizeof(flog_file_init_sector_header_t);
+	default:
+		return 0;
+	}
+}
+
+#if FS_READ_AHEAD
+/*!
+ @brief Check if a file sector holds the first data a file reads from a page
+ */
+static inline uint_fast8_t flog_sector_starts_page(uint16_t sector){
+	return (sector == FLOG_INIT_SECTOR) || (sector == FLOG_TAIL_SECTOR) ||
+	       (sector % FS_SECTORS_PER_PAGE == 0);
+}
 
 /*!
- @brief Add a free block candidate to the preallocation list
+ @brief Start loading the page a file reads after the one holding a sector
+ @param block The block being read
+ @param sector The sector being read
 
- @note This requires the allocation lock
+ After the tail sector this is the first page of the next block.
  */
-static void flog_prealloc_push(flog_block_idx_t block,
-                               flog_block_age_t age);
+static void flog_read_ahead(flog_block_idx_t block, uint16_t sector);
+#endif
+
+static flog_result_t flog_flush_write(flog_write_file_t * file);
 
 /*!
- @brief Take the youngest block from the preallocation list
- @retval Index The allocated block index
- @retval FLOG_BLOCK_IDX_INVALID if empty
+ @brief Write to a file up to the end of its current sector
+ @param file The file
+ @param src The data
+ @param nbytes The number of bytes available at src
+ @return The number of bytes taken, or 0 if the sector couldn't be committed
 
- @note This requires the allocation lock
+ The flash has to be held.
  */
-static flog_block_alloc_t flog_prealloc_pop(int32_t threshold);
+static uint32_t flog_write_file_data(flog_write_file_t * file,
+                                     uint8_t const * src, uint32_t nbytes);
+
+/*!
+ @brief Read from a file, either into a buffer or to a visitor in place
+ @param file The file
+ @param dst The buffer, if there's no visitor
+ @param nbytes The most bytes to read
+ @param visitor The visitor, or NULL to copy into dst
+ @param context Passed to the visitor
+ @return The number of bytes read
+ */
+static uint32_t flog_read_file_data(flog_read_file_t * file, uint8_t * dst,
+                                    uint32_t nbytes,
+                                    flogfs_read_visitor_t visitor,
+                                    void * context);
 
 /*!
  @brief Invalidate a chain of blocks
@@ -285,60 +808,441 @@ static flog_block_alloc_t flog_prealloc_pop(int32_t threshold);
 static void
 flog_invalidate_chain(flog_block_idx_t base, flog_file_id_t file_id);
 
+#if FS_ERASE_QUEUE_SIZE
 /*!
- @brief Check for a dirty block and flush it to allow for a new allocation
+ @brief Erase a block and give it back to the allocator
+ @param block The block
+ @param age The age it was allocated with, which it keeps while free
+ @param next_block The next block in its chain for the stat sector
 
- @note This requires the allocation lock
+ The stat sector is stamped with flogfs_t::t.
+
+ @note This requires the flash lock, and flogfs_t::delete_lock once mounted
  */
-static void flog_flush_dirty_block();
+static void flog_erase_free_block(flog_block_idx_t block, flog_block_age_t age,
+                                  flog_block_idx_t next_block);
 
 /*!
- @brief check to see if a block is sufficiently new against a threshold
- @retval 1 if okay
- @retval 0 if too old
+ @brief Add a deleted file to the erase queue without logging it
+ @param file_id The file
+ @param block The first block left in its chain
+ @retval FLOG_SUCCESS if it's now queued (or already was)
+ @retval FLOG_FAILURE if the queue is full
+
+ @note This requires the flash lock
  */
-static uint_fast8_t
-flog_age_is_sufficient(int32_t threshold, flog_block_age_t age);
+static flog_result_t flog_erase_queue_add(flog_file_id_t file_id,
+                                          flog_block_idx_t block);
 
-static flog_result_t flog_commit_file_sector(flog_write_file_t * file,
-                                             uint8_t const * data,
-                                             flog_sector_nbytes_t n);
+/*!
+ @brief Check if a deleted file still has blocks waiting in the erase queue
+ @note This requires the flash lock
+ */
+static uint_fast8_t flog_erase_queue_has(flog_file_id_t file_id);
 
-static flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block);
+/*!
+ @brief Move a queued chain on to its next block, dropping it at the end
+ @note This requires the flash lock
+ */
+static void flog_erase_queue_advance(flog_file_id_t file_id,
+                                     flog_block_idx_t next_block);
 
-static flog_block_age_t flog_block_get_age(flog_block_idx_t block);
+/*!
+ @brief Queue the chain of a deleted file to be erased later
 
-static void flog_get_file_tail_sector(flog_block_idx_t block,
-                                      flog_file_tail_sector_header_t * header);
+ The oldest chains are finished first if the queue is full. Without a
+ checkpoint to record the queue in, the chain is invalidated right away.
 
-static void flog_get_file_init_sector(flog_block_idx_t block,
-                                      flog_file_init_sector_header_t * header);
+ @note This requires the flash lock. It takes flogfs_t::delete_lock.
+ */
+static void flog_erase_queue_push(flog_file_id_t file_id,
+                                  flog_block_idx_t first_block);
 
-static void
-flog_get_universal_tail_sector(flog_block_idx_t block,
-                               flog_universal_tail_sector_t * header);
+/*!
+ @brief Erase the next block of the oldest queued chain
+ @retval FLOG_SUCCESS if a block was erased or a finished chain dropped
+ @retval FLOG_FAILURE if the queue is empty
 
-static flog_block_type_t
-flog_get_block_type(flog_block_idx_t block);
+ @note This requires the flash lock. It takes flogfs_t::delete_lock, so an
+       allocation can call it under flogfs_t::allocate_lock.
+ */
+static flog_result_t flog_erase_queue_step();
 
-static flog_file_id_t
-flog_block_get_file_id(flog_block_idx_t block);
+/*!
+ @brief Free every block of the queued files by scanning for them
 
-static void
-flog_write_block_stat(flog_block_idx_t block,
-                      flog_block_stat_sector_t const * stat);
+ After mounting without a checkpoint there is nothing to say where a queued
+ chain continues. Each entry holds the last block of its file instead, which
+ is freed after all of the others so that the next mount still sees the file
+ as unfinished if this is interrupted.
 
-static void
-flog_get_block_stat(flog_block_idx_t block, flog_block_stat_sector_t * stat);
+ @note This is only for mounting, which holds the FS lock and the flash lock
+ */
+static void flog_erase_queue_scan();
+#endif
 
-//! @}
+/*!
+ @brief Flush the dirty blocks which would be too old after a new allocation
+
+ @note This takes the allocation lock, so it has to be called before the
+       allocation
+ */
+static void flog_flush_dirty_blocks();
+
+/*!
+ @brief Remember a block allocated to a write file until the file starts it
+ @param block The block
+ @param age Its age before the allocation, as logged
+ @param previous The block whose tail points to it, or FLOG_BLOCK_IDX_INVALID
+                 if it's the first block of the file
+ @param file The file, with its ID set
+
+ This must be done after the allocation is logged, so that a new checkpoint
+ record written in the meantime doesn't log it again before it's referenced.
+
+ @note This requires the allocation lock
+ */
+static void flog_dirty_block_add(flog_block_idx_t block,
+                                 flog_block_age_t age,
+                                 flog_block_idx_t previous,
+                                 flog_write_file_t * file);
+
+#if FS_ERASE_QUEUE_SIZE
+/*!
+ @brief Check if a block is waiting to be started by an open write file
+ @note This requires the flash lock, which every change to the table holds
+ */
+static uint_fast8_t flog_dirty_block_owned(flog_block_idx_t block);
+#endif
+
+/*!
+ @brief Forget the dirty block of a file once it has been started
+ @note This requires the allocation lock
+ */
+static void flog_dirty_block_remove(flog_write_file_t * file);
+
+/*!
+ @brief Forget every dirty block
+ */
+static void flog_dirty_blocks_reset();
+
+/*!
+ @brief Keep an allocation found while mounting if it's one of the most recent
+ @param recent The FS_DIRTY_BLOCKS most recent allocations so far, newest first
+ @param allocation The allocation
+ */
+static void flog_allocation_note(flog_allocation_t * recent,
+                                 flog_allocation_t const * allocation);
+
+/*!
+ @brief Drop a block from the most recent allocations once it's been freed
+ */
+static void flog_allocation_forget(flog_allocation_t * recent,
+                                   flog_block_idx_t block);
+
+/*!
+ @brief Check if a write file holds data which hasn't been programmed yet
+ */
+static uint_fast8_t flog_write_file_is_buffered(flog_write_file_t const * file);
+
+/*!
+ @brief Finish the current sector of a write file
+
+ With FS_PAGE_WRITE_BUFFER, a full sector followed by another in the same page
+ is only buffered. It gets programmed along with the rest of the page.
+ @param file The file
+ @param data Data to append to what is already buffered
+ @param n The number of bytes of data
+ */
+static flog_result_t flog_commit_file_sector(flog_write_file_t * file,
+                                             uint8_t const * data,
+                                             flog_sector_nbytes_t n);
+
+/*!
+ @brief Get the buffer for the current sector of a write file
+ @return The buffer, or NULL with FS_WRITE_BUFFER_POOL_SIZE if the file
+         doesn't hold one
+ */
+static inline uint8_t * flog_write_file_buffer(flog_write_file_t * file);
+
+#if FS_WRITE_BUFFER_POOL_SIZE
+/*!
+ @brief Make sure a write file holds a buffer from the pool
+ @param file The file
+ @param steal Whether to flush another file to free a buffer if there are none
+ @retval FLOG_SUCCESS if the file has a buffer
+ */
+static flog_result_t flog_write_buffer_get(flog_write_file_t * file,
+                                           uint_fast8_t steal);
+
+/*!
+ @brief Give a write file's buffer back to the pool, if it holds one
+ */
+static void flog_write_buffer_put(flog_write_file_t * file);
+
+/*!
+ @brief Mark every pooled write buffer as free
+ */
+static void flog_write_buffers_reset();
+#endif
+
+static flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block);
+
+static flog_block_age_t flog_block_get_age(flog_block_idx_t block);
+
+static void flog_get_file_tail_sector(flog_block_idx_t block,
+                                      flog_file_tail_sector_header_t * header);
+
+static void flog_get_file_init_sector(flog_block_idx_t block,
+                                      flog_file_init_sector_header_t * header);
+
+static void
+flog_get_universal_tail_sector(flog_block_idx_t block,
+                               flog_universal_tail_sector_t * header);
+
+static flog_block_type_t
+flog_get_block_type(flog_block_idx_t block);
+
+static flog_file_id_t
+flog_block_get_file_id(flog_block_idx_t block);
+
+static void
+flog_write_block_stat(flog_block_idx_t block,
+                      flog_block_stat_sector_t const * stat);
+
+static void
+flog_get_block_stat(flog_block_idx_t block, flog_block_stat_sector_t * stat);
+
+/*!
+ @brief Locate the reserved checkpoint blocks (the first two good blocks)
+ @retval FLOG_SUCCESS if the volume has checkpoint blocks
+ */
+static flog_result_t flog_checkpoint_find();
+
+/*!
+ @brief Check if a block is one of the four reserved by flog_checkpoint_find()
+ */
+static inline uint_fast8_t flog_checkpoint_is_reserved(flog_block_idx_t block){
+	return (block == flogfs.checkpoint.blocks[0]) ||
+	       (block == flogfs.checkpoint.blocks[1]) ||
+	       (block == flogfs.checkpoint.age_tables[0]) ||
+	       (block == flogfs.checkpoint.age_tables[1]);
+}
+
+/*!
+ @brief Restore the allocator state from the newest checkpoint and its log
+ @param recent The most recent allocations, updated with the logged ones which
+               are still allocated and referenced by their owner
+ @retval FLOG_SUCCESS if a complete record was found
+ @retval FLOG_FAILURE if there was none, or the log couldn't be replayed. In
+                      the latter case the state is partly restored and the
+                      records are invalidated.
+
+ @note This is only for mounting, which holds the FS lock and the flash lock
+ */
+static flog_result_t flog_checkpoint_load(flog_allocation_t * recent);
+
+/*!
+ @brief Write a complete record to the other checkpoint block
+
+ @note This requires the flash lock. A write which fills the log gets here
+       holding nothing else.
+ */
+static flog_result_t flog_checkpoint_write();
+
+/*!
+ @brief Kill both records so that mount falls back to a full scan
+
+ This is used when a change can't be logged, or to force a scan. The older
+ record has to go too, or mount would pick it up instead. The marker can
+ always be programmed from flog_copy_complete_marker (or an erased sector)
+ to 0.
+
+ @note This requires the flash lock
+ */
+static void flog_checkpoint_invalidate();
+
+/*!
+ @brief Append a change in the allocator state to the checkpoint log
+
+ A new record is written when the active block fills up.
+
+ @note This requires the flash lock. Writes log their allocations holding
+       nothing else.
+ */
+static void flog_checkpoint_log(flog_checkpoint_delta_type_t type,
+                                flog_block_type_t block_type,
+                                flog_block_idx_t block,
+                                flog_block_age_t age,
+                                uint32_t owner,
+                                flog_block_idx_t previous);
+
+/*!
+ @brief Write a delta to the next sector of a checkpoint block
+ @param block The checkpoint block being logged to
+ @param delta The delta, which gets its check byte here
+
+ @note This requires the flash lock
+ */
+static void flog_checkpoint_append(flog_block_idx_t block,
+                                   flog_checkpoint_delta_t * delta);
+
+#if FS_FILE_INDEX_SIZE
+/*!
+ @brief Hash a filename for the filename index
+ @return A hash which is never 0
+ */
+static uint16_t flog_file_index_hash(char const * filename);
+
+/*!
+ @brief Add a file to the filename index
+
+ If the index is full, flogfs_t::file_index::overflow is set instead.
+ */
+static void flog_file_index_add(char const * filename,
+                                flog_block_idx_t inode_block,
+                                uint16_t inode_sector,
+                                flog_block_idx_t first_block,
+                                flog_file_id_t file_id);
+
+/*!
+ @brief Remove a file from the filename index, if present
+ */
+static void flog_file_index_remove(char const * filename,
+                                   flog_file_id_t file_id);
+#endif
+
+/*!
+ @brief Get the block which replaced an inode chain
+ @param inode0 The first block of the chain
+ @return The first block of the replacement or FLOG_BLOCK_IDX_INVALID
+ */
+static flog_block_idx_t flog_inode_get_replacement(flog_block_idx_t inode0);
+
+/*!
+ @brief Free the blocks of an inode chain left behind by compaction
+
+ The chain is freed from its end so that this can pick up again after an
+ interruption. The first block goes last.
+ @param inode0 The first block of the chain
+ @param split The init timestamp of the first block of the new chain
+ @param newer Whether this is the new chain (blocks started at or after
+              split) rather than the replaced one (blocks started before)
+ */
+static void flog_inode_release_chain(flog_block_idx_t inode0,
+                                     flog_timestamp_t split,
+                                     uint_fast8_t newer);
+
+/*!
+ @brief Finish whatever an interrupted compaction left behind
+ */
+static void flog_inode_compact_recover();
+
+#if FS_FILE_INDEX_SIZE
+/*!
+ @brief Rebuild the filename index from the inode chain
+ */
+static void flog_file_index_rebuild();
+#endif
+
+/*!
+ @brief Move the read head of a file to an offset
+
+ The walk starts from the closest block already known to come before the
+ offset: the current one, one in the seek index or the first.
+ @param file The file, with flog_read_file_t::first_block set
+ @param index The offset from the start of the file
+ @retval FLOG_SUCCESS if the offset is in the file
+ @retval FLOG_FAILURE if the file is shorter. The read head is left at the end.
+ */
+static flog_result_t flog_read_file_locate(flog_read_file_t * file,
+                                           uint32_t index);
+
+#if FS_TAIL_HINT_SIZE
+/*!
+ @brief Look up the tail hint of a file and make sure it's still usable
+
+ The hinted block has to belong to the file. An unwritten init sector is only
+ accepted if the hint says nothing has been written to the block yet.
+ @param file_id The file
+ @param hint Filled with the hint
+ @retval FLOG_SUCCESS if there is a usable hint
+ */
+static flog_result_t flog_tail_hint_get(flog_file_id_t file_id,
+                                        flog_tail_hint_t * hint);
+
+/*!
+ @brief Remember where a write file ends
+ */
+static void flog_tail_hint_set(flog_write_file_t const * file);
+
+/*!
+ @brief Forget the tail hint of a file, if it has one
+ */
+static void flog_tail_hint_remove(flog_file_id_t file_id);
+#endif
+
+#if FS_SEEK_INDEX_SIZE
+/*!
+ @brief Remember the current block of a read file if the index wants it
+
+ When the index fills up, every other entry is dropped and the stride doubles.
+ */
+static void flog_seek_index_add(flog_read_file_t * file);
+#endif
+
+/*!
+ @brief Erase a reserved block, keeping its age up to date
+
+ @note This requires the flash lock
+ */
+static flog_result_t flog_reset_reserved_block(flog_block_idx_t block);
+
+/*!
+ @brief Write the age of every block to a block age table
+ @param block The block age table to use
+ @param sequence The sequence number of the checkpoint record it goes with
+
+ @note This requires the flash lock
+ */
+static flog_result_t flog_age_table_write(flog_block_idx_t block,
+                                          uint32_t sequence);
+
+/*!
+ @brief Read the age of every block from a block age table
+ @param block The block age table to use
+ @param sequence The sequence number of the checkpoint record it must match
+ @retval FLOG_SUCCESS if the table was complete and matched
+
+ @note This is only for mounting, which holds the FS lock and the flash lock
+ */
+static flog_result_t flog_age_table_load(flog_block_idx_t block,
+                                         uint32_t sequence);
+
+//! @}
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// Public implementations
-///////////////////////////////////////////////////////////////////////////////
+// Public implementations
+///////////////////////////////////////////////////////////////////////////////
+
+#if FS_NUM_VOLUMES > 1
+flog_result_t flogfs_select(uint8_t volume){
+	if(volume >= FS_NUM_VOLUMES){
+		return FLOG_FAILURE;
+	}
+	flog_selected_volume = volume;
+	return FLOG_SUCCESS;
+}
+
+uint8_t flogfs_selected(){
+	return flog_selected_volume;
+}
+#endif
 
 flog_result_t flogfs_init(){
+	flog_enter_selected_volume();
+
 	// Initialize locks
 	fs_lock_init(&flogfs.allocate_lock);
 	fs_lock_init(&flogfs.lock);
@@ -346,17 +1250,28 @@ flog_result_t flogfs_init(){
 
 	flogfs.state = FLOG_STATE_RESET;
 	flogfs.cache_status.page_open = 0;
-	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+	flog_read_cache_reset();
+	flog_dirty_blocks_reset();
+#if FS_WRITE_BUFFER_POOL_SIZE
+	flog_write_buffers_reset();
+#endif
 	return flash_init();
 }
 
 flog_result_t flogfs_format(){
 	flog_block_idx_t i;
-	flog_block_idx_t first_valid = FLOG_BLOCK_IDX_INVALID;
+	// The first five valid blocks: two checkpoint blocks, two block age
+	// tables and the inode table
+	flog_block_idx_t first_valid[5];
+	uint_fast8_t num_valid = 0;
 
 	union {
 		flog_inode_init_sector_t main_buffer;
 		flog_inode_init_sector_spare_t spare_buffer;
+		flog_checkpoint_init_sector_t checkpoint_buffer;
+		flog_checkpoint_init_sector_spare_t checkpoint_spare_buffer;
+		flog_age_table_init_sector_t age_table_buffer;
+		flog_age_table_sector_spare_t age_table_spare_buffer;
         } buffer_union;
 	
 	struct {
@@ -364,12 +1279,15 @@ flog_result_t flogfs_format(){
 		char key[sizeof(flog_block_stat_key)];
 	} stat_sector;
 	
-	flash_lock();
+	flog_enter_selected_volume();
+
 	flog_lock_fs();
+	flash_lock();
 	
 	if(flogfs.state == FLOG_STATE_MOUNTED){
 		flogfs.state = FLOG_STATE_RESET;
 	}
+	flog_read_cache_reset();
 
 	for(i = 0; i < FS_NUM_BLOCKS; i++){
 		flog_open_page(i, 0);
@@ -390,36 +1308,70 @@ flog_result_t flogfs_format(){
 		stat_sector.stat.timestamp = 0;
 		flog_close_sector();
 		// Go erase it
-		if(FLOG_FAILURE == flash_erase_block(i)){
-			flog_unlock_fs();
+		if(FLOG_FAILURE == flog_erase_block(i)){
 			flash_unlock();
+			flog_unlock_fs();
 			flash_debug_error("FLogFS:" LINESTR);
 			return FLOG_FAILURE;
 		}
 		flog_open_sector(i, FLOG_BLK_STAT_SECTOR);
 		flash_write_sector((uint8_t *)&stat_sector, FLOG_BLK_STAT_SECTOR,
 		                   0, sizeof(stat_sector));
-		flash_commit();
-		if(first_valid == FLOG_BLOCK_IDX_INVALID){
-			first_valid = i;
+		flog_commit();
+		flog_set_known_age(i, stat_sector.stat.age);
+		if(num_valid < 5){
+			first_valid[num_valid++] = i;
 		}
 	}
 
-	// Really just assuming that at least 1 valid block was found
+	// Really just assuming that at least 5 valid blocks were found
+
+	// Reserve the checkpoint blocks. There is no record until the first
+	// mount has scanned the volume.
+	for(i = 0; i < 2; i++){
+		flog_open_sector(first_valid[i], FLOG_INIT_SECTOR);
+		buffer_union.checkpoint_buffer.sequence = 0;
+		flash_write_sector((const uint8_t *)&buffer_union.checkpoint_buffer,
+		                   FLOG_INIT_SECTOR, 0,
+		                   sizeof(buffer_union.checkpoint_buffer));
+		buffer_union.checkpoint_spare_buffer.type_id =
+		   FLOG_BLOCK_TYPE_CHECKPOINT;
+		buffer_union.checkpoint_spare_buffer.nothing = 0;
+		buffer_union.checkpoint_spare_buffer.reserved = 0;
+		flash_write_spare((const uint8_t *)&buffer_union.checkpoint_spare_buffer,
+		                  FLOG_INIT_SECTOR);
+		flog_commit();
+	}
+	for(i = 2; i < 4; i++){
+		flog_open_sector(first_valid[i], FLOG_INIT_SECTOR);
+		buffer_union.age_table_buffer.sequence = 0;
+		flash_write_sector((const uint8_t *)&buffer_union.age_table_buffer,
+		                   FLOG_INIT_SECTOR, 0,
+		                   sizeof(buffer_union.age_table_buffer));
+		buffer_union.age_table_spare_buffer.type_id = FLOG_BLOCK_TYPE_AGE_TABLE;
+		buffer_union.age_table_spare_buffer.nothing = 0;
+		buffer_union.age_table_spare_buffer.nentries = 0;
+		flash_write_spare((const uint8_t *)&buffer_union.age_table_spare_buffer,
+		                  FLOG_INIT_SECTOR);
+		flog_commit();
+	}
+	flogfs.checkpoint.valid = 0;
 
 	// Write the first file table
-	flog_open_sector(first_valid, FLOG_INIT_SECTOR);
+	flog_open_sector(first_valid[4], FLOG_INIT_SECTOR);
         buffer_union.main_buffer.timestamp = 0;
         buffer_union.main_buffer.previous = FLOG_BLOCK_IDX_INVALID;
+        buffer_union.main_buffer.max_file_id = 0;
+	buffer_union.main_buffer.version = FLOG_FORMAT_VERSION;
         flash_write_sector((const uint8_t *)&buffer_union.main_buffer,
                            FLOG_INIT_SECTOR, 0, sizeof(buffer_union.main_buffer));
         buffer_union.spare_buffer.inode_index = 0;
         buffer_union.spare_buffer.type_id = FLOG_BLOCK_TYPE_INODE;
         flash_write_spare((const uint8_t *)&buffer_union.spare_buffer, FLOG_INIT_SECTOR);
-	flash_commit();
+	flog_commit();
 
-	flog_unlock_fs();
 	flash_unlock();
+	flog_unlock_fs();
 	return FLOG_SUCCESS;
 }
 
@@ -431,17 +1383,10 @@ flog_result_t flogfs_mount(){
 	// Data structures
 	////////////////////////////////////////////////////////////
 
-	// Use in search for highest allocation timestamp
-	struct {
-		flog_block_idx_t block;
-		flog_block_age_t age;
-		union {
-		flog_file_id_t file_id;
-		flog_block_idx_t previous_inode;
-		};
-		flog_timestamp_t timestamp;
-		flog_block_type_t block_type;
-	} last_allocation;
+	// Use in search for highest allocation timestamps. Any block left dirty
+	// is one of these.
+	flog_allocation_t last_allocations[FS_DIRTY_BLOCKS];
+	flog_allocation_t allocation;
 
 	struct {
 		flog_block_idx_t first_block, last_block;
@@ -463,6 +1408,14 @@ flog_result_t flogfs_mount(){
 
 	flog_inode_iterator_t inode_iter;
 
+#if FS_FILE_INDEX_SIZE
+	char fname[FLOG_MAX_FNAME_LEN];
+#endif
+	// Whether the allocator state came from scanning every block
+	uint_fast8_t scanned_blocks;
+	// Whether a failed checkpoint load has already started things over
+	uint_fast8_t restarted = 0;
+
 	////////////////////////////////////////////////////////////
 	// Flexible buffers for flash reads
 	////////////////////////////////////////////////////////////
@@ -496,6 +1449,8 @@ flog_result_t flogfs_mount(){
 	// Claim the disk and get this show started
 	////////////////////////////////////////////////////////////
 
+	flog_enter_selected_volume();
+
 	flog_lock_fs();
 
 	if(flogfs.state == FLOG_STATE_MOUNTED){
@@ -504,7 +1459,8 @@ flog_result_t flogfs_mount(){
 	}
 
 	flash_lock();
-	
+
+restart:
 	for(uint32_t i = 0; i < FS_NUM_BLOCKS/8; i++){
 		flogfs.free_block_bitmap[i] = 0;
 	}
@@ -513,22 +1469,45 @@ flog_result_t flogfs_mount(){
 	// Initialize data structures
 	////////////////////////////////////////////////////////////
 
-	last_allocation.block = FLOG_BLOCK_IDX_INVALID;
-	last_allocation.timestamp = 0;
-	last_allocation.age = 0;
+	for(i = 0; i < FS_DIRTY_BLOCKS; i++){
+		last_allocations[i].block = FLOG_BLOCK_IDX_INVALID;
+		last_allocations[i].timestamp = 0;
+		last_allocations[i].age = 0;
+	}
 
+	last_deletion.first_block = FLOG_BLOCK_IDX_INVALID;
+	last_deletion.last_block = FLOG_BLOCK_IDX_INVALID;
 	last_deletion.timestamp = 0;
 	last_deletion.file_id = FLOG_FILE_ID_INVALID;
 
 	flogfs.num_free_blocks = 0;
+	flogfs.free_block_sum = 0;
 	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
 	flogfs.max_file_id = 0;
+	flogfs.num_dead_files = 0;
+	flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+	flogfs.compaction.old_inode0 = FLOG_BLOCK_IDX_INVALID;
+	flogfs.t = 0;
+
+#if FS_FREE_BLOCK_HEAP
+	flogfs.free_heap.n = 0;
+#endif
 	
 	flogfs.cache_status = {0};
+	flog_read_cache_reset();
 	
 	flogfs.read_head = nullptr;
 	flogfs.write_head = nullptr;
-	flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+	flog_dirty_blocks_reset();
+#if FS_WRITE_BUFFER_POOL_SIZE
+	flog_write_buffers_reset();
+#endif
+#if FS_TAIL_HINT_SIZE
+	memset(flogfs.tail_hints, 0xFF, sizeof(flogfs.tail_hints));
+#endif
+#if FS_ERASE_QUEUE_SIZE
+	flogfs.erase_queue.n = 0;
+#endif
 
 	min_age_block.age = 0xFFFFFFFF;
 	min_age_block.block = FLOG_BLOCK_IDX_INVALID;
@@ -539,6 +1518,24 @@ flog_result_t flogfs_mount(){
 
 	max_block_age = 0;
 
+	////////////////////////////////////////////////////////////
+	// Try the checkpoint first. A complete record and the log
+	// following it replace the scan of every block.
+	////////////////////////////////////////////////////////////
+	scanned_blocks = 0;
+	if(flog_checkpoint_find() == FLOG_SUCCESS){
+		if(flog_checkpoint_load(last_allocations) == FLOG_SUCCESS){
+			inode0_idx = flogfs.inode0;
+			goto scan_inodes;
+		}
+		if(!restarted){
+			// A partly replayed log leaves nothing worth keeping
+			restarted = 1;
+			goto restart;
+		}
+	}
+	scanned_blocks = 1;
+
 	////////////////////////////////////////////////////////////
 	// First, iterate through all blocks to find:
 	// - Most recent allocation time in a file block
@@ -549,13 +1546,27 @@ flog_result_t flogfs_mount(){
 	////////////////////////////////////////////////////////////
 	for(i = 0; i < FS_NUM_BLOCKS; i++){
 		// Everything can be determined from page 0
-		if(FLOG_FAILURE == flash_open_page(i, 0)){
+		if(FLOG_FAILURE == flog_open_page(i, 0)){
 			continue;
 		}
 		if(FLOG_SUCCESS == flash_block_is_bad()){
 			flash_debug_warn("FLogFS:" LINESTR);
 			continue;
 		}
+
+		age = flog_block_get_age(i);
+		flog_set_known_age(i, age);
+		// Check if this is a really old block
+		if((age != FLOG_BLOCK_AGE_INVALID) && (age > max_block_age)){
+			max_block_age = age;
+		}
+
+		if(flog_checkpoint_is_reserved(i)){
+			// An interrupted record can leave these erased, but they're
+			// never free
+			continue;
+		}
+
 		// Read the sector 0 spare to identify valid blocks
                 flash_read_spare((uint8_t *)&spare_buffer_union.spare_buffer, FLOG_INIT_SECTOR);
 		
@@ -563,6 +1574,17 @@ flog_result_t flogfs_mount(){
 		case FLOG_BLOCK_TYPE_INODE:
 			flog_get_universal_tail_sector(i, &universal_tail_sector);
                         if(spare_buffer_union.inode_spare0.inode_index == 0){
+				flog_open_sector(i, FLOG_INIT_SECTOR);
+				flash_read_sector(&init_buffer_union.init_sector_buffer,
+				                  FLOG_INIT_SECTOR, 0,
+				                  sizeof(flog_inode_init_sector_t));
+				if((init_buffer_union.inode_init_sector.max_file_id !=
+				    FLOG_FILE_ID_INVALID) &&
+				   (init_buffer_union.inode_init_sector.max_file_id >
+				    flogfs.max_file_id)){
+					flogfs.max_file_id =
+					   init_buffer_union.inode_init_sector.max_file_id;
+				}
 				// Found the original gangster!
 				if(inode0_idx == FLOG_BLOCK_IDX_INVALID){
 					inode0_idx = i;
@@ -579,22 +1601,26 @@ flog_result_t flogfs_mount(){
 				// Not the first, but valid!
 			}
 	
+			flog_update_max_timestamp(universal_tail_sector.timestamp);
 			if((universal_tail_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
-			   (universal_tail_sector.timestamp > last_allocation.timestamp)){
-				// This is now the most recent allocation timestamp!
-				last_allocation.previous_inode = i;
-				last_allocation.block_type = FLOG_BLOCK_TYPE_INODE;
+			   (universal_tail_sector.timestamp >
+			    last_allocations[FS_DIRTY_BLOCKS - 1].timestamp)){
+				// This is now one of the most recent allocation timestamps!
+				allocation.previous_inode = i;
+				allocation.block_type = FLOG_BLOCK_TYPE_INODE;
 				goto update_last_allocation;
 			}
 			break;
 		case FLOG_BLOCK_TYPE_FILE:
 			flog_get_universal_tail_sector(i, &universal_tail_sector);
                         flog_get_file_init_sector(i, &init_buffer_union.file_init_sector_header);
+			flog_update_max_timestamp(universal_tail_sector.timestamp);
 			if((universal_tail_sector.timestamp != FLOG_TIMESTAMP_INVALID) &&
-			   (universal_tail_sector.timestamp > last_allocation.timestamp)){
-				// This is now the most recent allocation timestamp!
-                                last_allocation.file_id = init_buffer_union.file_init_sector_header.file_id;
-				last_allocation.block_type = FLOG_BLOCK_TYPE_FILE;
+			   (universal_tail_sector.timestamp >
+			    last_allocations[FS_DIRTY_BLOCKS - 1].timestamp)){
+				// This is now one of the most recent allocation timestamps!
+                                allocation.file_id = init_buffer_union.file_init_sector_header.file_id;
+				allocation.block_type = FLOG_BLOCK_TYPE_FILE;
 				goto update_last_allocation;
 			}
 			
@@ -605,34 +1631,60 @@ flog_result_t flogfs_mount(){
 			break;
 		case FLOG_BLOCK_TYPE_UNALLOCATED:
                         flog_get_block_stat(i, &sector_buffer_union.stat_sector);
+			flog_update_max_timestamp(sector_buffer_union.stat_sector.timestamp);
 			flogfs.num_free_blocks += 1;
 			flogfs.free_block_bitmap[i / 8] |= (1 << (i % 8));
                         flogfs.free_block_sum += sector_buffer_union.stat_sector.age;
 			break;
+		case FLOG_BLOCK_TYPE_AGE_TABLE:
+		case FLOG_BLOCK_TYPE_CHECKPOINT:
+			// Reserved
+			break;
 		default:
 			flash_debug_error("FLogFS:" LINESTR);
 			goto failure;
 		}
 		
-		age = flog_block_get_age(i);
-		// Check if this is a really old block
-		if((age != FLOG_BLOCK_AGE_INVALID) && (age > max_block_age)){
-			max_block_age = age;
-		}
-		
 		continue;
 update_last_allocation:
-		last_allocation.timestamp = universal_tail_sector.timestamp;
-		last_allocation.block = universal_tail_sector.next_block;
-		last_allocation.age = universal_tail_sector.next_age;
+		allocation.timestamp = universal_tail_sector.timestamp;
+		allocation.block = universal_tail_sector.next_block;
+		allocation.age = universal_tail_sector.next_age;
+		flog_allocation_note(last_allocations, &allocation);
 	}
 	
-	flogfs.mean_free_age = flogfs.free_block_sum / flogfs.num_free_blocks;
+	flog_update_mean_free_age();
 	
 	if(inode0_idx == FLOG_BLOCK_IDX_INVALID){
 		flash_debug_error("FLogFS:" LINESTR);
 		goto failure;
 	}
+	flogfs.inode0 = inode0_idx;
+	// Two chains means that a compaction was interrupted
+	flogfs.compaction.new_inode0 = new_inode0_idx;
+
+scan_inodes:
+	// Nothing else would notice a volume laid out by another version until
+	// it misread something. Leave it untouched.
+	flog_read_cached(inode0_idx, FLOG_INIT_SECTOR,
+	                 &init_buffer_union.init_sector_buffer, 0,
+	                 sizeof(flog_inode_init_sector_t));
+	if(init_buffer_union.inode_init_sector.version != FLOG_FORMAT_VERSION){
+		flash_debug_error("FLogFS:" LINESTR);
+		goto failure;
+	}
+
+	// If the new chain had already replaced the old one, it's the one to use
+	if((flogfs.compaction.new_inode0 != FLOG_BLOCK_IDX_INVALID) &&
+	   (flog_inode_get_replacement(inode0_idx) ==
+	    flogfs.compaction.new_inode0)){
+		flogfs.compaction.old_inode0 = inode0_idx;
+		inode0_idx = flogfs.compaction.new_inode0;
+		flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+		flogfs.inode0 = inode0_idx;
+		flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_INODE0, FLOG_BLOCK_TYPE_INODE,
+		                    inode0_idx, 0, 0, flogfs.compaction.old_inode0);
+	}
 
 	////////////////////////////////////////////////////////////
 	// Now iterate through the inode chain, finding:
@@ -642,27 +1694,34 @@ update_last_allocation:
 	////////////////////////////////////////////////////////////
 
 	done_scanning = 0;
+#if FS_FILE_INDEX_SIZE
+	memset(&flogfs.file_index, 0, sizeof(flogfs.file_index));
+#endif
 	// THE OLD INODE CHAIN
 	for(flog_inode_iterator_init(&inode_iter, inode0_idx);;
 		flog_inode_iterator_next(&inode_iter)){
 		
-		flog_open_sector(inode_iter.block, inode_iter.sector);
-                flash_read_sector(&sector_buffer_union.sector_buffer, inode_iter.sector, 0,
-		                  sizeof(flog_inode_file_allocation_header_t));
+		flog_read_cached(inode_iter.block, inode_iter.sector,
+		                 &sector_buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_allocation_header_t));
                 if(sector_buffer_union.inode_file_allocation_sector.file_id == FLOG_FILE_ID_INVALID){
 			// Passed the last file
 			// When iterating across an incomplete inode table deletion, this
 			// will also catch and finish the routine
 			break;
 		}
-		flog_open_sector(inode_iter.block, inode_iter.sector + 1);
-                flash_read_sector(&init_buffer_union.init_sector_buffer, inode_iter.sector + 1, 0,
-		                  sizeof(flog_inode_file_invalidation_t));
+		flog_read_cached(inode_iter.block, inode_iter.sector + 1,
+		                 &init_buffer_union.init_sector_buffer, 0,
+		                 sizeof(flog_inode_file_invalidation_t));
 
 		// Keep track of the maximum file ID
                 if(sector_buffer_union.inode_file_allocation_sector.file_id > flogfs.max_file_id){
                         flogfs.max_file_id = sector_buffer_union.inode_file_allocation_sector.file_id;
 		}
+		flog_update_max_timestamp(
+		   sector_buffer_union.inode_file_allocation_sector.timestamp);
+		flog_update_max_timestamp(
+		   init_buffer_union.inode_file_invalidation_sector.timestamp);
 		
 		
 		// Was it deleted?
@@ -670,23 +1729,36 @@ update_last_allocation:
 			FLOG_TIMESTAMP_INVALID){
 			// This is still valid
 
-			// Check if this is now the most recent allocation
+#if FS_FILE_INDEX_SIZE
+			flog_read_cached(inode_iter.block, inode_iter.sector,
+			                 (uint8_t *)fname,
+			                 offsetof(flog_inode_file_allocation_t, filename),
+			                 FLOG_MAX_FNAME_LEN);
+			fname[FLOG_MAX_FNAME_LEN - 1] = '\0';
+			flog_file_index_add(fname, inode_iter.block, inode_iter.sector,
+			   sector_buffer_union.inode_file_allocation_sector.first_block,
+			   sector_buffer_union.inode_file_allocation_sector.file_id);
+#endif
+
+			// Check if this is now one of the most recent allocations
                         if(sector_buffer_union.inode_file_allocation_sector.timestamp >
-			   last_allocation.timestamp){
+			   last_allocations[FS_DIRTY_BLOCKS - 1].timestamp){
 				// This isn't really always true becase we also consider
 				// allocations in the file chain itself, which are not
 				// reflected
-				last_allocation.block =
+				allocation.block =
                                   sector_buffer_union.inode_file_allocation_sector.first_block;
-				last_allocation.file_id =
+				allocation.file_id =
                                   sector_buffer_union.inode_file_allocation_sector.file_id;
-				last_allocation.age =
+				allocation.age =
                                   sector_buffer_union.inode_file_allocation_sector.first_block_age;
-				last_allocation.timestamp =
+				allocation.timestamp =
                                   sector_buffer_union.inode_file_allocation_sector.timestamp;
-				last_allocation.block_type = FLOG_BLOCK_TYPE_FILE;
+				allocation.block_type = FLOG_BLOCK_TYPE_FILE;
+				flog_allocation_note(last_allocations, &allocation);
 			}
 		} else {
+			flogfs.num_dead_files += 1;
 			// Check if this was the most recent deletion
                         if(init_buffer_union.inode_file_invalidation_sector.timestamp >
 			   last_deletion.timestamp){
@@ -699,64 +1771,104 @@ update_last_allocation:
 				last_deletion.timestamp =
                                   init_buffer_union.inode_file_invalidation_sector.timestamp;
 			}
+#if FS_ERASE_QUEUE_SIZE
+			// Without the checkpoint, any file whose last block is still
+			// its own was queued when it went down
+			if(scanned_blocks &&
+			   (flog_get_block_type(
+			       init_buffer_union.inode_file_invalidation_sector.last_block) ==
+			    FLOG_BLOCK_TYPE_FILE) &&
+			   (flog_block_get_file_id(
+			       init_buffer_union.inode_file_invalidation_sector.last_block) ==
+			    sector_buffer_union.inode_file_allocation_sector.file_id)){
+				if(flog_erase_queue_add(
+				      sector_buffer_union.inode_file_allocation_sector.file_id,
+				      init_buffer_union.inode_file_invalidation_sector.last_block)
+				   != FLOG_SUCCESS){
+					flog_erase_queue_scan();
+					flog_erase_queue_add(
+					   sector_buffer_union.inode_file_allocation_sector.file_id,
+					   init_buffer_union.inode_file_invalidation_sector.last_block);
+				}
+			}
+#endif
 		}
 	}
+#if FS_FILE_INDEX_SIZE
+	// This is where the next file goes
+	flogfs.file_index.inode_tail = inode_iter;
+#endif
 
-	// Go check and (maybe) clean the last allocation
-	if(last_allocation.timestamp > 0){
-		switch(last_allocation.block_type){
+	// Go check and (maybe) clean the last allocations. Only the most recent
+	// could have been an inode block, which is started right away.
+	for(i = 0; i < FS_DIRTY_BLOCKS; i++){
+		flog_allocation_t * const last_allocation = &last_allocations[i];
+		if(last_allocation->timestamp == 0){
+			break;
+		}
+		switch(last_allocation->block_type){
 		case FLOG_BLOCK_TYPE_FILE:
-			flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
-                        flash_read_sector(&init_buffer_union.init_sector_buffer, FLOG_INIT_SECTOR, 0,
-			                  sizeof(flog_file_init_sector_header_t));
-                        if(init_buffer_union.file_init_sector_header.file_id != last_allocation.file_id){
+			if(last_allocation->file_id > flogfs.max_file_id){
+				// The inode entry for this new file was never written
+				if(flog_get_block_type(last_allocation->block) ==
+				   FLOG_BLOCK_TYPE_UNALLOCATED){
+					flog_release_block(last_allocation->block,
+					                   last_allocation->age - 1);
+				}
+				break;
+			}
+			flog_read_cached(last_allocation->block, FLOG_INIT_SECTOR,
+			                 &init_buffer_union.init_sector_buffer, 0,
+			                 sizeof(flog_file_init_sector_header_t));
+                        if(init_buffer_union.file_init_sector_header.file_id != last_allocation->file_id){
 				// This block never got claimed
 				// Initialize it!
-				flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
-                                init_buffer_union.file_init_sector_header.timestamp = last_allocation.timestamp;
-                                init_buffer_union.file_init_sector_header.age = last_allocation.age;
-                                init_buffer_union.file_init_sector_header.file_id = last_allocation.file_id;
+				flog_open_sector(last_allocation->block, FLOG_INIT_SECTOR);
+                                init_buffer_union.file_init_sector_header.timestamp = last_allocation->timestamp;
+                                init_buffer_union.file_init_sector_header.age = last_allocation->age;
+                                init_buffer_union.file_init_sector_header.file_id = last_allocation->file_id;
                                 flash_write_sector(&init_buffer_union.init_sector_buffer, FLOG_INIT_SECTOR, 0,
 				                   sizeof(flog_file_init_sector_header_t));
                                 spare_buffer_union.file_spare0.nbytes = 0;
                                 spare_buffer_union.file_spare0.nothing = 0;
                                 spare_buffer_union.file_spare0.type_id = FLOG_BLOCK_TYPE_FILE;
                                 flash_write_spare(&spare_buffer_union.spare_buffer, FLOG_INIT_SECTOR);
-				flash_commit();
+				flog_commit();
 				
 				// BOOOOOO
-				flogfs.num_free_blocks -= 1;
-				flogfs.free_block_sum -= last_allocation.age;
-				flogfs.mean_free_age = 
-				   flogfs.free_block_sum / flogfs.num_free_blocks;
-
-				flogfs.t = last_allocation.timestamp + 1;
+				flog_claim_free_block(last_allocation->block,
+				                      last_allocation->age);
 			}
 			break;
 		case FLOG_BLOCK_TYPE_INODE:
 			flog_inode_init_sector_spare_t inode_init_spare;
 			flog_inode_init_sector_t inode_init;
-			if(flog_get_block_type(last_allocation.block) ==
-			   FLOG_BLOCK_TYPE_INODE)
+			if((i > 0) || (flog_get_block_type(last_allocation->block) ==
+			               FLOG_BLOCK_TYPE_INODE))
 				break;
+			if(last_allocation->previous_inode == FLOG_BLOCK_IDX_INVALID){
+				// The start of a new chain, left to
+				// flog_inode_compact_recover()
+				break;
+			}
 			// Well, it seems the allocation was incomplete
-			flog_open_sector(last_allocation.previous_inode, FLOG_INIT_SECTOR);
-			flash_read_spare((uint8_t *)&inode_init_spare, FLOG_INIT_SECTOR);
-			inode_init.previous = last_allocation.previous_inode;
-			inode_init.timestamp = last_allocation.timestamp;
+			flog_read_spare_cached(last_allocation->previous_inode,
+			                       FLOG_INIT_SECTOR,
+			                       (uint8_t *)&inode_init_spare);
+			inode_init.previous = last_allocation->previous_inode;
+			inode_init.timestamp = last_allocation->timestamp;
+			inode_init.max_file_id = flogfs.max_file_id;
+			inode_init.version = FLOG_FORMAT_VERSION;
 			inode_init_spare.inode_index += 1;
 			// Other fields should be valid...
-			flog_open_sector(last_allocation.block, FLOG_INIT_SECTOR);
+			flog_open_sector(last_allocation->block, FLOG_INIT_SECTOR);
 			flash_write_sector((uint8_t *)&inode_init, FLOG_INIT_SECTOR, 0,
 			                   sizeof(inode_init));
-                        flash_write_spare((uint8_t *)&init_buffer_union.inode_init_sector, FLOG_INIT_SECTOR);
-			flash_commit();
+			flash_write_spare((uint8_t *)&inode_init_spare, FLOG_INIT_SECTOR);
+			flog_commit();
 			
 			// BOOOOOO
-			flogfs.num_free_blocks -= 1;
-			flogfs.free_block_sum -= last_allocation.age;
-			flogfs.mean_free_age = 
-			   flogfs.free_block_sum / flogfs.num_free_blocks;
+			flog_claim_free_block(last_allocation->block, last_allocation->age);
 			break;
 		default:
 			// Huh?
@@ -765,19 +1877,33 @@ update_last_allocation:
 	}
 
 	// Verify the completion of the most recent deletion operation
+#if FS_ERASE_QUEUE_SIZE
+	if(scanned_blocks){
+		// Everything unfinished was found along with the inodes
+		flog_erase_queue_scan();
+	} else if((last_deletion.timestamp > 0) &&
+	          (flog_get_block_type(last_deletion.last_block) ==
+	           FLOG_BLOCK_TYPE_FILE) &&
+	          (flog_block_get_file_id(last_deletion.last_block) ==
+	           last_deletion.file_id)){
+		// The rest of the queue came with the checkpoint. Only this one
+		// could have missed being logged.
+		flog_erase_queue_push(last_deletion.file_id, last_deletion.first_block);
+	}
+#else
 	if((last_deletion.timestamp > 0) &&
 	   (flog_get_block_type(last_deletion.last_block) ==
 	      FLOG_BLOCK_TYPE_FILE)){
 
-		flog_open_sector(last_deletion.last_block, FLOG_INIT_SECTOR);
-                flash_read_sector(&init_buffer_union.init_sector_buffer, FLOG_INIT_SECTOR, 0,
-		                  sizeof(flog_file_init_sector_header_t));
+		flog_read_cached(last_deletion.last_block, FLOG_INIT_SECTOR,
+		                 &init_buffer_union.init_sector_buffer, 0,
+		                 sizeof(flog_file_init_sector_header_t));
                 if(init_buffer_union.file_init_sector_header.file_id == last_deletion.file_id){
 			// This is the same file still, see if it's been invalidated
-			flog_open_sector(last_deletion.last_block,
-			                 FLOG_BLK_STAT_SECTOR);
-                        flash_read_sector(&sector_buffer_union.sector_buffer, FLOG_BLK_STAT_SECTOR, 0,
-			                  sizeof(flog_universal_invalidation_header_t));
+			flog_read_cached(last_deletion.last_block,
+			                 FLOG_BLK_STAT_SECTOR,
+			                 &sector_buffer_union.sector_buffer, 0,
+			                 sizeof(flog_universal_invalidation_header_t));
                         if(sector_buffer_union.universal_invalidation_header.timestamp != FLOG_TIMESTAMP_INVALID){
 				// Crap, this never got invalidated correctly
 				flog_invalidate_chain(last_deletion.first_block,
@@ -785,6 +1911,20 @@ update_last_allocation:
 			}
 		}
 	}
+#endif
+
+	flog_inode_compact_recover();
+
+	if(scanned_blocks &&
+	   (flogfs.checkpoint.blocks[0] != FLOG_BLOCK_IDX_INVALID)){
+		// Save the result so the next mount can skip the scan
+		flog_checkpoint_write();
+	}
+
+#if FS_FREE_BLOCK_HEAP
+	// Everything the allocator can hand out is settled now
+	flog_free_heap_build();
+#endif
 
 	flogfs.state = FLOG_STATE_MOUNTED;
 
@@ -799,16 +1939,71 @@ failure:
 }
 
 
+flog_result_t flogfs_mount_scan(){
+	flog_enter_selected_volume();
 
-flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename){
-	flog_inode_iterator_t inode_iter;
-	flog_read_file_t * file_iter;
-	flog_file_find_result_t find_result;
-
-	union {
-		uint8_t spare_buffer;
-		flog_file_sector_spare_t file_sector_spare;
-        } spare_buffer_union;
+	flog_lock_fs();
+	if(flogfs.state == FLOG_STATE_MOUNTED){
+		flog_unlock_fs();
+		return FLOG_FAILURE;
+	}
+	flash_lock();
+	if(flog_checkpoint_find() == FLOG_SUCCESS){
+		flog_checkpoint_invalidate();
+	}
+	flash_unlock();
+	flog_unlock_fs();
+
+	// Without a complete record this comes down to the scan
+	return flogfs_mount();
+}
+
+
+flog_result_t flogfs_unmount(){
+	flog_result_t result = FLOG_SUCCESS;
+
+	flog_enter_selected_volume();
+
+	flog_lock_fs();
+
+	if(flogfs.state != FLOG_STATE_MOUNTED){
+		flog_unlock_fs();
+		return FLOG_SUCCESS;
+	}
+
+	if(flogfs.write_head){
+		// Files still open for writing have to be closed first
+		flog_unlock_fs();
+		return FLOG_FAILURE;
+	}
+
+	flash_lock();
+
+	if(flogfs.checkpoint.valid){
+		// Fold the log into a fresh record so the next mount reads nothing
+		// else
+		result = flog_checkpoint_write();
+	}
+	// Don't leave anything programming
+	flog_flash_wait();
+
+	flogfs.state = FLOG_STATE_RESET;
+
+	flash_unlock();
+	flog_unlock_fs();
+	return result;
+}
+
+
+flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename){
+	flog_inode_iterator_t inode_iter;
+	flog_read_file_t * file_iter;
+	flog_file_find_result_t find_result;
+
+	flog_enter_selected_volume();
+#if FS_NUM_VOLUMES > 1
+	file->volume = flog_selected_volume;
+#endif
 
 	if(strlen(filename) >= FLOG_MAX_FNAME_LEN){
 		return FLOG_FAILURE;
@@ -823,30 +2018,19 @@ flog_result_t flogfs_open_read(flog_read_file_t * file, char const * filename){
 		goto failure;
 	}
 
+	file->first_block = find_result.first_block;
 	file->block = find_result.first_block;
+	file->block_number = 0;
+	file->block_start = 0;
 	file->id = find_result.file_id;
-	/////////////
-	// Actual file search
-	/////////////
-
+#if FS_SEEK_INDEX_SIZE
+	file->seek_index_n = 0;
+	file->seek_stride = 1;
+	flog_seek_index_add(file);
+#endif
 
 	// Now go find the start of file data (either first or second sector)
-	// and adjust some settings
-	flog_open_sector(file->block, FLOG_INIT_SECTOR);
-        flash_read_spare(&spare_buffer_union.spare_buffer, FLOG_INIT_SECTOR);
-
-        if(spare_buffer_union.file_sector_spare.nbytes != 0){
-		// The first sector has some stuff in it!
-		file->sector = FLOG_INIT_SECTOR;
-		file->offset = sizeof(flog_file_init_sector_header_t);
-	} else {
-		flog_open_sector(file->block, 1);
-                flash_read_spare(&spare_buffer_union.spare_buffer, 1);
-		file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
-		file->offset = 0;
-	}
-
-        file->sector_remaining_bytes = spare_buffer_union.file_sector_spare.nbytes;
+	flog_read_file_locate(file, 0);
 
 	// If we got this far...
 
@@ -874,6 +2058,8 @@ failure:
 
 flog_result_t flogfs_close_read(flog_read_file_t * file){
 	flog_read_file_t * iter;
+	flog_enter_volume(FLOG_VOLUME_OF(file));
+
 	flog_lock_fs();
 	if(flogfs.read_head == file){
 		flogfs.read_head = file->next;
@@ -901,6 +2087,8 @@ flog_result_t flogfs_check_exists(char const * filename){
 	flog_file_find_result_t find_result;
 	flog_result_t result;
 	
+	flog_enter_selected_volume();
+
 	flog_lock_fs();
 	flash_lock();
 	find_result = flog_find_file(filename, &inode_iter);
@@ -914,11 +2102,29 @@ flog_result_t flogfs_check_exists(char const * filename){
 }
 
 uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
+	flog_enter_volume(FLOG_VOLUME_OF(file));
+
+	return flog_read_file_data(file, dst, nbytes, NULL, NULL);
+}
+
+#if FS_ZERO_COPY_READ
+uint32_t flogfs_read_visit(flog_read_file_t * file, uint32_t nbytes,
+                           flogfs_read_visitor_t visitor, void * context){
+	flog_enter_volume(FLOG_VOLUME_OF(file));
+
+	return flog_read_file_data(file, NULL, nbytes, visitor, context);
+}
+#endif
+
+uint32_t flog_read_file_data(flog_read_file_t * file, uint8_t * dst,
+                             uint32_t nbytes, flogfs_read_visitor_t visitor,
+                             void * context){
         uint32_t count = 0;
         uint16_t to_read;
 
 	flog_block_idx_t block;
 	uint16_t sector;
+	uint32_t bytes_in_block;
 
 	union {
 		uint8_t sector_header;
@@ -931,10 +2137,17 @@ uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
 		flog_file_sector_spare_t file_sector_spare;
         } spare_buffer_union;
 
-	flog_lock_fs();
-	flash_lock();
+#if !FS_ZERO_COPY_READ
+	(void)visitor;
+	(void)context;
+#endif
 
 	while(nbytes){
+#if FS_READ_AHEAD
+		uint_fast8_t advanced = 0;
+#endif
+		// Only one page at a time, so other files get a turn in between
+		flash_lock();
 		if(file->sector_remaining_bytes == 0){
 			// We are/were at the end of file, look into the existence of new data
 			// This block is responsible for setting:
@@ -945,29 +2158,33 @@ uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
 			// and bailing on the loop if EOF is encountered
 			if(file->sector == FLOG_TAIL_SECTOR){
 				// This was the last sector in the block, check the next
-				flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-                                flash_read_sector(&buffer_union.sector_header, FLOG_TAIL_SECTOR, 0,
-								sizeof(flog_file_tail_sector_header_t));
+				flog_read_cached(file->block, FLOG_TAIL_SECTOR,
+				                 &buffer_union.sector_header, 0,
+				                 sizeof(flog_file_tail_sector_header_t));
                                 block = buffer_union.file_tail_sector_header.next_block;
+				bytes_in_block =
+				   buffer_union.file_tail_sector_header.bytes_in_block;
 				// Now check out that new block and make sure it's legit
-				flog_open_sector(block, FLOG_INIT_SECTOR);
-                                flash_read_sector(&buffer_union.sector_header, FLOG_INIT_SECTOR, 0,
-								sizeof(flog_file_init_sector_header_t));
+				flog_read_cached(block, FLOG_INIT_SECTOR,
+				                 &buffer_union.sector_header, 0,
+				                 sizeof(flog_file_init_sector_header_t));
                                 if(buffer_union.file_init_sector_header.file_id != file->id){
 					// This next block hasn't been written. EOF for now
 					goto done;
 				}
 
 				file->block = block;
+				file->block_number += 1;
+				file->block_start += bytes_in_block;
+#if FS_SEEK_INDEX_SIZE
+				flog_seek_index_add(file);
+#endif
 
-                                flash_read_spare(&spare_buffer_union.sector_spare, FLOG_INIT_SECTOR);
-                                if(spare_buffer_union.file_sector_spare.nbytes == 0){
-					// It's possible for the first sector to have 0 bytes
-					// Data is in next sector
-					file->sector = flog_increment_sector(FLOG_INIT_SECTOR);
-				} else {
-					file->sector = FLOG_INIT_SECTOR;
-				}
+				flog_read_spare_cached(file->block, FLOG_INIT_SECTOR,
+				                       &spare_buffer_union.sector_spare);
+				// It's possible for the first sector to have 0 bytes. Then the
+				// next pass moves on to the sector after it.
+				file->sector = FLOG_INIT_SECTOR;
 			} else {
 				// Increment to next sector but don't necessarily update file
 				// state
@@ -985,39 +2202,96 @@ uint32_t flogfs_read(flog_read_file_t * file, uint8_t * dst, uint32_t nbytes){
 			}
 
                         file->sector_remaining_bytes = spare_buffer_union.file_sector_spare.nbytes;
-			switch(file->sector){
-			case FLOG_TAIL_SECTOR:
-				file->offset = sizeof(flog_file_tail_sector_header_t);
-				break;
-			case FLOG_INIT_SECTOR:
-				file->offset = sizeof(flog_file_init_sector_header_t);
-				break;
-			default:
-				file->offset = 0;
-			}
+			file->offset = flog_sector_data_offset(file->sector);
+#if FS_READ_AHEAD
+			advanced = 1;
+#endif
 		}
 
 		// Figure out how many to read
 		to_read = MIN(nbytes, file->sector_remaining_bytes);
 
 		if(to_read){
-			// Read this sector now
+			uint16_t const first_sector = file->sector;
+			uint16_t const first_offset = file->offset;
+#if FS_ZERO_COPY_READ
+			uint16_t const first_remaining = file->sector_remaining_bytes;
+			uint8_t const * data;
+#endif
+
 			flog_open_sector(file->block, file->sector);
-			flash_read_sector(dst, file->sector, file->offset, to_read);
-			count += to_read;
-			nbytes -= to_read;
-			dst += to_read;
-			// Update file stats
+#if FS_READ_AHEAD
+			if((advanced || (file->read_head == 0)) &&
+			   flog_sector_starts_page(file->sector)){
+				if(file->sequential_pages < 0xFF){
+					file->sequential_pages += 1;
+				}
+				// Reading on into a new page, so load the next one meanwhile.
+				// Not until a whole page has been read through since seeking
+				// though, as a seek is often followed by another.
+				if(file->sequential_pages >= 2){
+					flog_read_ahead(file->block, file->sector);
+				}
+			}
+#endif
 			file->offset += to_read;
 			file->sector_remaining_bytes -= to_read;
+
+			// Take in the rest of the page while the data runs straight on into
+			// the next sector, so it all comes over in one transfer
+			while((to_read < nbytes) && (file->offset == FS_SECTOR_SIZE)){
+				uint16_t n;
+				sector = flog_increment_sector(file->sector);
+				if(sector / FS_SECTORS_PER_PAGE !=
+				   file->sector / FS_SECTORS_PER_PAGE){
+					break;
+				}
+				flash_read_spare(&spare_buffer_union.sector_spare, sector);
+				if(spare_buffer_union.file_sector_spare.nbytes ==
+				   FLOG_SECTOR_NBYTES_INVALID){
+					break;
+				}
+				file->sector = sector;
+				file->sector_remaining_bytes =
+				   spare_buffer_union.file_sector_spare.nbytes;
+				n = MIN(nbytes - to_read, file->sector_remaining_bytes);
+				file->offset = n;
+				file->sector_remaining_bytes -= n;
+				to_read += n;
+			}
+
+#if FS_ZERO_COPY_READ
+			if(visitor){
+				data = flash_map_sector(first_sector, first_offset, to_read);
+				if(data == NULL){
+					// Put the file back to where it was
+					file->sector = first_sector;
+					file->offset = first_offset;
+					file->sector_remaining_bytes = first_remaining;
+					goto done;
+				}
+			} else
+#endif
+			{
+				flash_read_sector(dst, first_sector, first_offset, to_read);
+				dst += to_read;
+			}
+			count += to_read;
+			nbytes -= to_read;
 			file->read_head += to_read;
+#if FS_ZERO_COPY_READ
+			if(visitor && (visitor(context, data, to_read) != FLOG_SUCCESS)){
+				goto done;
+			}
+#endif
 		}
+		flash_unlock();
 	}
 
+	return count;
 
 done:
 	flash_unlock();
-	flog_unlock_fs();
 
 	return count;
 }
@@ -1025,51 +2299,108 @@ done:
 uint32_t flogfs_write(flog_write_file_t * file, uint8_t const * src,
                       uint32_t nbytes){
 	uint32_t count = 0;
-	flog_sector_nbytes_t bytes_written;
+	uint32_t bytes_written;
 
-	flog_lock_fs();
-	flash_lock();
+	flog_enter_volume(FLOG_VOLUME_OF(file));
 
 	while(nbytes){
-		if(nbytes >= file->sector_remaining_bytes){
-			bytes_written = file->sector_remaining_bytes;
-			if(flog_commit_file_sector(file, src,
-				file->sector_remaining_bytes) == FLOG_FAILURE){
+		// Only one sector at a time, so other files get a turn in between
+		flash_lock();
+		bytes_written = flog_write_file_data(file, src, nbytes);
+		flash_unlock();
+		if(bytes_written == 0){
+			// Couldn't allocate or something
+			break;
+		}
+		src += bytes_written;
+		nbytes -= bytes_written;
+		count += bytes_written;
+	}
+
+	return count;
+}
+
+uint32_t flogfs_writev(flog_write_file_t * file, flog_iovec_t const * iov,
+                       uint16_t iovcnt){
+	uint32_t count = 0;
+	uint32_t bytes_written;
+	uint8_t const * src;
+	uint32_t nbytes;
+
+	flog_enter_volume(FLOG_VOLUME_OF(file));
+
+	// The whole record goes in while the flash is held
+	flash_lock();
+	for(uint16_t i = 0; i < iovcnt; i++){
+		src = (uint8_t const *)iov[i].data;
+		nbytes = iov[i].nbytes;
+		while(nbytes){
+			bytes_written = flog_write_file_data(file, src, nbytes);
+			if(bytes_written == 0){
 				// Couldn't allocate or something
 				goto done;
 			}
-
-			// Now that sector is completely written
 			src += bytes_written;
 			nbytes -= bytes_written;
 			count += bytes_written;
-		} else {
-			// This is smaller than a sector; cache it
-			memcpy(file->sector_buffer + file->offset, src, nbytes);
-			count += nbytes;
-			file->sector_remaining_bytes -= nbytes;
-			file->offset += nbytes;
-			file->bytes_in_block += nbytes;
-			file->write_head += nbytes;
-			nbytes = 0;
 		}
 	}
 
 done:
 	flash_unlock();
-	flog_unlock_fs();
 
 	return count;
 }
 
+uint32_t flog_write_file_data(flog_write_file_t * file, uint8_t const * src,
+                              uint32_t nbytes){
+	flog_sector_nbytes_t bytes_written;
+
+	if(nbytes >= file->sector_remaining_bytes){
+		bytes_written = file->sector_remaining_bytes;
+		if(flog_commit_file_sector(file, src,
+			file->sector_remaining_bytes) == FLOG_FAILURE){
+			return 0;
+		}
+		// Now that sector is completely written
+		return bytes_written;
+	}
+
+	// This is smaller than a sector; cache it
+#if FS_WRITE_BUFFER_POOL_SIZE
+	if(flog_write_buffer_get(file, 1) != FLOG_SUCCESS){
+		return 0;
+	}
+#endif
+	memcpy(flog_write_file_buffer(file) + file->offset, src, nbytes);
+	file->sector_remaining_bytes -= nbytes;
+	file->offset += nbytes;
+	file->bytes_in_block += nbytes;
+	file->write_head += nbytes;
+	return nbytes;
+}
+
 flog_result_t flogfs_seek(flog_read_file_t * file, uint32_t index){
-	return FLOG_FAILURE;
+	flog_result_t result;
+
+	flog_enter_volume(FLOG_VOLUME_OF(file));
+
+	flash_lock();
+
+	result = flog_read_file_locate(file, index);
+
+	flash_unlock();
+
+	return result;
 }
 
 flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename){
 	flog_inode_iterator_t inode_iter;
 	flog_block_alloc_t alloc_block;
 	flog_file_find_result_t find_result;
+#if FS_TAIL_HINT_SIZE
+	flog_tail_hint_t tail_hint;
+#endif
 
 	union {
                 uint8_t sector_buffer;
@@ -1082,12 +2413,22 @@ flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename)
 		flog_file_sector_spare_t file_sector_spare;
         } spare_buffer_union;
 
+	flog_enter_selected_volume();
+#if FS_NUM_VOLUMES > 1
+	file->volume = flog_selected_volume;
+#endif
+
 	flog_lock_fs();
 	flash_lock();
 
 	find_result = flog_find_file(filename, &inode_iter);
 	
-	file->base_threshold = 0;
+#if FS_PAGE_WRITE_BUFFER
+	file->page_n = 0;
+#endif
+#if FS_WRITE_BUFFER_POOL_SIZE
+	file->sector_buffer = NULL;
+#endif
 
 	if(find_result.first_block != FLOG_BLOCK_IDX_INVALID){
 		// TODO: Make sure file isn't already open for writing
@@ -1098,29 +2439,55 @@ flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename)
 		file->sector = FLOG_INIT_SECTOR;
 		// Count bytes from 0
 		file->write_head = 0;
+		file->bytes_in_block = 0;
+#if FS_TAIL_HINT_SIZE
+		if(flog_tail_hint_get(file->id, &tail_hint) == FLOG_SUCCESS){
+			// Skip to where the file ended last time
+			file->block = tail_hint.block;
+			file->sector = tail_hint.sector;
+			file->write_head = tail_hint.write_head;
+			file->bytes_in_block = tail_hint.bytes_in_block;
+		}
+#endif
 		// Iterate to the end of the file
 		// First check each terminated block
 		while(1){
-			flog_open_sector(file->block, FLOG_TAIL_SECTOR);
-                        flash_read_sector(&buffer_union.sector_buffer, FLOG_TAIL_SECTOR, 0,
-			                  sizeof(flog_file_tail_sector_header_t));
+			flog_read_cached(file->block, FLOG_TAIL_SECTOR,
+			                 &buffer_union.sector_buffer, 0,
+			                 sizeof(flog_file_tail_sector_header_t));
                         if(buffer_union.file_tail_sector_header.timestamp == FLOG_TIMESTAMP_INVALID){
 				// This block is incomplete
 				break;
 			}
                         file->block = buffer_union.file_tail_sector_header.next_block;
-                        file->write_head += buffer_union.file_tail_sector_header.bytes_in_block;
+                        file->write_head += buffer_union.file_tail_sector_header.bytes_in_block -
+			                    file->bytes_in_block;
+			file->bytes_in_block = 0;
+			file->sector = FLOG_INIT_SECTOR;
 		}
 		// Now file->block is the first incomplete block
 		// Scan it sector-by-sector
 
-		// Check out init sector no matter what and move on.
-		// It might have no data
-		flog_open_sector(file->block, FLOG_INIT_SECTOR);
-                flash_read_spare(&spare_buffer_union.spare_buffer, FLOG_INIT_SECTOR);
-                file->write_head += spare_buffer_union.file_sector_spare.nbytes;
-		file->sector = flog_increment_sector(file->sector);
-		while(1){
+		if(file->sector == FLOG_INIT_SECTOR){
+			// Check out init sector no matter what and move on.
+			// It might have no data
+			flog_read_spare_cached(file->block, FLOG_INIT_SECTOR,
+			                       &spare_buffer_union.spare_buffer);
+			if(spare_buffer_union.file_sector_spare.nbytes ==
+			   FLOG_SECTOR_NBYTES_INVALID){
+				// The block was allocated but never started, so start it
+				file->offset = sizeof(flog_file_init_sector_header_t);
+				file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+				// The allocation age goes up by one when the block is taken
+				file->block_age = flog_known_age(file->block) + 1;
+			} else {
+				file->write_head += spare_buffer_union.file_sector_spare.nbytes;
+				// The tail sector records this when the block is done
+				file->bytes_in_block = spare_buffer_union.file_sector_spare.nbytes;
+				file->sector = flog_increment_sector(file->sector);
+			}
+		}
+		while(file->sector != FLOG_INIT_SECTOR){
 			// For each block in the file
 			flog_open_sector(file->block, file->sector);
                         flash_read_spare(&spare_buffer_union.spare_buffer, file->sector);
@@ -1136,6 +2503,7 @@ flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename)
 				break;
 			}
                         file->write_head += spare_buffer_union.file_sector_spare.nbytes;
+			file->bytes_in_block += spare_buffer_union.file_sector_spare.nbytes;
 			file->sector = flog_increment_sector(file->sector);
 		}
 	} else {
@@ -1151,20 +2519,17 @@ flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename)
                 strcpy(buffer_union.inode_file_allocation_sector.filename, filename);
                 buffer_union.inode_file_allocation_sector.filename[FLOG_MAX_FNAME_LEN-1] = '\0';
 
-		flog_lock_allocate();
+		flog_flush_dirty_blocks();
 
-		flog_flush_dirty_block();
+		flog_lock_allocate();
 
-		alloc_block = flog_allocate_block(file->base_threshold);
+		alloc_block = flog_allocate_block();
 		if(alloc_block.block == FLOG_BLOCK_IDX_INVALID){
 			flog_unlock_allocate();
 			// Couldn't allocate a block
 			goto failure;
 		}
 
-		flogfs.dirty_block.block = alloc_block.block;
-		flogfs.dirty_block.file = file;
-
 		flog_unlock_allocate();
 
                 buffer_union.inode_file_allocation_sector.header.file_id = ++flogfs.max_file_id;
@@ -1172,11 +2537,29 @@ flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename)
                 buffer_union.inode_file_allocation_sector.header.first_block_age = ++alloc_block.age;
                 buffer_union.inode_file_allocation_sector.header.timestamp = ++flogfs.t;
 
+		// (The age was incremented above)
+		flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_ALLOC, FLOG_BLOCK_TYPE_FILE,
+		                    alloc_block.block, alloc_block.age - 1,
+		                    flogfs.max_file_id, FLOG_BLOCK_IDX_INVALID);
+
+		file->id = flogfs.max_file_id;
+		flog_lock_allocate();
+		flog_dirty_block_add(alloc_block.block, alloc_block.age - 1,
+		                     FLOG_BLOCK_IDX_INVALID, file);
+		flog_unlock_allocate();
+
 		// Write the new inode entry
 		flog_open_sector(inode_iter.block,inode_iter.sector);
                 flash_write_sector(&buffer_union.sector_buffer, inode_iter.sector, 0,
 		                   sizeof(flog_inode_file_allocation_t));
-		flash_commit();
+		flog_commit();
+
+#if FS_FILE_INDEX_SIZE
+		flog_file_index_add(filename, inode_iter.block, inode_iter.sector,
+		                    alloc_block.block, flogfs.max_file_id);
+		flog_inode_iterator_next(&inode_iter);
+		flogfs.file_index.inode_tail = inode_iter;
+#endif
 
 		file->block = alloc_block.block;
 		file->block_age = alloc_block.age;
@@ -1189,6 +2572,8 @@ flog_result_t flogfs_open_write(flog_write_file_t * file, char const * filename)
 		                               sizeof(flog_file_init_sector_header_t);
 	}
 
+	file->maintain_head = file->write_head;
+
 	// Add it to that list
 	file->next = 0;
 	if(flogfs.write_head == 0){
@@ -1226,6 +2611,8 @@ flog_result_t flogfs_close_write(flog_write_file_t * file){
 	flog_result_t result;
 
 
+	flog_enter_volume(FLOG_VOLUME_OF(file));
+
 	flog_lock_fs();
 	flash_lock();
 
@@ -1233,17 +2620,42 @@ flog_result_t flogfs_close_write(flog_write_file_t * file){
 		flogfs.write_head = file->next;
 	} else {
 		iter = flogfs.write_head;
-		while(iter->next){
+		while(1){
+			if(iter->next == 0){
+				// It isn't open
+				goto failure;
+			}
 			if(iter->next == file){
 				iter->next = file->next;
 				break;
 			}
 			iter = iter->next;
 		}
-		goto failure;
 	}
 
 	result = flog_flush_write(file);
+	if((result == FLOG_SUCCESS) && (file->sector == FLOG_INIT_SECTOR)){
+		// Flushing the tail sector claimed the next block. Nothing would
+		// start it once the file is closed.
+		result = flog_flush_write(file);
+	}
+	// Nothing may flush this file through its dirty block after it's closed
+	flog_lock_allocate();
+	flog_dirty_block_remove(file);
+	flog_unlock_allocate();
+#if FS_PLANES > 1
+	// Don't leave the last page waiting in its plane for one which may
+	// never come
+	flog_flash_send_planes();
+#endif
+#if FS_TAIL_HINT_SIZE
+	if(result == FLOG_SUCCESS){
+		flog_tail_hint_set(file);
+	}
+#endif
+#if FS_WRITE_BUFFER_POOL_SIZE
+	flog_write_buffer_put(file);
+#endif
 
 	flash_unlock();
 	flog_unlock_fs();
@@ -1261,12 +2673,17 @@ flog_result_t flogfs_rm(char const * filename){
 	flog_file_find_result_t find_result;
 	flog_inode_iterator_t inode_iter;
 	flog_block_idx_t block, next_block;	
+#if FS_TAIL_HINT_SIZE
+	flog_tail_hint_t tail_hint;
+#endif
 	
 	union {
 		uint8_t sector_buffer;
 		flog_inode_file_invalidation_t invalidation_buffer;
         } buffer_union;
 
+	flog_enter_selected_volume();
+
 	flog_lock_fs();
 	flash_lock();
 
@@ -1280,6 +2697,12 @@ flog_result_t flogfs_rm(char const * filename){
 
 	// Navigate to the end to find the last block
 	block = find_result.first_block;
+#if FS_TAIL_HINT_SIZE
+	if(flog_tail_hint_get(find_result.file_id, &tail_hint) == FLOG_SUCCESS){
+		block = tail_hint.block;
+	}
+	flog_tail_hint_remove(find_result.file_id);
+#endif
 	while(1){
 		next_block = flog_universal_get_next_block(block);
 		if(next_block == FLOG_BLOCK_IDX_INVALID){
@@ -1295,11 +2718,20 @@ flog_result_t flogfs_rm(char const * filename){
 	flog_open_sector(inode_iter.block, inode_iter.sector + 1);
         flash_write_sector(&buffer_union.sector_buffer, inode_iter.sector + 1, 0,
 	                   sizeof(flog_inode_file_invalidation_t));
-	flash_commit();
+	flog_commit();
 	// A disk failure here can be recovered in mounting
 
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_remove(filename, find_result.file_id);
+#endif
+	flogfs.num_dead_files += 1;
+
 	// Invalidate the file block chain
+#if FS_ERASE_QUEUE_SIZE
+	flog_erase_queue_push(find_result.file_id, find_result.first_block);
+#else
 	flog_invalidate_chain(find_result.first_block, find_result.file_id);
+#endif
 
 	flash_unlock();
 	flog_unlock_fs();
@@ -1311,87 +2743,385 @@ failure:
 	return FLOG_FAILURE;
 }
 
+flog_read_cache_stats_t flogfs_read_cache_stats(){
+	flog_read_cache_stats_t stats;
+	flog_enter_selected_volume();
 
+	flash_lock();
+	stats = flogfs.read_cache_stats;
+	flash_unlock();
+	return stats;
+}
 
+flog_block_idx_t flogfs_free_blocks(){
+	flog_block_idx_t n;
+	flog_enter_selected_volume();
 
+	flash_lock();
+	n = flogfs.num_free_blocks;
+	flash_unlock();
+	return n;
+}
 
-void flogfs_start_ls(flogfs_ls_iterator_t * iter){
-	// TODO: Lock something?
+uint16_t flogfs_maintain(uint16_t budget){
+	uint16_t remaining = 0;
 
-	flog_inode_iterator_init(iter, flogfs.inode0);
-}
+	flog_enter_selected_volume();
 
-uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst){
-	union {
-		uint8_t sector_buffer;
-		flog_file_id_t file_id;
-		flog_timestamp_t timestamp;
-        } buffer_union;
-	while(1){
-		flog_open_sector(iter->block, iter->sector);
-                flash_read_sector(&buffer_union.sector_buffer, iter->sector,
-		                  0, sizeof(flog_file_id_t));
-                if(buffer_union.file_id == FLOG_FILE_ID_INVALID){
-			// Nothing here. Done.
-			return 0;
+	flog_lock_fs();
+	if(flogfs.state != FLOG_STATE_MOUNTED){
+		flog_unlock_fs();
+		return 0;
+	}
+	flash_lock();
+
+	// Data nobody has added to since the last call
+	for(flog_write_file_t * file = flogfs.write_head; file; file = file->next){
+		if(flog_write_file_is_buffered(file) &&
+		   (file->maintain_head == file->write_head)){
+			if(budget){
+				flog_flush_write(file);
+				budget -= 1;
+			} else {
+				remaining += 1;
+			}
 		}
-		// Now check to see if it's valid
-		flog_open_sector(iter->block, iter->sector + 1);
-                flash_read_sector(&buffer_union.sector_buffer, iter->sector+1,
-		                  0, sizeof(flog_timestamp_t));
-                if(buffer_union.timestamp == FLOG_TIMESTAMP_INVALID){
-			// This file's good
-			// Now check to see if it's valid
-			// Go read the filename
-			flog_open_sector(iter->block, iter->sector);
-			flash_read_sector((uint8_t *)fname_dst, iter->sector,
-			                  sizeof(flog_inode_file_allocation_header_t),
-							  FLOG_MAX_FNAME_LEN);
-			fname_dst[FLOG_MAX_FNAME_LEN-1] = '\0';
-			flog_inode_iterator_next(iter);
-			return 1;
+		file->maintain_head = file->write_head;
+	}
+
+	// Don't leave the new record to whichever allocation fills the log
+	if(flogfs.checkpoint.valid &&
+	   (FS_SECTORS_PER_BLOCK - flogfs.checkpoint.next_sector <
+	    FLOG_CHECKPOINT_LOW_WATER)){
+		if(budget){
+			flog_checkpoint_write();
+			budget -= 1;
 		} else {
-			flog_inode_iterator_next(iter);
+			remaining += 1;
 		}
 	}
-}
-
-void flogfs_stop_ls(flogfs_ls_iterator_t * iter){
-	// TODO: Unlock something?
-}
 
+#if FS_ERASE_QUEUE_SIZE
+	for(; budget && flogfs.erase_queue.n; budget--){
+		flog_erase_queue_step();
+	}
+	// Counts files, not blocks. Their chains are only known by reading them.
+	remaining += flogfs.erase_queue.n;
+#endif
 
+	flash_unlock();
+	flog_unlock_fs();
+	return remaining;
+}
 
-///////////////////////////////////////////////////////////////////////////////
-// Static implementations
-///////////////////////////////////////////////////////////////////////////////
 
-flog_result_t flog_commit_file_sector(flog_write_file_t * file,
-                                      uint8_t const * data,
-                                      flog_sector_nbytes_t n){
-	flog_file_sector_spare_t file_sector_spare;
-	if(file->sector == FLOG_TAIL_SECTOR){
-		// We need a new block
-		flog_block_alloc_t next_block;
-		flog_file_tail_sector_header_t * const file_tail_sector_header =
-		   (flog_file_tail_sector_header_t *) file->sector_buffer;
 
-		flog_lock_allocate();
+/*!
+ @details
+ ### Internals
+ A new first inode block is started and every live entry is copied to the new
+ chain. The switch is a single sector write: the invalidation sector of the
+ old first block names its replacement, with flog_copy_complete_marker in its
+ spare. Only after that is the old chain freed, with its first block last.
+
+ Mount recognizes the two chains by their two first blocks (or from the
+ checkpoint log). Without the marker the new chain is thrown away; with it the
+ old chain is.
+ */
+flog_result_t flogfs_compact_inodes(){
+	flog_inode_iterator_t src, dst;
+	flog_block_alloc_t root;
+	flog_block_idx_t old_inode0;
+	flog_timestamp_t root_timestamp;
+	flog_file_id_t file_id;
+	uint_fast8_t deleted;
+	// Entries of deleted files copied to the new chain
+	flog_file_id_t num_kept = 0;
 
-		flog_flush_dirty_block();
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t allocation_sector;
+		flog_inode_file_invalidation_t file_invalidation_sector;
+		flog_inode_init_sector_t init_sector;
+		flog_inode_init_sector_spare_t init_spare;
+		flog_inode_invalidation_sector_t invalidation_sector;
+		flog_inode_invalidation_sector_spare_t invalidation_spare;
+        } buffer_union;
 
-		next_block = flog_allocate_block(file->base_threshold);
-		if(next_block.block == FLOG_BLOCK_IDX_INVALID){
-			// Can't write the last sector without sealing the file.
-			// Bailing
-			flog_unlock_allocate();
-			return FLOG_FAILURE;
-		}
+	flog_enter_selected_volume();
 
-		flogfs.dirty_block.block = next_block.block;
-		flogfs.dirty_block.file = file;
+	flog_lock_fs();
 
-		flogfs.num_free_blocks -= 1;
+	if(flogfs.state != FLOG_STATE_MOUNTED){
+		flog_unlock_fs();
+		return FLOG_FAILURE;
+	}
+#if FS_ERASE_QUEUE_SIZE
+	if(flogfs.num_dead_files <= flogfs.erase_queue.n){
+#else
+	if(flogfs.num_dead_files == 0){
+#endif
+		// Nothing to reclaim
+		flog_unlock_fs();
+		return FLOG_SUCCESS;
+	}
+	old_inode0 = flogfs.inode0;
+
+	flash_lock();
+
+	// Start the new chain
+	flog_flush_dirty_blocks();
+	flog_lock_allocate();
+	root = flog_allocate_block();
+	flog_unlock_allocate();
+	if(root.block == FLOG_BLOCK_IDX_INVALID){
+		goto failure;
+	}
+
+	root_timestamp = ++flogfs.t;
+	flogfs.compaction.new_inode0 = root.block;
+	flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_ALLOC, FLOG_BLOCK_TYPE_INODE,
+	                    root.block, root.age, 0, FLOG_BLOCK_IDX_INVALID);
+
+	buffer_union.init_sector.timestamp = root_timestamp;
+	buffer_union.init_sector.previous = FLOG_BLOCK_IDX_INVALID;
+	buffer_union.init_sector.max_file_id = flogfs.max_file_id;
+	buffer_union.init_sector.version = FLOG_FORMAT_VERSION;
+	flog_open_sector(root.block, FLOG_INIT_SECTOR);
+	flash_write_sector(&buffer_union.sector_buffer, FLOG_INIT_SECTOR, 0,
+	                   sizeof(flog_inode_init_sector_t));
+	buffer_union.init_spare.type_id = FLOG_BLOCK_TYPE_INODE;
+	buffer_union.init_spare.nothing = 0;
+	buffer_union.init_spare.inode_index = 0;
+	flash_write_spare(&buffer_union.sector_buffer, FLOG_INIT_SECTOR);
+	flog_commit();
+
+#if FS_FILE_INDEX_SIZE
+	// Everything is about to move
+	memset(&flogfs.file_index, 0, sizeof(flogfs.file_index));
+#endif
+
+	// Copy the live entries
+	flog_inode_iterator_init(&dst, root.block);
+	for(flog_inode_iterator_init(&src, old_inode0);;
+	    flog_inode_iterator_next(&src)){
+		flog_read_cached(src.block, src.sector,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_allocation_t));
+		file_id = buffer_union.allocation_sector.header.file_id;
+		if(file_id == FLOG_FILE_ID_INVALID){
+			// End of the table
+			break;
+		}
+		flog_read_cached(src.block, src.sector + 1,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_invalidation_t));
+		deleted = buffer_union.file_invalidation_sector.timestamp !=
+		          FLOG_TIMESTAMP_INVALID;
+		if(deleted
+#if FS_ERASE_QUEUE_SIZE
+		   // Mounting without a checkpoint finds the chains still queued
+		   // by their entries, so those stay
+		   && !flog_erase_queue_has(file_id)
+#endif
+		   ){
+			continue;
+		}
+
+		if(flog_inode_prepare_new(&dst) != FLOG_SUCCESS){
+			goto abort;
+		}
+		// That may have used the buffer
+		flog_read_cached(src.block, src.sector,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_allocation_t));
+
+		flog_open_sector(dst.block, dst.sector);
+		flash_write_sector(&buffer_union.sector_buffer, dst.sector, 0,
+		                   sizeof(flog_inode_file_allocation_t));
+		flog_commit();
+
+		if(deleted){
+			flog_read_cached(src.block, src.sector + 1,
+			                 &buffer_union.sector_buffer, 0,
+			                 sizeof(flog_inode_file_invalidation_t));
+			flog_open_sector(dst.block, dst.sector + 1);
+			flash_write_sector(&buffer_union.sector_buffer, dst.sector + 1, 0,
+			                   sizeof(flog_inode_file_invalidation_t));
+			flog_commit();
+			num_kept += 1;
+			flog_inode_iterator_next(&dst);
+			continue;
+		}
+
+#if FS_FILE_INDEX_SIZE
+		buffer_union.allocation_sector.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+		flog_file_index_add(buffer_union.allocation_sector.filename,
+		                    dst.block, dst.sector,
+		                    buffer_union.allocation_sector.header.first_block,
+		                    buffer_union.allocation_sector.header.file_id);
+#endif
+		flog_inode_iterator_next(&dst);
+	}
+
+	// Switch over
+	buffer_union.invalidation_sector.timestamp = ++flogfs.t;
+	buffer_union.invalidation_sector.replacement_id = root.block;
+	buffer_union.invalidation_sector.replacement_age = root.age + 1;
+	flog_open_sector(old_inode0, FLOG_INODE_INVALIDATION_SECTOR);
+	flash_write_sector(&buffer_union.sector_buffer,
+	                   FLOG_INODE_INVALIDATION_SECTOR, 0,
+	                   sizeof(flog_inode_invalidation_sector_t));
+	buffer_union.invalidation_spare.copy_complete_marker =
+	   flog_copy_complete_marker;
+	buffer_union.invalidation_spare.nothing = 0;
+	buffer_union.invalidation_spare.reserved = 0;
+	flash_write_spare(&buffer_union.sector_buffer,
+	                  FLOG_INODE_INVALIDATION_SECTOR);
+	flog_commit();
+
+	flogfs.inode0 = root.block;
+	flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+	flogfs.compaction.old_inode0 = old_inode0;
+	flogfs.compaction.generation += 1;
+	flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_INODE0, FLOG_BLOCK_TYPE_INODE,
+	                    root.block, 0, 0, old_inode0);
+#if FS_FILE_INDEX_SIZE
+	flogfs.file_index.inode_tail = dst;
+#endif
+
+	// Now the old chain can go
+	flog_inode_release_chain(old_inode0, root_timestamp, 0);
+	flogfs.compaction.old_inode0 = FLOG_BLOCK_IDX_INVALID;
+	flogfs.num_dead_files = num_kept;
+
+	flash_unlock();
+	flog_unlock_fs();
+	return FLOG_SUCCESS;
+
+abort:
+	// Out of space, so the old chain stays
+	flog_inode_release_chain(root.block, root_timestamp, 1);
+	flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+#if FS_FILE_INDEX_SIZE
+	flog_file_index_rebuild();
+#endif
+failure:
+	flash_unlock();
+	flog_unlock_fs();
+	return FLOG_FAILURE;
+}
+
+
+void flogfs_start_ls(flogfs_ls_iterator_t * iter){
+	flog_enter_selected_volume();
+
+	// Compaction may be swapping inode0 out
+	flog_lock_fs();
+	// The header reads go through the shared read cache
+	flash_lock();
+	flog_inode_iterator_init(iter, flogfs.inode0);
+	iter->generation = flogfs.compaction.generation;
+	flash_unlock();
+	flog_unlock_fs();
+#if FS_NUM_VOLUMES > 1
+	iter->volume = flog_selected_volume;
+#endif
+}
+
+uint_fast8_t flogfs_ls_iterate(flogfs_ls_iterator_t * iter, char * fname_dst){
+	union {
+		uint8_t sector_buffer;
+		flog_file_id_t file_id;
+		flog_timestamp_t timestamp;
+        } buffer_union;
+	flog_enter_volume(FLOG_VOLUME_OF(iter));
+
+	// Each step holds the flash like flog_read_file_data() does, since the
+	// read cache is shared
+	flash_lock();
+	if(iter->generation != flogfs.compaction.generation){
+		// The chain it was walking has been released
+		flash_unlock();
+		return 0;
+	}
+	while(1){
+		flog_read_cached(iter->block, iter->sector,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_file_id_t));
+                if(buffer_union.file_id == FLOG_FILE_ID_INVALID){
+			// Nothing here. Done.
+			flash_unlock();
+			return 0;
+		}
+		// Now check to see if it's valid
+		flog_read_cached(iter->block, iter->sector + 1,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_timestamp_t));
+                if(buffer_union.timestamp == FLOG_TIMESTAMP_INVALID){
+			// This file's good
+			// Now check to see if it's valid
+			// Go read the filename
+			flog_read_cached(iter->block, iter->sector,
+			                 (uint8_t *)fname_dst,
+			                 sizeof(flog_inode_file_allocation_header_t),
+			                 FLOG_MAX_FNAME_LEN);
+			fname_dst[FLOG_MAX_FNAME_LEN-1] = '\0';
+			flog_inode_iterator_next(iter);
+			flash_unlock();
+			return 1;
+		} else {
+			flog_inode_iterator_next(iter);
+		}
+	}
+}
+
+void flogfs_stop_ls(flogfs_ls_iterator_t * iter){
+	// TODO: Unlock something?
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Static implementations
+///////////////////////////////////////////////////////////////////////////////
+
+flog_result_t flog_commit_file_sector(flog_write_file_t * file,
+                                      uint8_t const * data,
+                                      flog_sector_nbytes_t n){
+	flog_file_sector_spare_t file_sector_spare;
+#if FS_WRITE_BUFFER_POOL_SIZE
+	// Only the header has to be buffered if the file has no buffer, since
+	// the data is written straight from the caller
+	union {
+		flog_file_init_sector_header_t init;
+		flog_file_tail_sector_header_t tail;
+	} header_buffer;
+#endif
+	if(file->sector == FLOG_TAIL_SECTOR){
+		// We need a new block
+		flog_block_alloc_t next_block;
+#if FS_WRITE_BUFFER_POOL_SIZE
+		flog_file_tail_sector_header_t * const file_tail_sector_header =
+		   flog_write_file_buffer(file) ?
+		   (flog_file_tail_sector_header_t *) flog_write_file_buffer(file) :
+		   &header_buffer.tail;
+#else
+		flog_file_tail_sector_header_t * const file_tail_sector_header =
+		   (flog_file_tail_sector_header_t *) flog_write_file_buffer(file);
+#endif
+
+		flog_flush_dirty_blocks();
+
+		flog_lock_allocate();
+
+		next_block = flog_allocate_block();
+		if(next_block.block == FLOG_BLOCK_IDX_INVALID){
+			// Can't write the last sector without sealing the file.
+			// Bailing
+			flog_unlock_allocate();
+			return FLOG_FAILURE;
+		}
 
 		flog_unlock_allocate();
 
@@ -1399,10 +3129,19 @@ flog_result_t flog_commit_file_sector(flog_write_file_t * file,
 		file_tail_sector_header->next_age = next_block.age + 1;
 		file_tail_sector_header->next_block = next_block.block;
 		file_tail_sector_header->timestamp = ++flogfs.t;
-		file->bytes_in_block +=
-			FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t);
-		file_sector_spare.nbytes =
-			FS_SECTOR_SIZE - sizeof(flog_file_tail_sector_header_t);
+
+		flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_ALLOC, FLOG_BLOCK_TYPE_FILE,
+		                    next_block.block, next_block.age, file->id,
+		                    file->block);
+		flog_lock_allocate();
+		flog_dirty_block_add(next_block.block, next_block.age, file->block,
+		                     file);
+		flog_unlock_allocate();
+		// Anything already buffered was counted in flogfs_write()
+		file->bytes_in_block += n;
+		file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
+		file_sector_spare.nbytes = file->offset + n -
+			sizeof(flog_file_tail_sector_header_t);
 		file_tail_sector_header->bytes_in_block = file->bytes_in_block;
 
 		flog_open_sector(file->block, FLOG_TAIL_SECTOR);
@@ -1415,28 +3154,43 @@ flog_result_t flog_commit_file_sector(flog_write_file_t * file,
 		}
 		flash_write_spare((uint8_t const *)&file_sector_spare,
 		                  FLOG_TAIL_SECTOR);
-		flash_commit();
+		flog_commit_start();
 
 		// Ready the file structure for the next block/sector
 		file->block = next_block.block;
-		file->block_age = next_block.age;
+		file->block_age = next_block.age + 1;
 		file->sector = FLOG_INIT_SECTOR;
 		file->sector_remaining_bytes =
 		   FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
 		file->bytes_in_block = 0;
 		file->offset = sizeof(flog_file_init_sector_header_t);
 		file->write_head += n;
+#if FS_WRITE_BUFFER_POOL_SIZE
+		flog_write_buffer_put(file);
+#endif
 		return FLOG_SUCCESS;
 	} else {
+#if FS_PAGE_WRITE_BUFFER
+		// Whether this sector waits for the rest of the page
+		uint_fast8_t const wait_for_page =
+		   (file->offset + n == FS_SECTOR_SIZE) &&
+		   (flog_increment_sector(file->sector) / FS_SECTORS_PER_PAGE ==
+		    file->sector / FS_SECTORS_PER_PAGE)
+#if FS_WRITE_BUFFER_POOL_SIZE
+		   // Not worth taking another file's buffer for
+		   && (flog_write_buffer_get(file, 0) == FLOG_SUCCESS)
+#endif
+		   ;
+#endif
+#if FS_WRITE_BUFFER_POOL_SIZE
+		uint8_t * const buffer = flog_write_file_buffer(file) ?
+		   flog_write_file_buffer(file) : (uint8_t *)&header_buffer.init;
+#else
+		uint8_t * const buffer = flog_write_file_buffer(file);
+#endif
 		flog_file_init_sector_header_t * const file_init_sector_header =
-			(flog_file_init_sector_header_t *) file->sector_buffer;
+			(flog_file_init_sector_header_t *) buffer;
 
-		flog_lock_allocate();
-		// So if this block is the dirty block...
-		if(flogfs.dirty_block.file == file){
-			flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
-		}
-		flog_unlock_allocate();
 		file_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
 		file_sector_spare.nbytes = file->offset + n;
 
@@ -1448,17 +3202,60 @@ flog_result_t flog_commit_file_sector(flog_write_file_t * file,
 			file_sector_spare.nbytes -= sizeof(flog_file_init_sector_header_t);
 		}
 
+#if FS_PAGE_WRITE_BUFFER
+		if(wait_for_page){
+			// Wait for the rest of the page
+			memcpy(buffer + file->offset, data, n);
+			if(file->page_n == 0){
+				file->page_sector = file->sector;
+			}
+			file->page_nbytes[file->sector % FS_SECTORS_PER_PAGE] =
+			   file_sector_spare.nbytes;
+			file->page_n += 1;
+			goto advance;
+		}
+#endif
+
+		flog_lock_allocate();
+		// So if this block is a dirty block...
+		flog_dirty_block_remove(file);
+		flog_unlock_allocate();
+
+#if FS_CACHE_PROGRAM
+		// Only new data goes in, so there's nothing to read first
+		flog_load_sector(file->block, file->sector);
+#else
 		flog_open_sector(file->block, file->sector);
+#endif
+#if FS_PAGE_WRITE_BUFFER
+		// The full sectors before this one in the page
+		for(uint16_t sector = file->page_sector;
+		    sector < file->page_sector + file->page_n; sector++){
+			flog_file_sector_spare_t page_sector_spare;
+			page_sector_spare.type_id = FLOG_BLOCK_TYPE_FILE;
+			page_sector_spare.nbytes =
+			   file->page_nbytes[sector % FS_SECTORS_PER_PAGE];
+			flash_write_sector(file->sector_buffer +
+			                   FS_SECTOR_SIZE * (sector % FS_SECTORS_PER_PAGE),
+			                   sector, 0, FS_SECTOR_SIZE);
+			flash_write_spare((uint8_t const *)&page_sector_spare, sector);
+		}
+		file->page_n = 0;
+#endif
 		if(file->offset){
 			// This is either sector 0 or there was data already
 			// First write prior data/header
-			flash_write_sector(file->sector_buffer, file->sector, 0, file->offset);
+			flash_write_sector(buffer, file->sector, 0, file->offset);
 		}
 		if(n){
 			flash_write_sector(data, file->sector, file->offset, n);
 		}
 		flash_write_spare((uint8_t const *)&file_sector_spare, file->sector);
-		flash_commit();
+		flog_commit_start();
+
+#if FS_PAGE_WRITE_BUFFER
+advance:
+#endif
 
 		// Now update stuff for the new sector
 		file->sector = flog_increment_sector(file->sector);
@@ -1470,115 +3267,271 @@ flog_result_t flog_commit_file_sector(flog_write_file_t * file,
 		file->bytes_in_block += n;
 		file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
 		file->write_head += n;
+#if FS_WRITE_BUFFER_POOL_SIZE
+		if(!flog_write_file_is_buffered(file)){
+			flog_write_buffer_put(file);
+		}
+#endif
 		return FLOG_SUCCESS;
 	}
 }
 
+uint8_t * flog_write_file_buffer(flog_write_file_t * file){
+#if FS_WRITE_BUFFER_POOL_SIZE
+	if(file->sector_buffer == NULL){
+		return NULL;
+	}
+#endif
+#if FS_PAGE_WRITE_BUFFER
+	return file->sector_buffer +
+	       FS_SECTOR_SIZE * (file->sector % FS_SECTORS_PER_PAGE);
+#else
+	return file->sector_buffer;
+#endif
+}
+
 flog_result_t flog_flush_write (flog_write_file_t * file ){
 	return flog_commit_file_sector(file, 0, 0);
 }
 
+flog_result_t flog_read_file_locate(flog_read_file_t * file, uint32_t index){
+	flog_block_idx_t block = file->first_block;
+	uint16_t block_number = 0;
+	uint32_t block_start = 0;
+	uint32_t position;
+	uint16_t sector, header;
 
-void flog_prealloc_iterate() {
-	flog_block_alloc_t block;
-	block = flog_allocate_block_iterate();
-	flog_prealloc_push(block.block, block.age);
-}
+	flog_file_tail_sector_header_t tail_sector_header;
+	flog_file_init_sector_header_t init_sector_header;
+	flog_file_sector_spare_t file_sector_spare;
 
+#if FS_SEEK_INDEX_SIZE
+	for(uint16_t i = file->seek_index_n; i > 0; i--){
+		if(file->seek_index[i - 1].offset <= index){
+			block = file->seek_index[i - 1].block;
+			block_start = file->seek_index[i - 1].offset;
+			block_number = (i - 1) * file->seek_stride;
+			break;
+		}
+	}
+#endif
+	if((file->block_start <= index) && (file->block_start >= block_start)){
+		// Going forward (or staying in the same block)
+		block = file->block;
+		block_number = file->block_number;
+		block_start = file->block_start;
+	}
 
-flog_block_alloc_t flog_allocate_block_iterate(){
-        flog_block_alloc_t block;
+	file->block = block;
+	file->block_number = block_number;
+	file->block_start = block_start;
+#if FS_READ_AHEAD
+	// Reading from the start is assumed to carry on
+	file->sequential_pages = (index == 0) ? 1 : 0;
+#endif
 
-	flog_block_stat_sector_t block_stat_sector;
+	// Skip whole blocks using their tail sectors
+	while(1){
+		flog_read_cached(file->block, FLOG_TAIL_SECTOR,
+		                 (uint8_t *)&tail_sector_header, 0,
+		                 sizeof(flog_file_tail_sector_header_t));
+		if((tail_sector_header.timestamp == FLOG_TIMESTAMP_INVALID) ||
+		   (index < file->block_start + tail_sector_header.bytes_in_block)){
+			// It's in this block, if anywhere
+			break;
+		}
+		// Make sure the next block has been started
+		flog_read_cached(tail_sector_header.next_block,
+		                 FLOG_INIT_SECTOR,
+		                 (uint8_t *)&init_sector_header, 0,
+		                 sizeof(flog_file_init_sector_header_t));
+		if(init_sector_header.file_id != file->id){
+			// Park at the end of this block so reads pick up the next one
+			file->sector = FLOG_TAIL_SECTOR;
+			file->offset = FS_SECTOR_SIZE;
+			file->sector_remaining_bytes = 0;
+			file->read_head = file->block_start +
+			                  tail_sector_header.bytes_in_block;
+			return FLOG_RESULT(file->read_head == index);
+		}
+		file->block = tail_sector_header.next_block;
+		file->block_number += 1;
+		file->block_start += tail_sector_header.bytes_in_block;
+#if FS_SEEK_INDEX_SIZE
+		flog_seek_index_add(file);
+#endif
+	}
 
-	block.block = FLOG_BLOCK_IDX_INVALID;
-	
-	if(flogfs.free_block_bitmap[flogfs.allocate_head] &
-	   (1 << (flogfs.allocate_head % 8))){
-		// This block is okay to look at
-		flog_get_block_stat(flogfs.allocate_head, &block_stat_sector);
-		block.age = block_stat_sector.age;
-		block.block = flogfs.allocate_head;
+	if((tail_sector_header.timestamp != FLOG_TIMESTAMP_INVALID) &&
+	   (tail_sector_header.bytes_in_block == FLOG_FILE_BLOCK_CAPACITY)){
+		// Every sector is full so there's nothing to look up
+		position = index - file->block_start;
+		if(position < FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t)){
+			file->sector = FLOG_INIT_SECTOR;
+			file->offset = sizeof(flog_file_init_sector_header_t) + position;
+		} else {
+			position -= FS_SECTOR_SIZE - sizeof(flog_file_init_sector_header_t);
+			if(position < (FS_SECTORS_PER_BLOCK - 3) * FS_SECTOR_SIZE){
+				sector = position / FS_SECTOR_SIZE;
+				file->sector = sector ? (FLOG_TAIL_SECTOR + sector) :
+				                        (FLOG_TAIL_SECTOR - 1);
+				file->offset = position % FS_SECTOR_SIZE;
+			} else {
+				file->sector = FLOG_TAIL_SECTOR;
+				file->offset = sizeof(flog_file_tail_sector_header_t) + position -
+				               (FS_SECTORS_PER_BLOCK - 3) * FS_SECTOR_SIZE;
+			}
+		}
+		file->sector_remaining_bytes = FS_SECTOR_SIZE - file->offset;
+		file->read_head = index;
+		return FLOG_SUCCESS;
 	}
 
-	// Move the head
-	flogfs.allocate_head = (flogfs.allocate_head + 1) % FS_NUM_BLOCKS;
+	// Then sectors using their spare
+	position = file->block_start;
+	sector = FLOG_INIT_SECTOR;
+	file->sector = FLOG_INIT_SECTOR;
+	file->offset = sizeof(flog_file_init_sector_header_t);
+	file->sector_remaining_bytes = 0;
+	while(1){
+		flog_open_sector(file->block, sector);
+		flash_read_spare((uint8_t *)&file_sector_spare, sector);
+		if(file_sector_spare.nbytes == FLOG_SECTOR_NBYTES_INVALID){
+			// Nothing more written, so stay at the end of the last sector
+			break;
+		}
 
-	return block;
-}
+		switch(sector){
+		case FLOG_INIT_SECTOR:
+			header = sizeof(flog_file_init_sector_header_t);
+			break;
+		case FLOG_TAIL_SECTOR:
+			header = sizeof(flog_file_tail_sector_header_t);
+			break;
+		default:
+			header = 0;
+		}
 
-static void flog_prealloc_push(flog_block_idx_t block,
-                               flog_block_age_t age){
-	if(flogfs.prealloc.n == 0){
-		flogfs.prealloc.blocks[0].block = block;
-		flogfs.prealloc.blocks[0].age = age;
-		flogfs.prealloc.n = 1;
-		flogfs.prealloc.age_sum += age;
-		return;
+		file->sector = sector;
+		if(index < position + file_sector_spare.nbytes){
+			file->offset = header + (index - position);
+			file->sector_remaining_bytes = file_sector_spare.nbytes -
+			                               (index - position);
+			file->read_head = index;
+			return FLOG_SUCCESS;
+		}
+		position += file_sector_spare.nbytes;
+		file->offset = header + file_sector_spare.nbytes;
+		if(sector == FLOG_TAIL_SECTOR){
+			break;
+		}
+		sector = flog_increment_sector(sector);
 	}
 
-	if((flogfs.prealloc.n == FS_PREALLOCATE_SIZE) &&
-	   (flogfs.prealloc.blocks[flogfs.prealloc.n - 1].age < age)){
-		// This block sucks
-		return;
-	}
-	for(flog_block_idx_t i = flogfs.prealloc.n - 1; i; i--){
-		// Search for the right place (start at end)
-		if(age <= flogfs.prealloc.blocks[i].age){
-			if(flogfs.prealloc.n == FS_PREALLOCATE_SIZE){
-				// Last block will be discarded
-				flogfs.prealloc.age_sum -=
-				  flogfs.prealloc.blocks[FS_PREALLOCATE_SIZE - 1].age;
-			}
-			for(flog_block_idx_t j = MIN(flogfs.prealloc.n,
-			                             FS_PREALLOCATE_SIZE - 1);
-			    j > i; j--){
-				// Shift all older blocks
-				flogfs.prealloc.blocks[j].age =
-				   flogfs.prealloc.blocks[j - 1].age;
-				flogfs.prealloc.blocks[j].block =
-				   flogfs.prealloc.blocks[j - 1].block;
-			}
-			if(flogfs.prealloc.n < FS_PREALLOCATE_SIZE){
-				flogfs.prealloc.n += 1;
-			}
-			flogfs.prealloc.blocks[i].age = age;
-			flogfs.prealloc.blocks[i].block = block;
+	file->read_head = position;
+	return FLOG_RESULT(position == index);
+}
 
-			flogfs.prealloc.age_sum += age;
-			return;
+#if FS_TAIL_HINT_SIZE
+flog_result_t flog_tail_hint_get(flog_file_id_t file_id,
+                                 flog_tail_hint_t * hint){
+	flog_file_init_sector_header_t init_sector_header;
+
+	for(uint16_t i = 0; i < FS_TAIL_HINT_SIZE; i++){
+		if(flogfs.tail_hints[i].file_id != file_id){
+			continue;
 		}
+		*hint = flogfs.tail_hints[i];
+		if((hint->block >= FS_NUM_BLOCKS) ||
+		   (hint->sector >= FS_SECTORS_PER_BLOCK)){
+			return FLOG_FAILURE;
+		}
+		flog_read_cached(hint->block, FLOG_INIT_SECTOR,
+		                 (uint8_t *)&init_sector_header, 0,
+		                 sizeof(flog_file_init_sector_header_t));
+		if(init_sector_header.file_id == file_id){
+			return FLOG_SUCCESS;
+		}
+		return FLOG_RESULT(
+		   (init_sector_header.file_id == FLOG_FILE_ID_INVALID) &&
+		   (hint->sector == FLOG_INIT_SECTOR) &&
+		   (hint->bytes_in_block == 0));
 	}
+	return FLOG_FAILURE;
 }
 
-uint_fast8_t flog_age_is_sufficient(int32_t threshold,
-                                    flog_block_age_t age){
-	if((int32_t)flogfs.mean_free_age - (int32_t)age >= threshold)
-		return 1;
-	return 0;
-}
+void flog_tail_hint_set(flog_write_file_t const * file){
+	uint16_t i;
 
-static flog_block_alloc_t flog_prealloc_pop(int32_t threshold) {
-	flog_block_alloc_t block;
-	if((flogfs.prealloc.n == 0) ||
-	   !flog_age_is_sufficient(threshold, flogfs.prealloc.blocks[0].age)){
-		block.block = FLOG_BLOCK_IDX_INVALID;
-		return block;
+	// Bump it (or the oldest one) to the front
+	for(i = 0; i < FS_TAIL_HINT_SIZE - 1; i++){
+		if(flogfs.tail_hints[i].file_id == file->id){
+			break;
+		}
+	}
+	for(; i > 0; i--){
+		flogfs.tail_hints[i] = flogfs.tail_hints[i - 1];
 	}
+	flogfs.tail_hints[0].file_id = file->id;
+	flogfs.tail_hints[0].block = file->block;
+	flogfs.tail_hints[0].sector = file->sector;
+	flogfs.tail_hints[0].bytes_in_block = file->bytes_in_block;
+	flogfs.tail_hints[0].write_head = file->write_head;
+}
 
-	block.block = flogfs.prealloc.blocks[0].block;
-	block.age = flogfs.prealloc.blocks[0].age;
+void flog_tail_hint_remove(flog_file_id_t file_id){
+	for(uint16_t i = 0; i < FS_TAIL_HINT_SIZE; i++){
+		if(flogfs.tail_hints[i].file_id != file_id){
+			continue;
+		}
+		for(; i < FS_TAIL_HINT_SIZE - 1; i++){
+			flogfs.tail_hints[i] = flogfs.tail_hints[i + 1];
+		}
+		memset(&flogfs.tail_hints[i], 0xFF, sizeof(flog_tail_hint_t));
+		return;
+	}
+}
+#endif
 
-	// Shift all of the other entries forward
-	flogfs.prealloc.n -= 1;
-	for(flog_block_idx_t i = 0; i < flogfs.prealloc.n; i++){
-		flogfs.prealloc.blocks[i].age = flogfs.prealloc.blocks[i + 1].age;
-		flogfs.prealloc.blocks[i].block = flogfs.prealloc.blocks[i + 1].block;
+#if FS_SEEK_INDEX_SIZE
+void flog_seek_index_add(flog_read_file_t * file){
+	if(file->block_number % file->seek_stride){
+		return;
 	}
-	return block;
+	if(file->block_number / file->seek_stride != file->seek_index_n){
+		// Already there
+		return;
+	}
+	if(file->seek_index_n == FS_SEEK_INDEX_SIZE){
+		// Thin it out
+		for(uint16_t i = 0; 2 * i < FS_SEEK_INDEX_SIZE; i++){
+			file->seek_index[i] = file->seek_index[2 * i];
+		}
+		file->seek_index_n = (FS_SEEK_INDEX_SIZE + 1) / 2;
+		file->seek_stride *= 2;
+		if((file->block_number % file->seek_stride) ||
+		   (file->block_number / file->seek_stride != file->seek_index_n)){
+			return;
+		}
+	}
+	file->seek_index[file->seek_index_n].block = file->block;
+	file->seek_index[file->seek_index_n].offset = file->block_start;
+	file->seek_index_n += 1;
 }
+#endif
+
 
 static flog_result_t flog_open_page(uint16_t block, uint16_t page){
+#if FS_PLANES > 1
+	// The next plane of a held multi-plane program goes in without sending
+	// the program out
+	if(!flog_page_joins_planes(block, page)){
+		flog_flash_wait_chip(FLOG_PAGE_CHIP(page));
+	}
+#else
+	// Programs on other chips can keep running
+	flog_flash_wait_chip(FLOG_PAGE_CHIP(page));
+#endif
 	if(flogfs.cache_status.page_open &&
 	   (flogfs.cache_status.current_open_block == block) &&
 	   (flogfs.cache_status.current_open_page == page)){
@@ -1596,39 +3549,331 @@ flog_result_t flog_open_sector(uint16_t block, uint16_t sector){
 	return flog_open_page(block, sector / FS_SECTORS_PER_PAGE);
 }
 
-void flog_close_sector(){
+#if FS_CACHE_PROGRAM
+void flog_load_sector(flog_block_idx_t block, uint16_t sector){
+	uint16_t const page = sector / FS_SECTORS_PER_PAGE;
+#if FS_PLANES > 1
+	uint_fast8_t const chip = FLOG_PAGE_CHIP(page);
+	if((flogfs.cache_status.queued & (1 << chip)) &&
+	   !flog_page_joins_planes(block, page)){
+		flog_flash_wait_chip(chip);
+	}
+#endif
+	flash_load_page(block, page);
+	// The register only holds what gets written to it
 	flogfs.cache_status.page_open = 0;
+	flogfs.cache_status.current_open_block = block;
+	flogfs.cache_status.current_open_page = page;
 }
+#endif
 
-flog_block_idx_t
-flog_universal_get_next_block(flog_block_idx_t block){
-	if(block == FLOG_BLOCK_IDX_INVALID)
-		return block;
-	flog_open_sector(block, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t*)&block, FLOG_TAIL_SECTOR,
-	                  0, sizeof(block));
-	return block;
+#if FS_READ_AHEAD
+void flog_read_ahead(flog_block_idx_t block, uint16_t sector){
+	if(sector == FLOG_TAIL_SECTOR){
+		flog_file_tail_sector_header_t tail;
+		flog_read_cached(block, FLOG_TAIL_SECTOR, &tail, 0, sizeof(tail));
+		if((tail.timestamp == FLOG_TIMESTAMP_INVALID) ||
+		   (tail.next_block >= FS_NUM_BLOCKS)){
+			return;
+		}
+		block = tail.next_block;
+		sector = FLOG_INIT_SECTOR;
+	} else {
+		// The next sector after the last one in this page
+		sector = flog_increment_sector((sector / FS_SECTORS_PER_PAGE + 1) *
+		                               FS_SECTORS_PER_PAGE - 1);
+	}
+	flog_flash_wait_chip(FLOG_PAGE_CHIP(sector / FS_SECTORS_PER_PAGE));
+	flash_read_ahead(block, sector / FS_SECTORS_PER_PAGE);
 }
+#endif
 
-
-void flog_inode_iterator_init(flog_inode_iterator_t * iter,
-                              flog_block_idx_t inode0){
-        union {
-		uint8_t spare_buffer;
-		flog_inode_init_sector_spare_t inode_init_sector_spare;
-        } buffer_union;
-	iter->block = inode0;
-	flog_open_sector(inode0, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t *)&iter->next_block, FLOG_TAIL_SECTOR, 0,
-	                  sizeof(flog_block_idx_t));
-	// Get the current inode block index
-	flog_open_sector(inode0, FLOG_INIT_SECTOR);
-        flash_read_spare(&buffer_union.spare_buffer, FLOG_INIT_SECTOR);
-        iter->inode_block_idx = buffer_union.inode_init_sector_spare.inode_index;
-
-	// This is zero anyways
-	iter->inode_idx = 0;
-	iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
+void flog_close_sector(){
+	flog_flash_wait();
+	flogfs.cache_status.page_open = 0;
+}
+
+void flog_commit_start(){
+#if FS_ASYNC_FLASH
+	uint16_t const page = flogfs.cache_status.current_open_page;
+	uint_fast8_t const chip = FLOG_PAGE_CHIP(page);
+#if FS_READ_CACHE_SIZE
+	flog_read_cache_drop(flogfs.cache_status.current_open_block, page);
+#endif
+#if FS_PLANES > 1
+	if(FLOG_PAGE_PLANE(page) < FS_PLANES - 1){
+		// Hold it to go out with the page of the next plane
+		flash_commit_plane();
+		flogfs.cache_status.queued |= 1 << chip;
+		flogfs.cache_status.queued_block =
+		   flogfs.cache_status.current_open_block;
+		flogfs.cache_status.queued_page = page;
+		return;
+	}
+#endif
+	// Programs on other chips finish first, so a power cut can't leave a
+	// page programmed after an earlier one which was lost
+	for(uint_fast8_t other = 0; other < FS_STRIPE_CHIPS; other++){
+		if(other != chip){
+			flog_flash_wait_chip(other);
+		}
+	}
+#if FS_CACHE_PROGRAM
+	// Anything still running here is a cache program too, so pages can be
+	// loaded behind this one
+	flash_commit_cache();
+#else
+	flash_commit_start();
+#endif
+	flogfs.cache_status.busy |= 1 << chip;
+#if FS_PLANES > 1
+	// The pages held on this chip went with it
+	flogfs.cache_status.queued &= ~(1 << chip);
+#endif
+#else
+	flog_commit();
+#endif
+}
+
+void flog_commit(){
+#if FS_READ_CACHE_SIZE
+	flog_read_cache_drop(flogfs.cache_status.current_open_block,
+	                     flogfs.cache_status.current_open_page);
+#endif
+	flog_flash_wait();
+	flash_commit();
+}
+
+flog_result_t flog_erase_block(flog_block_idx_t block){
+#if FS_READ_CACHE_SIZE
+	flog_read_cache_drop(block, FS_PAGES_PER_BLOCK);
+#endif
+	// The block is erased on every chip
+	flog_flash_wait();
+	return flash_erase_block(block);
+}
+
+void flog_flash_wait(){
+	for(uint_fast8_t chip = 0; chip < FS_STRIPE_CHIPS; chip++){
+		flog_flash_wait_chip(chip);
+	}
+}
+
+void flog_flash_wait_chip(uint_fast8_t chip){
+#if FS_ASYNC_FLASH
+#if FS_PLANES > 1
+	// Held pages are programmed on their own
+	flogfs.cache_status.busy |= flogfs.cache_status.queued & (1 << chip);
+	flogfs.cache_status.queued &= ~(1 << chip);
+#endif
+	if(flogfs.cache_status.busy & (1 << chip)){
+#if FS_STRIPE_CHIPS > 1
+		flash_wait_chip(chip);
+#else
+		flash_wait();
+#endif
+		flogfs.cache_status.busy &= ~(1 << chip);
+	}
+#else
+	(void)chip;
+#endif
+}
+
+#if FS_PLANES > 1
+uint_fast8_t flog_page_joins_planes(flog_block_idx_t block, uint16_t page){
+	return (flogfs.cache_status.queued & (1 << FLOG_PAGE_CHIP(page))) &&
+	       (flogfs.cache_status.queued_block == block) &&
+	       (flogfs.cache_status.queued_page + 1 == page);
+}
+
+void flog_flash_send_planes(){
+	for(uint_fast8_t chip = 0; chip < FS_STRIPE_CHIPS; chip++){
+		if(flogfs.cache_status.queued & (1 << chip)){
+			flog_flash_wait_chip(chip);
+		}
+	}
+}
+#endif
+
+/*!
+ @brief Open the page of a sector for a metadata read, counting whether the
+ cache register already held it
+ */
+static flog_result_t flog_read_cache_open(flog_block_idx_t block,
+                                          uint16_t sector){
+	if(flogfs.cache_status.page_open &&
+	   (flogfs.cache_status.current_open_block == block) &&
+	   (flogfs.cache_status.current_open_page == sector / FS_SECTORS_PER_PAGE)){
+		flogfs.read_cache_stats.register_hits += 1;
+	} else {
+		flogfs.read_cache_stats.misses += 1;
+	}
+	return flog_open_sector(block, sector);
+}
+
+#if FS_READ_CACHE_SIZE
+void flog_read_cache_drop(flog_block_idx_t block, uint16_t page){
+	for(uint16_t i = 0; i < FS_READ_CACHE_SIZE; i++){
+		flog_read_cache_entry_t * const entry = &flogfs.read_cache.entries[i];
+		if((entry->block == block) &&
+		   ((page == FS_PAGES_PER_BLOCK) ||
+		    (entry->sector / FS_SECTORS_PER_PAGE == page))){
+			entry->block = FLOG_BLOCK_IDX_INVALID;
+			entry->last_used = 0;
+		}
+	}
+}
+
+/*!
+ @brief Find a sector in the read cache, loading it in place of the least
+ recently used entry if it isn't there
+ @param block The block
+ @param sector The sector
+ @param data_bytes The number of bytes needed from the start of the sector
+ @param spare Whether the spare is needed
+ @return The entry, or NULL if the page couldn't be opened
+
+ Only what has been asked for is read, so an entry can fill in over a few
+ reads. The rest of the sector costs bus time that most callers never use.
+ */
+static flog_read_cache_entry_t * flog_read_cache_get(flog_block_idx_t block,
+                                                     uint16_t sector,
+                                                     uint16_t data_bytes,
+                                                     uint_fast8_t spare){
+	flog_read_cache_entry_t * entry = &flogfs.read_cache.entries[0];
+
+	flogfs.read_cache.clock += 1;
+	for(uint16_t i = 0; i < FS_READ_CACHE_SIZE; i++){
+		flog_read_cache_entry_t * const candidate =
+		   &flogfs.read_cache.entries[i];
+		if((candidate->block == block) && (candidate->sector == sector)){
+			entry = candidate;
+			break;
+		}
+		// Unused entries have last_used == 0 so they go first
+		if(candidate->last_used < entry->last_used){
+			entry = candidate;
+		}
+	}
+
+	if((entry->block != block) || (entry->sector != sector)){
+		entry->block = FLOG_BLOCK_IDX_INVALID;
+		entry->data_bytes = 0;
+		entry->has_spare = 0;
+	} else if((data_bytes <= entry->data_bytes) &&
+	          (!spare || entry->has_spare)){
+		entry->last_used = flogfs.read_cache.clock;
+		flogfs.read_cache_stats.hits += 1;
+		return entry;
+	}
+
+	if(flog_read_cache_open(block, sector) != FLOG_SUCCESS){
+		return NULL;
+	}
+	if(data_bytes > entry->data_bytes){
+		flash_read_sector(entry->data + entry->data_bytes, sector,
+		                  entry->data_bytes, data_bytes - entry->data_bytes);
+		entry->data_bytes = data_bytes;
+	}
+	if(spare && !entry->has_spare){
+		flash_read_spare(entry->spare, sector);
+		entry->has_spare = 1;
+	}
+	entry->block = block;
+	entry->sector = sector;
+	entry->last_used = flogfs.read_cache.clock;
+	return entry;
+}
+#endif
+
+/*!
+ @details
+ ### Internals
+ The cache register is the first level: a read of the page it already holds
+ costs no array read. Behind it, up to the first FLOG_READ_CACHE_BYTES of
+ recently read sectors and their spares are kept in RAM. That covers every header
+ FLogFS looks at when it follows chains and searches inodes, so walking the
+ same blocks again (the inode table, the tail of a file being appended) doesn't
+ keep reloading pages. Entries are dropped whenever their page is programmed
+ or their block erased, so they never differ from the flash.
+ */
+flog_result_t flog_read_cached(flog_block_idx_t block, uint16_t sector,
+                               void * dst, uint16_t offset, uint16_t n){
+	flog_result_t result;
+#if FS_READ_CACHE_SIZE
+	if(offset + n <= FLOG_READ_CACHE_BYTES){
+		flog_read_cache_entry_t const * const entry =
+		   flog_read_cache_get(block, sector, offset + n, 0);
+		if(entry != NULL){
+			memcpy(dst, entry->data + offset, n);
+			return FLOG_SUCCESS;
+		}
+		// Give back whatever the register has, the same as an uncached read
+		flash_read_sector((uint8_t *)dst, sector, offset, n);
+		return FLOG_FAILURE;
+	}
+#endif
+	result = flog_read_cache_open(block, sector);
+	flash_read_sector((uint8_t *)dst, sector, offset, n);
+	return result;
+}
+
+flog_result_t flog_read_spare_cached(flog_block_idx_t block, uint16_t sector,
+                                     void * dst){
+#if FS_READ_CACHE_SIZE
+	flog_read_cache_entry_t const * const entry =
+	   flog_read_cache_get(block, sector, 0, 1);
+	if(entry != NULL){
+		memcpy(dst, entry->spare, sizeof(entry->spare));
+		return FLOG_SUCCESS;
+	}
+	flash_read_spare((uint8_t *)dst, sector);
+	return FLOG_FAILURE;
+#else
+	flog_result_t const result = flog_read_cache_open(block, sector);
+	flash_read_spare((uint8_t *)dst, sector);
+	return result;
+#endif
+}
+
+void flog_read_cache_reset(){
+#if FS_READ_CACHE_SIZE
+	for(uint16_t i = 0; i < FS_READ_CACHE_SIZE; i++){
+		flogfs.read_cache.entries[i].block = FLOG_BLOCK_IDX_INVALID;
+		flogfs.read_cache.entries[i].last_used = 0;
+	}
+	flogfs.read_cache.clock = 0;
+#endif
+	memset(&flogfs.read_cache_stats, 0, sizeof(flogfs.read_cache_stats));
+}
+
+flog_block_idx_t
+flog_universal_get_next_block(flog_block_idx_t block){
+	if(block == FLOG_BLOCK_IDX_INVALID)
+		return block;
+	flog_read_cached(block, FLOG_TAIL_SECTOR, (uint8_t*)&block, 0,
+	                 sizeof(block));
+	return block;
+}
+
+
+void flog_inode_iterator_init(flog_inode_iterator_t * iter,
+                              flog_block_idx_t inode0){
+        union {
+		uint8_t spare_buffer;
+		flog_inode_init_sector_spare_t inode_init_sector_spare;
+        } buffer_union;
+	iter->block = inode0;
+	flog_read_cached(inode0, FLOG_TAIL_SECTOR, (uint8_t *)&iter->next_block,
+	                 0, sizeof(flog_block_idx_t));
+	// Get the current inode block index
+	flog_read_spare_cached(inode0, FLOG_INIT_SECTOR,
+	                       &buffer_union.spare_buffer);
+        iter->inode_block_idx = buffer_union.inode_init_sector_spare.inode_index;
+
+	// This is zero anyways
+	iter->inode_idx = 0;
+	iter->sector = FLOG_INODE_FIRST_ENTRY_SECTOR;
 }
 
 /*!
@@ -1670,9 +3915,8 @@ flog_block_idx_t
 flog_inode_get_prev_block(flog_block_idx_t block){
 	if(block == FLOG_BLOCK_IDX_INVALID)
 		return block;
-	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t*)&block, FLOG_INIT_SECTOR,
-	                  sizeof(flog_timestamp_t), sizeof(block));
+	flog_read_cached(block, FLOG_INIT_SECTOR, (uint8_t*)&block,
+	                 sizeof(flog_timestamp_t), sizeof(block));
 	return block;
 }
 
@@ -1713,39 +3957,42 @@ flog_result_t flog_inode_prepare_new (flog_inode_iterator_t * iter) {
 		// This entry is valid and will be used but now is the time to allocate
 		// the next block
 
-		flog_lock_allocate();
+		flog_flush_dirty_blocks();
 
-		flog_flush_dirty_block();
+		flog_lock_allocate();
 
-		block_alloc = flog_allocate_block(0);
+		block_alloc = flog_allocate_block();
 		if(block_alloc.block == FLOG_BLOCK_IDX_INVALID){
 			// Couldn't allocate a new block!
 			flog_unlock_allocate();
 			return FLOG_FAILURE;
 		}
 
-		flogfs.num_free_blocks -= 1;
-
 		flog_unlock_allocate();
 
 		// Go write the tail sector
-		flog_open_sector(iter->block, FLOG_TAIL_SECTOR);
                 buffer_union.inode_tail_sector.next_age = block_alloc.age + 1;
                 buffer_union.inode_tail_sector.next_block = block_alloc.block;
                 buffer_union.inode_tail_sector.timestamp = ++flogfs.t;
+		flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_ALLOC, FLOG_BLOCK_TYPE_INODE,
+		                    block_alloc.block, block_alloc.age, 0, iter->block);
+		flog_open_sector(iter->block, FLOG_TAIL_SECTOR);
                 flash_write_sector(&buffer_union.sector_buffer, FLOG_TAIL_SECTOR, 0,
 		                   sizeof(flog_universal_tail_sector_t));
-		flash_commit();
+		flog_commit();
 
 		// And prepare the header
 		flog_open_sector(block_alloc.block, FLOG_INIT_SECTOR);
                 buffer_union.inode_init_sector.timestamp = flogfs.t;
+		buffer_union.inode_init_sector.previous = iter->block;
+		buffer_union.inode_init_sector.max_file_id = flogfs.max_file_id;
+		buffer_union.inode_init_sector.version = FLOG_FORMAT_VERSION;
                 flash_write_sector(&buffer_union.sector_buffer, FLOG_INIT_SECTOR, 0,
 		                   sizeof(flog_inode_init_sector_t));
                 buffer_union.inode_init_sector_spare.type_id = FLOG_BLOCK_TYPE_INODE;
                 buffer_union.inode_init_sector_spare.inode_index = ++iter->inode_block_idx;
-                flash_write_spare(&buffer_union.sector_buffer, 0);
-		flash_commit();
+                flash_write_spare(&buffer_union.sector_buffer, FLOG_INIT_SECTOR);
+		flog_commit();
 
 		iter->next_block = block_alloc.block;
 	}
@@ -1756,9 +4003,9 @@ flog_result_t flog_inode_prepare_new (flog_inode_iterator_t * iter) {
 
 flog_file_id_t flog_block_get_file_id(flog_block_idx_t block){
 	flog_file_id_t id;
-	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t *)&id, FLOG_INIT_SECTOR,
-	                  sizeof(flog_block_age_t), sizeof(flog_file_id_t));
+	flog_read_cached(block, FLOG_INIT_SECTOR, (uint8_t *)&id,
+	                 offsetof(flog_file_init_sector_header_t, file_id),
+	                 sizeof(flog_file_id_t));
 	return id;
 }
 
@@ -1768,15 +4015,13 @@ void flog_write_block_stat(flog_block_idx_t block,
 	flash_write_sector((uint8_t const *)stat,
 	                   FLOG_BLK_STAT_SECTOR, 0,
 	                   sizeof(flog_block_stat_sector_t));
-	flash_commit();
+	flog_commit();
 }
 
 void flog_get_block_stat(flog_block_idx_t block,
                          flog_block_stat_sector_t * stat){
-	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
-	flash_read_sector((uint8_t *)stat,
-	                   FLOG_BLK_STAT_SECTOR, 0,
-	                   sizeof(flog_block_stat_sector_t));
+	flog_read_cached(block, FLOG_BLK_STAT_SECTOR, (uint8_t *)stat, 0,
+	                 sizeof(flog_block_stat_sector_t));
 }
 
 void flog_invalidate_chain (flog_block_idx_t base, flog_file_id_t file_id) {
@@ -1791,8 +4036,6 @@ void flog_invalidate_chain (flog_block_idx_t base, flog_file_id_t file_id) {
         } tail_buffer_union;
 	flog_block_stat_sector_t block_stat;
 	
-	flog_block_idx_t num_freed = 0;
-	
 	flog_lock_delete();
 	
 	flogfs.t_allocation_ceiling = flogfs.t;
@@ -1822,33 +4065,34 @@ void flog_invalidate_chain (flog_block_idx_t base, flog_file_id_t file_id) {
 // 			return;
 		case FLOG_BLOCK_TYPE_FILE:
 			// Check if this is indeed still the correct file
-			flog_open_sector(base, FLOG_INIT_SECTOR);
-                        flash_read_sector((uint8_t *)&init_buffer_union.init_sector, FLOG_INIT_SECTOR, 0,
-			                  sizeof(flog_file_init_sector_header_t));
+			flog_read_cached(base, FLOG_INIT_SECTOR,
+			                 (uint8_t *)&init_buffer_union.init_sector,
+			                 0,
+			                 sizeof(flog_file_init_sector_header_t));
 			if((file_id != FLOG_FILE_ID_INVALID) &&
                            (init_buffer_union.init_sector.file_id == file_id)){
 				// Well it's time to invalidate this
 				// Get the age of this block
 				// The the age and index of the next block
                                 block_stat.age = init_buffer_union.init_sector.age;
-				flog_open_sector(base, FLOG_TAIL_SECTOR);
-                                flash_read_sector((uint8_t *)&tail_buffer_union.file_tail_sector,
-				                  FLOG_TAIL_SECTOR, 0,
-				                  sizeof(flog_file_tail_sector_header_t));
+				flog_read_cached(base, FLOG_TAIL_SECTOR,
+				                 (uint8_t *)&tail_buffer_union.file_tail_sector,
+				                 0,
+				                 sizeof(flog_file_tail_sector_header_t));
                                 block_stat.next_block = tail_buffer_union.file_tail_sector.next_block;
                                 block_stat.next_age = tail_buffer_union.file_tail_sector.next_age;
 				block_stat.timestamp = ++flogfs.t;
 				// Need to clear cache
 				flog_close_sector();
 				
-				flash_erase_block(base);
+				flog_erase_block(base);
 				
 				flog_write_block_stat(base, &block_stat);
-				flogfs.free_block_bitmap[base / 8] |= 1 << (base % 8);
-				
-				num_freed += 1;
-				
-				flogfs.free_block_sum += block_stat.age;
+				flog_release_block(base, block_stat.age);
+
+				flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_FREE,
+				                    FLOG_BLOCK_TYPE_UNALLOCATED, base,
+				                    block_stat.age, 0, FLOG_BLOCK_IDX_INVALID);
 				
 				base = block_stat.next_block;
 			}
@@ -1860,70 +4104,232 @@ void flog_invalidate_chain (flog_block_idx_t base, flog_file_id_t file_id) {
 
 	}
 done:
-	flogfs.num_free_blocks += num_freed;
-	flogfs.mean_free_age = flogfs.free_block_sum / flogfs.num_free_blocks;
 	flogfs.t_allocation_ceiling = FLOG_TIMESTAMP_INVALID;
 	flog_unlock_delete();
 }
 
+#if FS_ERASE_QUEUE_SIZE
+void flog_erase_free_block(flog_block_idx_t block, flog_block_age_t age,
+                           flog_block_idx_t next_block){
+	flog_block_stat_sector_t block_stat;
+
+	block_stat.age = age;
+	block_stat.timestamp = flogfs.t;
+	block_stat.next_block = next_block;
+	block_stat.next_age = FLOG_BLOCK_AGE_INVALID;
+
+	flog_close_sector();
+	flog_erase_block(block);
+	flog_write_block_stat(block, &block_stat);
+	flog_release_block(block, age);
+}
+
+flog_result_t flog_erase_queue_add(flog_file_id_t file_id,
+                                   flog_block_idx_t block){
+	if(flog_erase_queue_has(file_id)){
+		return FLOG_SUCCESS;
+	}
+	if(flogfs.erase_queue.n == FS_ERASE_QUEUE_SIZE){
+		return FLOG_FAILURE;
+	}
+	flogfs.erase_queue.entries[flogfs.erase_queue.n].file_id = file_id;
+	flogfs.erase_queue.entries[flogfs.erase_queue.n].block = block;
+	flogfs.erase_queue.n += 1;
+	return FLOG_SUCCESS;
+}
+
+uint_fast8_t flog_erase_queue_has(flog_file_id_t file_id){
+	for(uint16_t i = 0; i < flogfs.erase_queue.n; i++){
+		if(flogfs.erase_queue.entries[i].file_id == file_id){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void flog_erase_queue_advance(flog_file_id_t file_id,
+                              flog_block_idx_t next_block){
+	for(uint16_t i = 0; i < flogfs.erase_queue.n; i++){
+		if(flogfs.erase_queue.entries[i].file_id != file_id){
+			continue;
+		}
+		if(next_block != FLOG_BLOCK_IDX_INVALID){
+			flogfs.erase_queue.entries[i].block = next_block;
+			return;
+		}
+		flogfs.erase_queue.n -= 1;
+		for(; i < flogfs.erase_queue.n; i++){
+			flogfs.erase_queue.entries[i] = flogfs.erase_queue.entries[i + 1];
+		}
+		return;
+	}
+}
+
+void flog_erase_queue_push(flog_file_id_t file_id,
+                           flog_block_idx_t first_block){
+	if(!flogfs.checkpoint.valid){
+		// Nowhere to keep the queue
+		flog_invalidate_chain(first_block, file_id);
+		return;
+	}
+	if(flog_erase_queue_has(file_id)){
+		return;
+	}
+	while(flog_erase_queue_add(file_id, first_block) != FLOG_SUCCESS){
+		flog_erase_queue_step();
+	}
+	flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_DELETE, FLOG_BLOCK_TYPE_FILE,
+	                    first_block, 0, file_id, FLOG_BLOCK_IDX_INVALID);
+}
+
+flog_result_t flog_erase_queue_step(){
+	flog_file_init_sector_header_t init_sector_header;
+	flog_file_tail_sector_header_t tail_sector_header;
+	flog_file_id_t file_id;
+	flog_block_idx_t block, next_block;
+	flog_block_age_t age;
+
+	if(flogfs.erase_queue.n == 0){
+		return FLOG_FAILURE;
+	}
+	file_id = flogfs.erase_queue.entries[0].file_id;
+	block = flogfs.erase_queue.entries[0].block;
+
+	flog_lock_delete();
+
+	if(block >= FS_NUM_BLOCKS){
+		// The chain ended without a next block ever being claimed
+		goto drop;
+	}
+	switch(flog_get_block_type(block)){
+	case FLOG_BLOCK_TYPE_UNALLOCATED:
+		if(flog_block_is_free(block) || flog_dirty_block_owned(block)){
+			// It went back before the file started it, maybe to another
+			goto drop;
+		}
+		// Claimed for the file but never started. Nothing else would give
+		// it back.
+		age = flog_known_age(block) + 1;
+		next_block = FLOG_BLOCK_IDX_INVALID;
+		break;
+	case FLOG_BLOCK_TYPE_FILE:
+		flog_read_cached(block, FLOG_INIT_SECTOR,
+		                 (uint8_t *)&init_sector_header, 0,
+		                 sizeof(flog_file_init_sector_header_t));
+		if(init_sector_header.file_id != file_id){
+			goto drop;
+		}
+		flog_get_file_tail_sector(block, &tail_sector_header);
+		age = init_sector_header.age;
+		next_block = tail_sector_header.next_block;
+		break;
+	default:
+		goto drop;
+	}
+
+	// Log it first. Once the block is erased, nothing else says where the
+	// chain goes.
+	flogfs.t += 1;
+	flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_ERASE, FLOG_BLOCK_TYPE_UNALLOCATED,
+	                    block, age, file_id, next_block);
+	flog_erase_free_block(block, age, next_block);
+
+	flog_erase_queue_advance(file_id, next_block);
+	flog_unlock_delete();
+	return FLOG_SUCCESS;
+
+drop:
+	// Nothing is erased, but the log has to drop the entry too or the next
+	// mount queues the file again
+	flogfs.t += 1;
+	flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_ERASE, FLOG_BLOCK_TYPE_UNALLOCATED,
+	                    FLOG_BLOCK_IDX_INVALID, 0, file_id,
+	                    FLOG_BLOCK_IDX_INVALID);
+	flog_erase_queue_advance(file_id, FLOG_BLOCK_IDX_INVALID);
+	flog_unlock_delete();
+	return FLOG_SUCCESS;
+}
+
+void flog_erase_queue_scan(){
+	flog_file_init_sector_header_t init_sector_header;
+
+	for(flog_block_idx_t i = 0; i < FS_NUM_BLOCKS; i++){
+		if(flog_block_is_free(i) ||
+		   (flog_get_block_type(i) != FLOG_BLOCK_TYPE_FILE)){
+			continue;
+		}
+		flog_open_sector(i, FLOG_INIT_SECTOR);
+		flash_read_sector((uint8_t *)&init_sector_header, FLOG_INIT_SECTOR, 0,
+		                  sizeof(flog_file_init_sector_header_t));
+		for(uint16_t j = 0; j < flogfs.erase_queue.n; j++){
+			if((flogfs.erase_queue.entries[j].file_id ==
+			    init_sector_header.file_id) &&
+			   (flogfs.erase_queue.entries[j].block != i)){
+				flogfs.t += 1;
+				flog_erase_free_block(i, init_sector_header.age,
+				                      FLOG_BLOCK_IDX_INVALID);
+				break;
+			}
+		}
+	}
+
+	// Now the last blocks, as long as they still belong to their file.
+	// Unlike flog_erase_queue_step(), a block which was never started is
+	// already free after a scan.
+	for(uint16_t j = 0; j < flogfs.erase_queue.n; j++){
+		flog_block_idx_t const block = flogfs.erase_queue.entries[j].block;
+		if((block >= FS_NUM_BLOCKS) ||
+		   (flog_get_block_type(block) != FLOG_BLOCK_TYPE_FILE)){
+			continue;
+		}
+		flog_read_cached(block, FLOG_INIT_SECTOR,
+		                 (uint8_t *)&init_sector_header, 0,
+		                 sizeof(flog_file_init_sector_header_t));
+		if(init_sector_header.file_id !=
+		   flogfs.erase_queue.entries[j].file_id){
+			continue;
+		}
+		flogfs.t += 1;
+		flog_erase_free_block(block, init_sector_header.age,
+		                      FLOG_BLOCK_IDX_INVALID);
+	}
+	flogfs.erase_queue.n = 0;
+}
+#endif
+
 flog_block_type_t flog_get_block_type(flog_block_idx_t block){
 	uint8_t type_id[4];
-	if(flog_open_sector(block, FLOG_INIT_SECTOR) != FLOG_SUCCESS){
+	if(flog_read_spare_cached(block, FLOG_INIT_SECTOR, type_id) !=
+	   FLOG_SUCCESS){
 		return FLOG_BLOCK_TYPE_ERROR;
 	}
-	flash_read_spare(type_id, FLOG_INIT_SECTOR);
 	return (flog_block_type_t)type_id[0];
 }
 
-flog_block_alloc_t flog_allocate_block(int32_t threshold){
+flog_block_alloc_t flog_allocate_block(){
 	flog_block_alloc_t block;
 
 	// Don't lock because that should be done at higher level
 
-	//flog_lock_allocate();
-	if(flogfs.num_free_blocks == 0){
+#if FS_ERASE_QUEUE_SIZE
+	// Deleted files give their blocks back when they're needed
+	while((flogfs.num_free_blocks == 0) &&
+	      (flog_erase_queue_step() == FLOG_SUCCESS));
+#endif
+
+	// The youngest block is as good for wear as anything can be
+#if FS_FREE_BLOCK_HEAP
+	block.block = flog_free_heap_pop();
+#else
+	block.block = flog_free_block_youngest();
+#endif
+	if(block.block == FLOG_BLOCK_IDX_INVALID){
 		// No free blocks in the system. GTFO.
-		block.block = FLOG_BLOCK_IDX_INVALID;
-		//flog_unlock_allocate();
 		return block;
 	}
-
-	// Preallocate is empty
-	// Go search for another
-	// TODO: Make this efficient
-	for(flog_block_idx_t i = FS_NUM_BLOCKS; i; i--){
-		block = flog_prealloc_pop(threshold);
-		if(block.block != FLOG_BLOCK_IDX_INVALID){
-			// Got a block! Yahtzee!
-			//flog_unlock_allocate();
-			flogfs.num_free_blocks -= 1;
-			flogfs.free_block_sum -= block.age;
-			flogfs.mean_free_age = 
-			   flogfs.free_block_sum / flogfs.num_free_blocks;
-			return block;
-		}
-		
-		block = flog_allocate_block_iterate();
-		if(block.block != FLOG_BLOCK_IDX_INVALID){
-			// Found a block
-			if(flog_age_is_sufficient(threshold, block.age)){
-				flogfs.free_block_bitmap[block.age / 8] &=
-				   ~(1 << (block.age % 8));
-				// BOOOOOO
-				flogfs.num_free_blocks -= 1;
-				flogfs.free_block_sum -= block.age;
-				flogfs.mean_free_age = 
-				   flogfs.free_block_sum / flogfs.num_free_blocks;
-				// It's actually okay!
-				break;
-			} else {
-				// Leave it for someone else
-				flog_prealloc_push(block.block, block.age);
-			}
-		}
-		threshold -= 1;
-	}
-	//flog_unlock_allocate();
+	block.age = flog_known_age(block.block);
+	flog_claim_free_block(block.block, block.age);
+	flogfs.num_allocations += 1;
 
 	return block;
 }
@@ -1949,6 +4355,41 @@ flog_file_find_result_t flog_find_file(char const * filename,
 
 	flog_file_find_result_t result;
 
+#if FS_FILE_INDEX_SIZE
+	char fname[FLOG_MAX_FNAME_LEN];
+	uint16_t const hash = flog_file_index_hash(filename);
+
+	for(uint16_t i = hash % FS_FILE_INDEX_SIZE;
+	    flogfs.file_index.entries[i].hash != 0;
+	    i = (i + 1) % FS_FILE_INDEX_SIZE){
+		flog_file_index_entry_t const * const entry =
+		   &flogfs.file_index.entries[i];
+		if(entry->hash != hash){
+			continue;
+		}
+		// Make sure it isn't a collision
+		flog_read_cached(entry->inode_block, entry->inode_sector,
+		                 (uint8_t *)fname,
+		                 offsetof(flog_inode_file_allocation_t, filename),
+		                 FLOG_MAX_FNAME_LEN);
+		if(strncmp(filename, fname, FLOG_MAX_FNAME_LEN) != 0){
+			continue;
+		}
+		// Only the location is needed by callers
+		iter->block = entry->inode_block;
+		iter->sector = entry->inode_sector;
+		result.first_block = entry->first_block;
+		result.file_id = entry->file_id;
+		return result;
+	}
+
+	if(!flogfs.file_index.overflow){
+		// Every file is in the index so it doesn't exist
+		*iter = flogfs.file_index.inode_tail;
+		goto failure;
+	}
+#endif
+
 	for(flog_inode_iterator_init(iter, flogfs.inode0);;
 	    flog_inode_iterator_next(iter)){
 
@@ -1957,9 +4398,9 @@ flog_file_find_result_t flog_find_file(char const * filename,
 		/////////////
 
 		// Check if the entry is valid
-		flog_open_sector(iter->block, iter->sector);
-                flash_read_sector(&buffer_union.sector_buffer, iter->sector, 0,
-		                  sizeof(flog_inode_file_allocation_t));
+		flog_read_cached(iter->block, iter->sector,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_allocation_t));
 
                 if(buffer_union.inode_file_allocation_sector.header.file_id ==
 		   FLOG_FILE_ID_INVALID){
@@ -1981,9 +4422,9 @@ flog_file_find_result_t flog_find_file(char const * filename,
                 result.file_id = buffer_union.inode_file_allocation_sector.header.file_id;
 
 		// Now check if it's been deleted
-		flog_open_sector(iter->block, iter->sector+1);
-                flash_read_sector(&buffer_union.sector_buffer, iter->sector+1, 0,
-		                  sizeof(flog_timestamp_t));
+		flog_read_cached(iter->block, iter->sector+1,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_timestamp_t));
 
                 if(buffer_union.inode_file_invalidation_sector.timestamp != FLOG_TIMESTAMP_INVALID){
 			// This one is invalid
@@ -1999,49 +4440,957 @@ failure:
 	return result;
 }
 
-void flog_flush_dirty_block(){
-	if(flogfs.dirty_block.block != FLOG_BLOCK_IDX_INVALID){
-		flog_flush_write(flogfs.dirty_block.file);
-		flogfs.dirty_block.block = FLOG_BLOCK_IDX_INVALID;
+#if FS_FILE_INDEX_SIZE
+uint16_t flog_file_index_hash(char const * filename){
+	// FNV-1a, folded
+	uint32_t hash = 2166136261u;
+	for(uint_fast8_t i = 0; (i < FLOG_MAX_FNAME_LEN) && filename[i]; i++){
+		hash ^= (uint8_t)filename[i];
+		hash *= 16777619u;
 	}
+	hash = (hash >> 16) ^ (hash & 0xFFFF);
+	return hash ? hash : 1;
 }
 
+void flog_file_index_add(char const * filename,
+                         flog_block_idx_t inode_block,
+                         uint16_t inode_sector,
+                         flog_block_idx_t first_block,
+                         flog_file_id_t file_id){
+	uint16_t const hash = flog_file_index_hash(filename);
+	uint16_t i;
+
+	// Always leave an empty slot to end searches
+	if(flogfs.file_index.n + 1 >= FS_FILE_INDEX_SIZE){
+		flogfs.file_index.overflow = 1;
+		return;
+	}
+
+	for(i = hash % FS_FILE_INDEX_SIZE; flogfs.file_index.entries[i].hash != 0;
+	    i = (i + 1) % FS_FILE_INDEX_SIZE);
 
-flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block){
-	flog_timestamp_t ts;
-	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t *)&ts, FLOG_INIT_SECTOR,
-	                  0, sizeof(flog_timestamp_t));
-	return ts;
+	flogfs.file_index.entries[i].hash = hash;
+	flogfs.file_index.entries[i].inode_block = inode_block;
+	flogfs.file_index.entries[i].inode_sector = inode_sector;
+	flogfs.file_index.entries[i].first_block = first_block;
+	flogfs.file_index.entries[i].file_id = file_id;
+	flogfs.file_index.n += 1;
 }
 
-flog_block_age_t flog_block_get_age(flog_block_idx_t block){
-	flog_block_age_t age;
-	flog_open_sector(block, FLOG_BLK_STAT_SECTOR);
-	flash_read_sector((uint8_t *)&age, FLOG_BLK_STAT_SECTOR,
-	                  0, sizeof(flog_block_age_t));
-	return age;
+void flog_file_index_remove(char const * filename, flog_file_id_t file_id){
+	flog_file_index_entry_t * const entries = flogfs.file_index.entries;
+	uint16_t i, j, home;
+
+	for(i = flog_file_index_hash(filename) % FS_FILE_INDEX_SIZE;
+	    entries[i].file_id != file_id; i = (i + 1) % FS_FILE_INDEX_SIZE){
+		if(entries[i].hash == 0){
+			return;
+		}
+	}
+	if(entries[i].hash == 0){
+		return;
+	}
+	flogfs.file_index.n -= 1;
+
+	// Move back any entries which would no longer be found past the gap
+	j = i;
+	while(1){
+		entries[i].hash = 0;
+		do {
+			j = (j + 1) % FS_FILE_INDEX_SIZE;
+			if(entries[j].hash == 0){
+				return;
+			}
+			home = entries[j].hash % FS_FILE_INDEX_SIZE;
+		} while((i <= j) ? ((i < home) && (home <= j)) :
+		                   ((i < home) || (home <= j)));
+		entries[i] = entries[j];
+		i = j;
+	}
 }
+#endif
 
-void flog_get_file_tail_sector(flog_block_idx_t block,
-                               flog_file_tail_sector_header_t * header){
-	flog_open_sector(block, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t *)header, FLOG_TAIL_SECTOR, 0,
-	                  sizeof(flog_file_tail_sector_header_t));
+flog_block_idx_t flog_inode_get_replacement(flog_block_idx_t inode0){
+	flog_inode_invalidation_sector_t invalidation;
+	flog_inode_invalidation_sector_spare_t spare;
+
+	flog_read_spare_cached(inode0, FLOG_INODE_INVALIDATION_SECTOR,
+	                       (uint8_t *)&spare);
+	if(spare.copy_complete_marker != flog_copy_complete_marker){
+		return FLOG_BLOCK_IDX_INVALID;
+	}
+	flog_read_cached(inode0, FLOG_INODE_INVALIDATION_SECTOR,
+	                 (uint8_t *)&invalidation, 0, sizeof(invalidation));
+	return invalidation.replacement_id;
 }
 
-void flog_get_file_init_sector(flog_block_idx_t block,
-                               flog_file_init_sector_header_t * header){
-	flog_open_sector(block, FLOG_INIT_SECTOR);
-	flash_read_sector((uint8_t *)header, FLOG_INIT_SECTOR, 0,
-	                  sizeof(flog_file_init_sector_header_t));
+/*!
+ @brief Erase an inode block and return it to the free list
+ @param block The block to free
+ */
+static void flog_inode_free_block(flog_block_idx_t block){
+	flog_block_stat_sector_t stat;
+
+	stat.age = flog_known_age(block) + 1;
+	stat.timestamp = ++flogfs.t;
+	stat.next_block = FLOG_BLOCK_IDX_INVALID;
+	stat.next_age = FLOG_BLOCK_AGE_INVALID;
+
+	flog_close_sector();
+	flog_erase_block(block);
+	flog_write_block_stat(block, &stat);
+
+	flog_release_block(block, stat.age);
+	flog_checkpoint_log(FLOG_CHECKPOINT_DELTA_FREE,
+	                    FLOG_BLOCK_TYPE_UNALLOCATED, block, stat.age, 0,
+	                    FLOG_BLOCK_IDX_INVALID);
 }
 
-void flog_get_universal_tail_sector(flog_block_idx_t block,
-                                    flog_universal_tail_sector_t * header){
-	flog_open_sector(block, FLOG_TAIL_SECTOR);
-	flash_read_sector((uint8_t *)header, FLOG_TAIL_SECTOR, 0,
-	                  sizeof(flog_universal_tail_sector_t));
+void flog_inode_release_chain(flog_block_idx_t inode0,
+                              flog_timestamp_t split,
+                              uint_fast8_t newer){
+	flog_block_stat_sector_t stat;
+	flog_block_idx_t block, n;
+	flog_timestamp_t timestamp;
+
+	if(flog_get_block_type(inode0) != FLOG_BLOCK_TYPE_INODE){
+		// Either all done or the new chain never got started. Either way
+		// it may still have been claimed.
+		flog_release_block(inode0, flog_known_age(inode0));
+		return;
+	}
+
+	// Count the blocks after the first
+	n = 0;
+	for(block = flog_universal_get_next_block(inode0);
+	    block != FLOG_BLOCK_IDX_INVALID;
+	    block = flog_universal_get_next_block(block)){
+		if(flog_get_block_type(block) != FLOG_BLOCK_TYPE_INODE){
+			flog_get_block_stat(block, &stat);
+			if((stat.timestamp == FLOG_TIMESTAMP_INVALID) &&
+			   !flog_block_is_free(block)){
+				// Erased but the stat sector never made it
+				flog_inode_free_block(block);
+			}
+			break;
+		}
+		timestamp = flog_block_get_init_timestamp(block);
+		if(newer ? (timestamp < split) : (timestamp >= split)){
+			// Not part of this chain
+			break;
+		}
+		n += 1;
+	}
+
+	// Free from the end so that an interruption never leaves the rest of the
+	// chain unreachable
+	for(; n > 0; n--){
+		block = inode0;
+		for(flog_block_idx_t i = 0; i < n; i++){
+			block = flog_universal_get_next_block(block);
+		}
+		flog_inode_free_block(block);
+	}
+
+	flog_inode_free_block(inode0);
+}
+
+void flog_inode_compact_recover(){
+	if(flogfs.compaction.new_inode0 != FLOG_BLOCK_IDX_INVALID){
+		// The copy never finished
+		flog_inode_release_chain(flogfs.compaction.new_inode0,
+		   flog_block_get_init_timestamp(flogfs.compaction.new_inode0), 1);
+		flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+	}
+	if(flogfs.compaction.old_inode0 != FLOG_BLOCK_IDX_INVALID){
+		// The old chain was never fully released
+		flog_inode_release_chain(flogfs.compaction.old_inode0,
+		   flog_block_get_init_timestamp(flogfs.inode0), 0);
+		flogfs.compaction.old_inode0 = FLOG_BLOCK_IDX_INVALID;
+	}
+}
+
+#if FS_FILE_INDEX_SIZE
+void flog_file_index_rebuild(){
+	flog_inode_iterator_t iter;
+	union {
+		uint8_t sector_buffer;
+		flog_inode_file_allocation_t allocation_sector;
+		flog_inode_file_invalidation_t invalidation_sector;
+        } buffer_union;
+
+	memset(&flogfs.file_index, 0, sizeof(flogfs.file_index));
+
+	for(flog_inode_iterator_init(&iter, flogfs.inode0);;
+	    flog_inode_iterator_next(&iter)){
+		flog_read_cached(iter.block, iter.sector + 1,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_invalidation_t));
+		if(buffer_union.invalidation_sector.timestamp !=
+		   FLOG_TIMESTAMP_INVALID){
+			continue;
+		}
+		flog_read_cached(iter.block, iter.sector,
+		                 &buffer_union.sector_buffer, 0,
+		                 sizeof(flog_inode_file_allocation_t));
+		if(buffer_union.allocation_sector.header.file_id ==
+		   FLOG_FILE_ID_INVALID){
+			break;
+		}
+		buffer_union.allocation_sector.filename[FLOG_MAX_FNAME_LEN - 1] = '\0';
+		flog_file_index_add(buffer_union.allocation_sector.filename,
+		                    iter.block, iter.sector,
+		                    buffer_union.allocation_sector.header.first_block,
+		                    buffer_union.allocation_sector.header.file_id);
+	}
+	flogfs.file_index.inode_tail = iter;
+}
+#endif
+
+uint_fast8_t flog_write_file_is_buffered(flog_write_file_t const * file){
+	uint16_t header = 0;
+#if FS_PAGE_WRITE_BUFFER
+	if(file->page_n){
+		return 1;
+	}
+#endif
+	if(file->sector == FLOG_INIT_SECTOR){
+		header = sizeof(flog_file_init_sector_header_t);
+	} else if(file->sector == FLOG_TAIL_SECTOR){
+		header = sizeof(flog_file_tail_sector_header_t);
+	}
+	return file->offset > header;
+}
+
+void flog_flush_dirty_blocks(){
+	flog_write_file_t * file;
+	while(1){
+		file = 0;
+		flog_lock_allocate();
+		for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+			if((flogfs.dirty_blocks[i].block != FLOG_BLOCK_IDX_INVALID) &&
+			   (flogfs.num_allocations - flogfs.dirty_blocks[i].allocation >=
+			    FS_DIRTY_BLOCKS - 1)){
+				file = flogfs.dirty_blocks[i].file;
+				flogfs.dirty_blocks[i].block = FLOG_BLOCK_IDX_INVALID;
+				break;
+			}
+		}
+		flog_unlock_allocate();
+		if(file == 0){
+			return;
+		}
+		// Writing its init sector takes the allocation lock again
+		flog_flush_write(file);
+	}
+}
+
+void flog_dirty_block_add(flog_block_idx_t block,
+                          flog_block_age_t age,
+                          flog_block_idx_t previous,
+                          flog_write_file_t * file){
+	// flog_flush_dirty_blocks() left room for this one
+	for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+		if(flogfs.dirty_blocks[i].block == FLOG_BLOCK_IDX_INVALID){
+			flogfs.dirty_blocks[i].block = block;
+			flogfs.dirty_blocks[i].age = age;
+			flogfs.dirty_blocks[i].previous = previous;
+			flogfs.dirty_blocks[i].file = file;
+			flogfs.dirty_blocks[i].timestamp = flogfs.t;
+			flogfs.dirty_blocks[i].allocation = flogfs.num_allocations;
+			return;
+		}
+	}
+}
+
+#if FS_ERASE_QUEUE_SIZE
+uint_fast8_t flog_dirty_block_owned(flog_block_idx_t block){
+	for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+		if(flogfs.dirty_blocks[i].block == block){
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+void flog_dirty_block_remove(flog_write_file_t * file){
+	for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+		if(flogfs.dirty_blocks[i].file == file){
+			flogfs.dirty_blocks[i].block = FLOG_BLOCK_IDX_INVALID;
+			flogfs.dirty_blocks[i].file = 0;
+		}
+	}
+}
+
+#if FS_WRITE_BUFFER_POOL_SIZE
+flog_result_t flog_write_buffer_get(flog_write_file_t * file,
+                                    uint_fast8_t steal){
+	flog_write_file_t * victim;
+
+	if(file->sector_buffer){
+		return FLOG_SUCCESS;
+	}
+	// Each buffer can be taken back at most once
+	for(uint16_t attempt = 0; attempt <= FS_WRITE_BUFFER_POOL_SIZE;
+	    attempt++){
+		for(uint16_t i = 0; i < FS_WRITE_BUFFER_POOL_SIZE; i++){
+			if(flogfs.write_buffers.owners[i] == NULL){
+				flogfs.write_buffers.owners[i] = file;
+				file->sector_buffer = flogfs.write_buffers.buffers[i];
+				return FLOG_SUCCESS;
+			}
+		}
+		if(!steal || (attempt == FS_WRITE_BUFFER_POOL_SIZE)){
+			break;
+		}
+		// Program what another file has waiting. Its buffer is given back
+		// once the sector is committed.
+		victim = flogfs.write_buffers.owners[flogfs.write_buffers.next_victim];
+		flogfs.write_buffers.next_victim =
+		   (flogfs.write_buffers.next_victim + 1) % FS_WRITE_BUFFER_POOL_SIZE;
+		flog_flush_write(victim);
+	}
+	return FLOG_FAILURE;
+}
+
+void flog_write_buffer_put(flog_write_file_t * file){
+	if(file->sector_buffer == NULL){
+		return;
+	}
+	for(uint16_t i = 0; i < FS_WRITE_BUFFER_POOL_SIZE; i++){
+		if(flogfs.write_buffers.owners[i] == file){
+			flogfs.write_buffers.owners[i] = NULL;
+			break;
+		}
+	}
+	file->sector_buffer = NULL;
+}
+
+void flog_write_buffers_reset(){
+	for(uint16_t i = 0; i < FS_WRITE_BUFFER_POOL_SIZE; i++){
+		flogfs.write_buffers.owners[i] = NULL;
+	}
+	flogfs.write_buffers.next_victim = 0;
+}
+#endif
+
+void flog_dirty_blocks_reset(){
+	for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+		flogfs.dirty_blocks[i].block = FLOG_BLOCK_IDX_INVALID;
+		flogfs.dirty_blocks[i].file = 0;
+	}
+	flogfs.num_allocations = 0;
+}
+
+void flog_allocation_note(flog_allocation_t * recent,
+                          flog_allocation_t const * allocation){
+	uint_fast8_t i;
+	for(i = 0; i < FS_DIRTY_BLOCKS; i++){
+		if((recent[i].block == allocation->block) &&
+		   (recent[i].timestamp == allocation->timestamp)){
+			// An inode entry copied by an unfinished compaction
+			return;
+		}
+	}
+	// Shift the older ones down to make room
+	for(i = FS_DIRTY_BLOCKS; i > 0; i--){
+		if(recent[i - 1].timestamp >= allocation->timestamp){
+			break;
+		}
+		if(i < FS_DIRTY_BLOCKS){
+			recent[i] = recent[i - 1];
+		}
+	}
+	if(i < FS_DIRTY_BLOCKS){
+		recent[i] = *allocation;
+	}
+}
+
+void flog_allocation_forget(flog_allocation_t * recent,
+                            flog_block_idx_t block){
+	for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+		if((recent[i].timestamp == 0) || (recent[i].block != block)){
+			continue;
+		}
+		for(; i < FS_DIRTY_BLOCKS - 1; i++){
+			recent[i] = recent[i + 1];
+		}
+		recent[FS_DIRTY_BLOCKS - 1].block = FLOG_BLOCK_IDX_INVALID;
+		recent[FS_DIRTY_BLOCKS - 1].timestamp = 0;
+		return;
+	}
+}
+
+
+flog_timestamp_t flog_block_get_init_timestamp(flog_block_idx_t block){
+	flog_timestamp_t ts;
+	flog_read_cached(block, FLOG_INIT_SECTOR, (uint8_t *)&ts, 0,
+	                 sizeof(flog_timestamp_t));
+	return ts;
+}
+
+flog_block_age_t flog_block_get_age(flog_block_idx_t block){
+	flog_block_age_t age;
+	flog_read_cached(block, FLOG_BLK_STAT_SECTOR, (uint8_t *)&age, 0,
+	                 sizeof(flog_block_age_t));
+	return age;
+}
+
+void flog_get_file_tail_sector(flog_block_idx_t block,
+                               flog_file_tail_sector_header_t * header){
+	flog_read_cached(block, FLOG_TAIL_SECTOR, (uint8_t *)header, 0,
+	                 sizeof(flog_file_tail_sector_header_t));
+}
+
+void flog_get_file_init_sector(flog_block_idx_t block,
+                               flog_file_init_sector_header_t * header){
+	flog_read_cached(block, FLOG_INIT_SECTOR, (uint8_t *)header, 0,
+	                 sizeof(flog_file_init_sector_header_t));
+}
+
+void flog_get_universal_tail_sector(flog_block_idx_t block,
+                                    flog_universal_tail_sector_t * header){
+	flog_read_cached(block, FLOG_TAIL_SECTOR, (uint8_t *)header, 0,
+	                 sizeof(flog_universal_tail_sector_t));
+}
+
+static uint16_t flog_checkpoint_delta_check(flog_checkpoint_delta_t const * delta){
+	uint8_t const * const bytes = (uint8_t const *)delta;
+	uint16_t sum = 0;
+	for(uint_fast8_t i = 0; i < offsetof(flog_checkpoint_delta_t, check); i++){
+		sum += bytes[i];
+	}
+	return ~sum;
+}
+
+void flog_checkpoint_invalidate(){
+	flog_checkpoint_commit_sector_t commit;
+	flogfs.checkpoint.valid = 0;
+	if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+		return;
+	}
+	for(uint_fast8_t i = 0; i < 2; i++){
+		flog_open_sector(flogfs.checkpoint.blocks[i],
+		                 FLOG_CHECKPOINT_COMMIT_SECTOR);
+		flash_read_sector((uint8_t *)&commit, FLOG_CHECKPOINT_COMMIT_SECTOR, 0,
+		                  sizeof(commit));
+		if(commit.complete_marker != flog_copy_complete_marker){
+			continue;
+		}
+		commit.complete_marker = 0;
+		flash_write_sector((uint8_t const *)&commit,
+		                   FLOG_CHECKPOINT_COMMIT_SECTOR, 0, sizeof(commit));
+		flog_commit();
+	}
+}
+
+flog_result_t flog_checkpoint_find(){
+	flog_block_idx_t reserved[4];
+	uint_fast8_t found = 0;
+	flog_block_type_t types[4];
+
+	flogfs.checkpoint.blocks[0] = FLOG_BLOCK_IDX_INVALID;
+	flogfs.checkpoint.blocks[1] = FLOG_BLOCK_IDX_INVALID;
+	flogfs.checkpoint.age_tables[0] = FLOG_BLOCK_IDX_INVALID;
+	flogfs.checkpoint.age_tables[1] = FLOG_BLOCK_IDX_INVALID;
+	flogfs.checkpoint.valid = 0;
+
+	for(flog_block_idx_t i = 0; (i < FS_NUM_BLOCKS) && (found < 4); i++){
+		if(FLOG_FAILURE == flog_open_page(i, 0)){
+			continue;
+		}
+		if(FLOG_SUCCESS == flash_block_is_bad()){
+			continue;
+		}
+		types[found] = flog_get_block_type(i);
+		if((types[found] != FLOG_BLOCK_TYPE_UNALLOCATED) &&
+		   (types[found] != ((found < 2) ? FLOG_BLOCK_TYPE_CHECKPOINT :
+		                                   FLOG_BLOCK_TYPE_AGE_TABLE))){
+			// This volume was formatted without checkpoint blocks
+			return FLOG_FAILURE;
+		}
+		reserved[found++] = i;
+	}
+
+	if(found < 4){
+		return FLOG_FAILURE;
+	}
+	// A new record erases its pair of blocks before it gets to write their
+	// types, but the other pair is left alone
+	if(((types[0] != FLOG_BLOCK_TYPE_CHECKPOINT) ||
+	    (types[2] != FLOG_BLOCK_TYPE_AGE_TABLE)) &&
+	   ((types[1] != FLOG_BLOCK_TYPE_CHECKPOINT) ||
+	    (types[3] != FLOG_BLOCK_TYPE_AGE_TABLE))){
+		return FLOG_FAILURE;
+	}
+	flogfs.checkpoint.blocks[0] = reserved[0];
+	flogfs.checkpoint.blocks[1] = reserved[1];
+	flogfs.checkpoint.age_tables[0] = reserved[2];
+	flogfs.checkpoint.age_tables[1] = reserved[3];
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flog_reset_reserved_block(flog_block_idx_t block){
+	flog_block_stat_sector_t stat;
+
+	flog_get_block_stat(block, &stat);
+	flog_close_sector();
+	if(flog_erase_block(block) != FLOG_SUCCESS){
+		flash_debug_warn("FLogFS:" LINESTR);
+		return FLOG_FAILURE;
+	}
+	stat.age += 1;
+	stat.timestamp = flogfs.t;
+	stat.next_block = FLOG_BLOCK_IDX_INVALID;
+	stat.next_age = FLOG_BLOCK_AGE_INVALID;
+	flog_write_block_stat(block, &stat);
+	flog_set_known_age(block, stat.age);
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flog_age_table_write(flog_block_idx_t block, uint32_t sequence){
+	flog_age_table_init_sector_t init;
+	flog_age_table_sector_spare_t spare;
+	flog_checkpoint_commit_sector_t commit;
+	flog_age_table_entry_t entries[FLOG_AGE_TABLE_ENTRIES_PER_SECTOR];
+	flog_block_idx_t i = 0;
+	uint16_t sector = FLOG_AGE_TABLE_FIRST_SECTOR;
+
+	if(flog_reset_reserved_block(block) != FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+
+	init.sequence = sequence;
+	spare.type_id = FLOG_BLOCK_TYPE_AGE_TABLE;
+	spare.nothing = 0;
+	spare.nentries = 0;
+	flog_open_sector(block, FLOG_INIT_SECTOR);
+	flash_write_sector((uint8_t const *)&init, FLOG_INIT_SECTOR, 0,
+	                   sizeof(init));
+	flash_write_spare((uint8_t const *)&spare, FLOG_INIT_SECTOR);
+	flog_commit();
+
+	while(i < FS_NUM_BLOCKS){
+		uint16_t n;
+		for(n = 0; (n < FLOG_AGE_TABLE_ENTRIES_PER_SECTOR) &&
+		           (i < FS_NUM_BLOCKS); n++, i++){
+			entries[n].block[0] = i & 0xFF;
+			entries[n].block[1] = i >> 8;
+			memcpy(entries[n].age, flogfs.block_age[i],
+			       sizeof(entries[n].age));
+		}
+		spare.nentries = n;
+		flog_open_sector(block, sector);
+		flash_write_sector((uint8_t const *)entries, sector, 0,
+		                   n * sizeof(flog_age_table_entry_t));
+		flash_write_spare((uint8_t const *)&spare, sector);
+		flog_commit();
+		sector += 1;
+	}
+
+	commit.complete_marker = flog_copy_complete_marker;
+	flog_open_sector(block, FLOG_AGE_TABLE_COMMIT_SECTOR);
+	flash_write_sector((uint8_t const *)&commit, FLOG_AGE_TABLE_COMMIT_SECTOR,
+	                   0, sizeof(commit));
+	flog_commit();
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flog_age_table_load(flog_block_idx_t block, uint32_t sequence){
+	flog_age_table_init_sector_t init;
+	flog_age_table_sector_spare_t spare;
+	flog_checkpoint_commit_sector_t commit;
+	flog_age_table_entry_t entries[FLOG_AGE_TABLE_ENTRIES_PER_SECTOR];
+
+	flog_open_sector(block, FLOG_INIT_SECTOR);
+	flash_read_sector((uint8_t *)&init, FLOG_INIT_SECTOR, 0, sizeof(init));
+	flash_read_sector((uint8_t *)&commit, FLOG_AGE_TABLE_COMMIT_SECTOR, 0,
+	                  sizeof(commit));
+	if((commit.complete_marker != flog_copy_complete_marker) ||
+	   (init.sequence != sequence)){
+		return FLOG_FAILURE;
+	}
+
+	for(uint16_t sector = FLOG_AGE_TABLE_FIRST_SECTOR;
+	    sector < FLOG_AGE_TABLE_FIRST_SECTOR + FLOG_AGE_TABLE_SECTORS;
+	    sector++){
+		flog_open_sector(block, sector);
+		flash_read_spare((uint8_t *)&spare, sector);
+		if(spare.nentries > FLOG_AGE_TABLE_ENTRIES_PER_SECTOR){
+			return FLOG_FAILURE;
+		}
+		flash_read_sector((uint8_t *)entries, sector, 0,
+		                  spare.nentries * sizeof(flog_age_table_entry_t));
+		for(uint16_t n = 0; n < spare.nentries; n++){
+			flog_block_idx_t const i = entries[n].block[0] |
+			                           (entries[n].block[1] << 8);
+			if(i < FS_NUM_BLOCKS){
+				memcpy(flogfs.block_age[i], entries[n].age,
+				       sizeof(entries[n].age));
+			}
+		}
+	}
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @details
+ ### Internals
+ The newest complete record restores the state as of the time it was written.
+ Each logged change is then applied on top. Changes are idempotent so a record
+ written after a change was logged (when the log fills) doesn't matter.
+
+ The most recent allocation is handed back to flogfs_mount() to finish the
+ same way as one found by scanning. If its owner never got to reference it,
+ it goes back to the free list here instead.
+ */
+flog_result_t flog_checkpoint_load(flog_allocation_t * recent){
+	flog_checkpoint_init_sector_t init;
+	flog_checkpoint_commit_sector_t commit;
+	flog_checkpoint_header_t header;
+	flog_checkpoint_delta_t delta;
+	// The most recent allocation
+	flog_checkpoint_delta_t last_alloc;
+	flog_allocation_t allocation;
+#if FS_ERASE_QUEUE_SIZE
+	// The most recent block erased from the queue
+	flog_checkpoint_delta_t last_erase;
+	flog_block_stat_sector_t block_stat;
+#endif
+	uint32_t sequence = 0;
+	uint_fast8_t active = 2;
+	flog_block_idx_t block;
+	uint16_t sector;
+
+	// Like an erased delta, with no type
+	memset(&last_alloc, 0xFF, sizeof(last_alloc));
+	last_alloc.delta_type = 0;
+#if FS_ERASE_QUEUE_SIZE
+	memset(&last_erase, 0xFF, sizeof(last_erase));
+	last_erase.delta_type = 0;
+#endif
+
+	for(uint_fast8_t i = 0; i < 2; i++){
+		flog_open_sector(flogfs.checkpoint.blocks[i], FLOG_INIT_SECTOR);
+		flash_read_sector((uint8_t *)&init, FLOG_INIT_SECTOR, 0, sizeof(init));
+		flash_read_sector((uint8_t *)&commit, FLOG_CHECKPOINT_COMMIT_SECTOR, 0,
+		                  sizeof(commit));
+		if(commit.complete_marker != flog_copy_complete_marker){
+			continue;
+		}
+		if((active == 2) || (init.sequence > sequence)){
+			active = i;
+			sequence = init.sequence;
+		}
+	}
+	if(active == 2){
+		return FLOG_FAILURE;
+	}
+	block = flogfs.checkpoint.blocks[active];
+
+	if(flog_age_table_load(flogfs.checkpoint.age_tables[active], sequence) !=
+	   FLOG_SUCCESS){
+		return FLOG_FAILURE;
+	}
+
+	// Restore the record
+	flog_open_sector(block, FLOG_CHECKPOINT_RECORD_SECTOR);
+	flash_read_sector((uint8_t *)&header, FLOG_CHECKPOINT_RECORD_SECTOR, 0,
+	                  sizeof(header));
+	flogfs.t = header.t;
+	flogfs.max_file_id = header.max_file_id;
+	flogfs.inode0 = header.inode0;
+	flogfs.num_free_blocks = header.num_free_blocks;
+	flogfs.free_block_sum = header.free_block_sum;
+	flogfs.compaction.new_inode0 = header.compact_new_inode0;
+	flogfs.compaction.old_inode0 = header.compact_old_inode0;
+#if FS_TAIL_HINT_SIZE
+	memcpy(flogfs.tail_hints, header.tail_hints, sizeof(flogfs.tail_hints));
+#endif
+#if FS_ERASE_QUEUE_SIZE
+	flogfs.erase_queue.n = MIN(header.erase_queue_n, FS_ERASE_QUEUE_SIZE);
+	memcpy(flogfs.erase_queue.entries, header.erase_queue,
+	       flogfs.erase_queue.n * sizeof(flog_erase_queue_entry_t));
+#endif
+	for(uint16_t i = 0; i < FLOG_CHECKPOINT_BITMAP_SECTORS; i++){
+		uint16_t const offset = i * FS_SECTOR_SIZE;
+		sector = FLOG_CHECKPOINT_RECORD_SECTOR + 1 + i;
+		flog_open_sector(block, sector);
+		flash_read_sector(flogfs.free_block_bitmap + offset, sector, 0,
+		                  MIN(FS_SECTOR_SIZE,
+		                      FLOG_CHECKPOINT_BITMAP_SIZE - offset));
+	}
+
+	// Replay the log
+	for(sector = FLOG_CHECKPOINT_FIRST_DELTA_SECTOR;
+	    sector < FS_SECTORS_PER_BLOCK; sector++){
+		flog_open_sector(block, sector);
+		flash_read_sector((uint8_t *)&delta, sector, 0, sizeof(delta));
+		if(delta.delta_type == 0xFF){
+			// End of the log
+			break;
+		}
+		if(delta.check != flog_checkpoint_delta_check(&delta)){
+			// Torn write
+			continue;
+		}
+		flog_update_max_timestamp(delta.timestamp);
+		switch(delta.delta_type){
+		case FLOG_CHECKPOINT_DELTA_ALLOC:
+			flog_claim_free_block(delta.block, delta.age);
+			last_alloc = delta;
+			allocation.block = delta.block;
+			allocation.age = delta.age + 1;
+			allocation.timestamp = delta.timestamp;
+			allocation.block_type = (flog_block_type_t)delta.block_type;
+			if(allocation.block_type == FLOG_BLOCK_TYPE_INODE){
+				allocation.previous_inode = delta.previous;
+			} else {
+				allocation.file_id = delta.owner;
+			}
+			flog_allocation_note(recent, &allocation);
+#if FS_ERASE_QUEUE_SIZE
+			if(last_erase.block == delta.block){
+				last_erase.delta_type = 0;
+			}
+#endif
+			if((delta.block_type == FLOG_BLOCK_TYPE_INODE) &&
+			   (delta.previous == FLOG_BLOCK_IDX_INVALID)){
+				// A compaction started a new chain
+				flogfs.compaction.new_inode0 = delta.block;
+			}
+			break;
+		case FLOG_CHECKPOINT_DELTA_INODE0:
+			flogfs.inode0 = delta.block;
+			flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+			flogfs.compaction.old_inode0 = delta.previous;
+			break;
+		case FLOG_CHECKPOINT_DELTA_FREE:
+			flog_release_block(delta.block, delta.age);
+			flog_set_known_age(delta.block, delta.age);
+			if(delta.block == flogfs.compaction.new_inode0){
+				flogfs.compaction.new_inode0 = FLOG_BLOCK_IDX_INVALID;
+			}
+			if(delta.block == flogfs.compaction.old_inode0){
+				flogfs.compaction.old_inode0 = FLOG_BLOCK_IDX_INVALID;
+			}
+			if((last_alloc.delta_type == FLOG_CHECKPOINT_DELTA_ALLOC) &&
+			   (last_alloc.block == delta.block)){
+				last_alloc.delta_type = 0;
+			}
+			flog_allocation_forget(recent, delta.block);
+			break;
+#if FS_ERASE_QUEUE_SIZE
+		case FLOG_CHECKPOINT_DELTA_DELETE:
+			if(flog_erase_queue_add(delta.owner, delta.block) !=
+			   FLOG_SUCCESS){
+				// Its blocks would be lost. Only a scan can find them now.
+				flog_checkpoint_invalidate();
+				return FLOG_FAILURE;
+			}
+			break;
+		case FLOG_CHECKPOINT_DELTA_ERASE:
+			if(delta.block != FLOG_BLOCK_IDX_INVALID){
+				flog_release_block(delta.block, delta.age);
+				flog_set_known_age(delta.block, delta.age);
+				flog_allocation_forget(recent, delta.block);
+				last_erase = delta;
+			}
+			flog_erase_queue_advance(delta.owner, delta.previous);
+			break;
+#endif
+		default:
+			break;
+		}
+	}
+
+	flogfs.checkpoint.active = active;
+	flogfs.checkpoint.sequence = sequence;
+	flogfs.checkpoint.next_sector = sector;
+	flogfs.checkpoint.valid = 1;
+
+	// Make sure the most recent allocation got referenced by the block before
+	if((last_alloc.delta_type == FLOG_CHECKPOINT_DELTA_ALLOC) &&
+	   (last_alloc.previous != FLOG_BLOCK_IDX_INVALID) &&
+	   (flog_universal_get_next_block(last_alloc.previous) !=
+	    last_alloc.block)){
+		if(flog_get_block_type(last_alloc.block) ==
+		   FLOG_BLOCK_TYPE_UNALLOCATED){
+			flog_release_block(last_alloc.block, last_alloc.age);
+		}
+		flog_allocation_forget(recent, last_alloc.block);
+	}
+
+#if FS_ERASE_QUEUE_SIZE
+	// Make sure the most recent erase happened. Its stat sector is written
+	// last, with the timestamp of the log entry.
+	if(last_erase.delta_type == FLOG_CHECKPOINT_DELTA_ERASE){
+		flog_get_block_stat(last_erase.block, &block_stat);
+		if((flog_get_block_type(last_erase.block) !=
+		    FLOG_BLOCK_TYPE_UNALLOCATED) ||
+		   (block_stat.timestamp != last_erase.timestamp)){
+			flog_erase_free_block(last_erase.block, last_erase.age,
+			                      last_erase.previous);
+		}
+	}
+#endif
+
+	flog_update_mean_free_age();
+	return FLOG_SUCCESS;
+}
+
+flog_result_t flog_checkpoint_write(){
+	flog_checkpoint_init_sector_t init;
+	flog_checkpoint_init_sector_spare_t init_spare;
+	flog_checkpoint_commit_sector_t commit;
+	flog_checkpoint_header_t header;
+	flog_checkpoint_delta_t delta;
+	uint_fast8_t target;
+	uint32_t sequence;
+	flog_block_idx_t block;
+
+	if(flogfs.checkpoint.blocks[0] == FLOG_BLOCK_IDX_INVALID){
+		return FLOG_FAILURE;
+	}
+
+	if(flogfs.checkpoint.valid){
+		target = !flogfs.checkpoint.active;
+		sequence = flogfs.checkpoint.sequence + 1;
+	} else {
+		// Neither block is trusted. Overwrite the older one.
+		uint32_t sequences[2];
+		for(uint_fast8_t i = 0; i < 2; i++){
+			flog_open_sector(flogfs.checkpoint.blocks[i], FLOG_INIT_SECTOR);
+			flash_read_sector((uint8_t *)&init, FLOG_INIT_SECTOR, 0,
+			                  sizeof(init));
+			sequences[i] = (init.sequence == 0xFFFFFFFF) ? 0 : init.sequence;
+		}
+		target = (sequences[0] <= sequences[1]) ? 0 : 1;
+		sequence = MAX(sequences[0], sequences[1]) + 1;
+	}
+	block = flogfs.checkpoint.blocks[target];
+
+	// The block ages go first so that a complete record always has them
+	if((flog_reset_reserved_block(block) != FLOG_SUCCESS) ||
+	   (flog_age_table_write(flogfs.checkpoint.age_tables[target], sequence) !=
+	    FLOG_SUCCESS)){
+		flog_checkpoint_invalidate();
+		return FLOG_FAILURE;
+	}
+
+	init.sequence = sequence;
+	init_spare.type_id = FLOG_BLOCK_TYPE_CHECKPOINT;
+	init_spare.nothing = 0;
+	init_spare.reserved = 0;
+	flog_open_sector(block, FLOG_INIT_SECTOR);
+	flash_write_sector((uint8_t const *)&init, FLOG_INIT_SECTOR, 0,
+	                   sizeof(init));
+	flash_write_spare((uint8_t const *)&init_spare, FLOG_INIT_SECTOR);
+	flog_commit();
+
+	// The record itself
+	memset(&header, 0xFF, sizeof(header));
+	header.t = flogfs.t;
+	header.max_file_id = flogfs.max_file_id;
+	header.inode0 = flogfs.inode0;
+	header.num_free_blocks = flogfs.num_free_blocks;
+	header.free_block_sum = flogfs.free_block_sum;
+	header.compact_new_inode0 = flogfs.compaction.new_inode0;
+	header.compact_old_inode0 = flogfs.compaction.old_inode0;
+#if FS_TAIL_HINT_SIZE
+	memcpy(header.tail_hints, flogfs.tail_hints, sizeof(header.tail_hints));
+#endif
+#if FS_ERASE_QUEUE_SIZE
+	header.erase_queue_n = flogfs.erase_queue.n;
+	memcpy(header.erase_queue, flogfs.erase_queue.entries,
+	       sizeof(header.erase_queue));
+#endif
+	flog_open_sector(block, FLOG_CHECKPOINT_RECORD_SECTOR);
+	flash_write_sector((uint8_t const *)&header, FLOG_CHECKPOINT_RECORD_SECTOR,
+	                   0, sizeof(header));
+	flog_commit();
+
+	for(uint16_t i = 0; i < FLOG_CHECKPOINT_BITMAP_SECTORS; i++){
+		uint16_t const offset = i * FS_SECTOR_SIZE;
+		uint16_t const sector = FLOG_CHECKPOINT_RECORD_SECTOR + 1 + i;
+		flog_open_sector(block, sector);
+		flash_write_sector(flogfs.free_block_bitmap + offset, sector, 0,
+		                   MIN(FS_SECTOR_SIZE,
+		                       FLOG_CHECKPOINT_BITMAP_SIZE - offset));
+		flog_commit();
+	}
+
+	// Mount only finds unstarted blocks by their allocations, so those of the
+	// dirty blocks have to be carried into the new log before it counts
+	flogfs.checkpoint.next_sector = FLOG_CHECKPOINT_FIRST_DELTA_SECTOR;
+	for(uint_fast8_t i = 0; i < FS_DIRTY_BLOCKS; i++){
+		if(flogfs.dirty_blocks[i].block != FLOG_BLOCK_IDX_INVALID){
+			delta.delta_type = FLOG_CHECKPOINT_DELTA_ALLOC;
+			delta.block_type = FLOG_BLOCK_TYPE_FILE;
+			delta.block = flogfs.dirty_blocks[i].block;
+			delta.age = flogfs.dirty_blocks[i].age;
+			delta.owner = flogfs.dirty_blocks[i].file->id;
+			delta.previous = flogfs.dirty_blocks[i].previous;
+			// Mount has to see them in the order they were allocated
+			delta.timestamp = flogfs.dirty_blocks[i].timestamp;
+			flog_checkpoint_append(block, &delta);
+		}
+	}
+
+	// Only now is it complete
+	commit.complete_marker = flog_copy_complete_marker;
+	flog_open_sector(block, FLOG_CHECKPOINT_COMMIT_SECTOR);
+	flash_write_sector((uint8_t const *)&commit, FLOG_CHECKPOINT_COMMIT_SECTOR,
+	                   0, sizeof(commit));
+	flog_commit();
+
+	flogfs.checkpoint.active = target;
+	flogfs.checkpoint.sequence = sequence;
+	flogfs.checkpoint.valid = 1;
+	return FLOG_SUCCESS;
+}
+
+void flog_checkpoint_log(flog_checkpoint_delta_type_t type,
+                         flog_block_type_t block_type,
+                         flog_block_idx_t block,
+                         flog_block_age_t age,
+                         uint32_t owner,
+                         flog_block_idx_t previous){
+	flog_checkpoint_delta_t delta;
+
+	if(!flogfs.checkpoint.valid){
+		return;
+	}
+
+	if(flogfs.checkpoint.next_sector >= FS_SECTORS_PER_BLOCK){
+		// The log is full. The new record already includes this change but
+		// it still gets logged for the benefit of mount recovery.
+		if(flog_checkpoint_write() != FLOG_SUCCESS){
+			return;
+		}
+	}
+
+	delta.delta_type = type;
+	delta.block_type = block_type;
+	delta.block = block;
+	delta.age = age;
+	delta.owner = owner;
+	delta.previous = previous;
+	delta.timestamp = flogfs.t;
+	flog_checkpoint_append(flogfs.checkpoint.blocks[flogfs.checkpoint.active],
+	                       &delta);
+}
+
+void flog_checkpoint_append(flog_block_idx_t block,
+                            flog_checkpoint_delta_t * delta){
+	delta->check = flog_checkpoint_delta_check(delta);
+
+	flog_open_sector(block, flogfs.checkpoint.next_sector);
+	flash_write_sector((uint8_t const *)delta, flogfs.checkpoint.next_sector,
+	                   0, sizeof(*delta));
+	flog_commit();
+	flogfs.checkpoint.next_sector += 1;
 }
 
 
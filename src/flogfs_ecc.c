@@ -0,0 +1,447 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_ecc.c
+ * @author Ben Nahill <bnahill@gmail.com>
+ * @ingroup FLogFS
+ * @brief Software ECC for flash without ECC of its own
+ *
+ * The code of a sector of 2^n bytes has these bits, each the parity of some
+ * of its (inverted) bits:
+ *
+ * - Bit k, for k < n: every byte whose offset has bit k set
+ * - Bit n + k: every byte whose offset has bit k clear
+ * - Bit 2n + b, for b < 3: bit positions with bit b set, across every byte
+ * - Bit 2n + 3 + b: bit positions with bit b clear
+ *
+ * One flipped bit changes exactly one of each pair, and the ones which change
+ * spell out where it is.
+ */
+
+#include "flogfs_ecc.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define FLOG_ECC_SSE2 (1)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FLOG_ECC_NEON (1)
+#endif
+
+//! @addtogroup FLogECC
+//! @{
+
+//! @name Parity of each byte value
+//! @{
+#define FLOG_ECC_P2(n) n, n ^ 1, n ^ 1, n
+#define FLOG_ECC_P4(n) FLOG_ECC_P2(n), FLOG_ECC_P2(n ^ 1), \
+                       FLOG_ECC_P2(n ^ 1), FLOG_ECC_P2(n)
+#define FLOG_ECC_P6(n) FLOG_ECC_P4(n), FLOG_ECC_P4(n ^ 1), \
+                       FLOG_ECC_P4(n ^ 1), FLOG_ECC_P4(n)
+static uint8_t const flog_ecc_parity[256] = {
+	FLOG_ECC_P6(0), FLOG_ECC_P6(1), FLOG_ECC_P6(1), FLOG_ECC_P6(0)
+};
+//! @}
+
+//! The bit positions within a byte which have each bit of their index set
+static uint8_t const flog_ecc_column_masks[3] = {0xAA, 0xCC, 0xF0};
+
+static uint_fast8_t flog_ecc_offset_bits(uint16_t size){
+	uint_fast8_t bits = 0;
+	while((1U << bits) < size){
+		bits += 1;
+	}
+	return bits;
+}
+
+/*!
+ @brief Add bytes one at a time
+
+ This takes care of the ends of runs which don't line up with a whole word.
+ */
+static void flog_ecc_update_bytes(flog_ecc_state_t * state,
+                                  uint8_t const * data,
+                                  uint16_t offset, uint16_t n){
+	for(; n; n--, offset++, data++){
+		uint8_t const byte = ~*data;
+		state->column ^= byte;
+		for(uint_fast8_t k = 0; (offset >> k) != 0; k++){
+			if(offset & (1 << k)){
+				state->lines[k] ^= byte;
+			}
+		}
+	}
+}
+
+/*!
+ @brief Fold the lanes of a word into the state
+ @param state The state
+ @param lanes The word
+ @param width The number of lanes (and bytes) in the word, a power of two
+ @param offset_bits The number of offset bits given by the lanes
+
+ Lane l holds the bytes at offsets with l in their low bits.
+ */
+static void flog_ecc_fold_lanes(flog_ecc_state_t * state,
+                                uint8_t const * lanes, uint_fast8_t width,
+                                uint_fast8_t offset_bits){
+	for(uint_fast8_t l = 0; l < width; l++){
+		state->column ^= lanes[l];
+		for(uint_fast8_t k = 0; k < offset_bits; k++){
+			if(l & (1 << k)){
+				state->lines[k] ^= lanes[l];
+			}
+		}
+	}
+}
+
+//! Fold every byte of a word into one
+static inline uint8_t flog_ecc_fold(uint64_t word){
+	word ^= word >> 32;
+	word ^= word >> 16;
+	word ^= word >> 8;
+	return (uint8_t)word;
+}
+
+//! Fold the running XORs of the words (or vectors) into the state
+static inline void flog_ecc_fold_lines(flog_ecc_state_t * state,
+                                       uint64_t const * lines,
+                                       uint_fast8_t first_bit,
+                                       uint16_t last_index){
+	for(uint_fast8_t k = 0; (last_index >> k) != 0; k++){
+		state->lines[first_bit + k] ^= flog_ecc_fold(lines[k]);
+	}
+}
+
+/*!
+ @brief Add a run of 8-byte words at an offset which is a multiple of 8
+
+ Each word goes into its own running XOR for every bit set in its index, so
+ there's nothing to do per byte until the end. Words are taken four at a time
+ where they can be, since the four of them only differ in the low two bits of
+ their index, and the inversions of an even number of words cancel out.
+ */
+static void flog_ecc_update_words(flog_ecc_state_t * state,
+                                  uint8_t const * data,
+                                  uint16_t offset, uint16_t n){
+	uint64_t all = 0;
+	uint64_t lines[FLOG_ECC_MAX_OFFSET_BITS - 3];
+	uint8_t lanes[8];
+	uint16_t const first = offset >> 3;
+	uint16_t const count = n / 8;
+	uint16_t i;
+
+	memset(lines, 0, sizeof(lines));
+	i = 0;
+	if((first & 3) == 0){
+		for(; i + 4 <= count; i += 4){
+			uint64_t word[4];
+			uint64_t group;
+			uint16_t const index = (first + i) >> 2;
+			memcpy(word, data + 8 * i, sizeof(word));
+			lines[0] ^= word[1] ^ word[3];
+			lines[1] ^= word[2] ^ word[3];
+			group = word[0] ^ word[1] ^ word[2] ^ word[3];
+			all ^= group;
+			for(uint_fast8_t k = 0; (index >> k) != 0; k++){
+				if(index & (1 << k)){
+					lines[k + 2] ^= group;
+				}
+			}
+		}
+	}
+	for(; i < count; i++){
+		uint16_t const index = first + i;
+		uint64_t word;
+		memcpy(&word, data + 8 * i, 8);
+		word = ~word;
+		all ^= word;
+		for(uint_fast8_t k = 0; (index >> k) != 0; k++){
+			if(index & (1 << k)){
+				lines[k] ^= word;
+			}
+		}
+	}
+
+	memcpy(lanes, &all, 8);
+	flog_ecc_fold_lanes(state, lanes, 8, 3);
+	flog_ecc_fold_lines(state, lines, 3, first + count - 1);
+}
+
+#if FLOG_ECC_SSE2 || FLOG_ECC_NEON
+/*!
+ @brief Add a run of 16-byte vectors at an offset which is a multiple of 16
+
+ The same as flog_ecc_update_words() with twice the width. The two halves of
+ each vector are folded together at the end to share the rest of it.
+ */
+static void flog_ecc_update_vectors(flog_ecc_state_t * state,
+                                    uint8_t const * data,
+                                    uint16_t offset, uint16_t n){
+	uint8_t lanes[8];
+	uint64_t folded[FLOG_ECC_MAX_OFFSET_BITS - 4];
+	uint64_t high;
+	uint16_t const first = offset >> 4;
+	uint16_t const count = n / 16;
+	uint16_t i = 0;
+#if FLOG_ECC_SSE2
+	__m128i const ones = _mm_set1_epi8(-1);
+	__m128i all = _mm_setzero_si128();
+	__m128i lines[FLOG_ECC_MAX_OFFSET_BITS - 4];
+
+	for(uint_fast8_t k = 0; k < FLOG_ECC_MAX_OFFSET_BITS - 4; k++){
+		lines[k] = _mm_setzero_si128();
+	}
+	if((first & 3) == 0){
+		for(; i + 4 <= count; i += 4){
+			__m128i const * const src = (__m128i const *)(data + 16 * i);
+			__m128i const v0 = _mm_loadu_si128(src);
+			__m128i const v1 = _mm_loadu_si128(src + 1);
+			__m128i const v2 = _mm_loadu_si128(src + 2);
+			__m128i const v3 = _mm_loadu_si128(src + 3);
+			__m128i const high = _mm_xor_si128(v2, v3);
+			__m128i const group = _mm_xor_si128(_mm_xor_si128(v0, v1), high);
+			uint16_t const index = (first + i) >> 2;
+			lines[0] = _mm_xor_si128(lines[0], _mm_xor_si128(v1, v3));
+			lines[1] = _mm_xor_si128(lines[1], high);
+			all = _mm_xor_si128(all, group);
+			for(uint_fast8_t k = 0; (index >> k) != 0; k++){
+				if(index & (1 << k)){
+					lines[k + 2] = _mm_xor_si128(lines[k + 2], group);
+				}
+			}
+		}
+	}
+	for(; i < count; i++){
+		uint16_t const index = first + i;
+		__m128i const vector = _mm_xor_si128(
+			_mm_loadu_si128((__m128i const *)(data + 16 * i)), ones);
+		all = _mm_xor_si128(all, vector);
+		for(uint_fast8_t k = 0; (index >> k) != 0; k++){
+			if(index & (1 << k)){
+				lines[k] = _mm_xor_si128(lines[k], vector);
+			}
+		}
+	}
+
+	_mm_storel_epi64((__m128i *)&high, _mm_srli_si128(all, 8));
+	all = _mm_xor_si128(all, _mm_srli_si128(all, 8));
+	_mm_storel_epi64((__m128i *)lanes, all);
+	for(uint_fast8_t k = 0; k < FLOG_ECC_MAX_OFFSET_BITS - 4; k++){
+		_mm_storel_epi64((__m128i *)&folded[k],
+		                 _mm_xor_si128(lines[k], _mm_srli_si128(lines[k], 8)));
+	}
+#else
+	uint8x16_t all = vdupq_n_u8(0);
+	uint8x16_t lines[FLOG_ECC_MAX_OFFSET_BITS - 4];
+
+	for(uint_fast8_t k = 0; k < FLOG_ECC_MAX_OFFSET_BITS - 4; k++){
+		lines[k] = vdupq_n_u8(0);
+	}
+	if((first & 3) == 0){
+		for(; i + 4 <= count; i += 4){
+			uint8x16_t const v0 = vld1q_u8(data + 16 * i);
+			uint8x16_t const v1 = vld1q_u8(data + 16 * i + 16);
+			uint8x16_t const v2 = vld1q_u8(data + 16 * i + 32);
+			uint8x16_t const v3 = vld1q_u8(data + 16 * i + 48);
+			uint8x16_t const high = veorq_u8(v2, v3);
+			uint8x16_t const group = veorq_u8(veorq_u8(v0, v1), high);
+			uint16_t const index = (first + i) >> 2;
+			lines[0] = veorq_u8(lines[0], veorq_u8(v1, v3));
+			lines[1] = veorq_u8(lines[1], high);
+			all = veorq_u8(all, group);
+			for(uint_fast8_t k = 0; (index >> k) != 0; k++){
+				if(index & (1 << k)){
+					lines[k + 2] = veorq_u8(lines[k + 2], group);
+				}
+			}
+		}
+	}
+	for(; i < count; i++){
+		uint16_t const index = first + i;
+		uint8x16_t const vector = vmvnq_u8(vld1q_u8(data + 16 * i));
+		all = veorq_u8(all, vector);
+		for(uint_fast8_t k = 0; (index >> k) != 0; k++){
+			if(index & (1 << k)){
+				lines[k] = veorq_u8(lines[k], vector);
+			}
+		}
+	}
+
+	high = vgetq_lane_u64(vreinterpretq_u64_u8(all), 1);
+	vst1_u8(lanes, veor_u8(vget_low_u8(all), vget_high_u8(all)));
+	for(uint_fast8_t k = 0; k < FLOG_ECC_MAX_OFFSET_BITS - 4; k++){
+		folded[k] = vgetq_lane_u64(vreinterpretq_u64_u8(lines[k]), 0) ^
+		            vgetq_lane_u64(vreinterpretq_u64_u8(lines[k]), 1);
+	}
+#endif
+
+	// Lanes 8 to 15 are the bytes with bit 3 of their offset set
+	state->lines[3] ^= flog_ecc_fold(high);
+	flog_ecc_fold_lanes(state, lanes, 8, 3);
+	flog_ecc_fold_lines(state, folded, 4, first + count - 1);
+}
+#endif
+
+/*!
+ @brief Split a run into its unaligned ends and a middle of whole words
+ */
+static void flog_ecc_update_with(flog_ecc_state_t * state,
+                                 uint8_t const * data,
+                                 uint16_t offset, uint16_t n,
+                                 uint_fast8_t width,
+                                 void (*kernel)(flog_ecc_state_t *,
+                                                uint8_t const *,
+                                                uint16_t, uint16_t)){
+	uint16_t head = (width - (offset & (width - 1))) & (width - 1);
+	uint16_t middle;
+
+	if(head > n){
+		head = n;
+	}
+	flog_ecc_update_bytes(state, data, offset, head);
+	data += head;
+	offset += head;
+	n -= head;
+
+	middle = n & ~(width - 1);
+	if(middle){
+		kernel(state, data, offset, middle);
+	}
+	flog_ecc_update_bytes(state, data + middle, offset + middle, n - middle);
+}
+
+uint8_t flog_ecc_bytes(uint16_t size){
+	return (2 * flog_ecc_offset_bits(size) + 6 + 7) / 8;
+}
+
+void flog_ecc_start(flog_ecc_state_t * state){
+	memset(state, 0, sizeof(*state));
+}
+
+void flog_ecc_update(flog_ecc_state_t * state, uint8_t const * data,
+                     uint16_t offset, uint16_t n){
+#if FLOG_ECC_SSE2 || FLOG_ECC_NEON
+	flog_ecc_update_with(state, data, offset, n, 16, flog_ecc_update_vectors);
+#else
+	flog_ecc_update_with(state, data, offset, n, 8, flog_ecc_update_words);
+#endif
+}
+
+void flog_ecc_update_scalar(flog_ecc_state_t * state, uint8_t const * data,
+                            uint16_t offset, uint16_t n){
+	flog_ecc_update_with(state, data, offset, n, 8, flog_ecc_update_words);
+}
+
+char const * flog_ecc_kernel(){
+#if FLOG_ECC_SSE2
+	return "sse2";
+#elif FLOG_ECC_NEON
+	return "neon";
+#else
+	return "scalar";
+#endif
+}
+
+uint32_t flog_ecc_finish(flog_ecc_state_t const * state, uint16_t size){
+	uint_fast8_t const bits = flog_ecc_offset_bits(size);
+	uint_fast8_t const bytes = flog_ecc_bytes(size);
+	uint32_t const all = flog_ecc_parity[state->column];
+	uint32_t code = 0;
+
+	for(uint_fast8_t k = 0; k < bits; k++){
+		uint32_t const parity = flog_ecc_parity[state->lines[k]];
+		code |= parity << k;
+		code |= (parity ^ all) << (bits + k);
+	}
+	for(uint_fast8_t b = 0; b < 3; b++){
+		uint8_t const mask = flog_ecc_column_masks[b];
+		code |= (uint32_t)flog_ecc_parity[state->column & mask] << (2 * bits + b);
+		code |= (uint32_t)flog_ecc_parity[state->column & ~mask] <<
+		        (2 * bits + 3 + b);
+	}
+
+	// Stored inverted, with any spare bits left erased
+	code = ~code;
+	if(bytes < 4){
+		code &= (1UL << (8 * bytes)) - 1;
+	}
+	return code;
+}
+
+uint32_t flog_ecc_calculate(uint8_t const * data, uint16_t size){
+	flog_ecc_state_t state;
+	flog_ecc_start(&state);
+	flog_ecc_update(&state, data, 0, size);
+	return flog_ecc_finish(&state, size);
+}
+
+flog_flash_read_result_t flog_ecc_check(uint32_t stored, uint32_t calculated,
+                                        uint16_t size, uint16_t * bit){
+	uint_fast8_t const bits = flog_ecc_offset_bits(size);
+	uint32_t const lines = (1UL << bits) - 1;
+	uint32_t const syndrome =
+		(stored ^ calculated) & ((1UL << (2 * bits + 6)) - 1);
+	uint32_t const offset = syndrome & lines;
+	uint32_t const column = (syndrome >> (2 * bits)) & 7;
+
+	if(syndrome == 0){
+		return FLOG_FLASH_SUCCESS;
+	}
+
+	if(((offset ^ (syndrome >> bits)) & lines) == lines &&
+	   ((column ^ (syndrome >> (2 * bits + 3))) & 7) == 7){
+		*bit = offset * 8 + column;
+		return FLOG_FLASH_ERR_CORRECT;
+	}
+
+	if((syndrome & (syndrome - 1)) == 0){
+		*bit = FLOG_ECC_CODE_BIT;
+		return FLOG_FLASH_ERR_CORRECT;
+	}
+
+	return FLOG_FLASH_ERR_DETECT;
+}
+
+flog_flash_read_result_t flog_ecc_correct(uint8_t * data, uint16_t size,
+                                          uint32_t stored){
+	uint16_t bit;
+	flog_flash_read_result_t const result =
+		flog_ecc_check(stored, flog_ecc_calculate(data, size), size, &bit);
+
+	if(result == FLOG_FLASH_ERR_CORRECT && bit != FLOG_ECC_CODE_BIT){
+		data[bit / 8] ^= 1 << (bit % 8);
+	}
+	return result;
+}
+
+//! @} // FLogECC
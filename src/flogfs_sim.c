@@ -0,0 +1,641 @@
+/*
+Copyright (c) 2013, Ben Nahill <bnahill@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the FLogFS Project.
+*/
+
+/*!
+ * @file flogfs_sim.c
+ * @author Ben Nahill <bnahill@gmail.com>
+ * @ingroup FLogFS
+ * @brief RAM-backed NAND simulator
+ */
+
+#include "flogfs_sim.h"
+#include "flogfs_private.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! @addtogroup FLogSim
+//! @{
+
+/*!
+ @brief The state of the simulated part
+
+ Blocks are only backed by memory once they have been programmed. A NULL
+ block is fully erased and reads as 0xFF.
+ */
+typedef struct {
+	//! Backing store for each block
+	uint8_t * blocks[FS_NUM_BLOCKS];
+	//! Factory bad block flags
+	uint8_t bad[FS_NUM_BLOCKS];
+	//! Number of programs on each page since the last erase
+	uint8_t * nop;
+
+	//! The cache register
+	uint8_t cache[FLOG_SIM_PAGE_SIZE];
+	uint16_t cache_block;
+	uint16_t cache_page;
+	uint_fast8_t cache_valid;
+	//! Set while the cache register holds a page started by
+	//! flog_sim_load_page(), which can be filled during a program
+	uint_fast8_t cache_loading;
+
+	//! One bit for each chip with a program started by
+	//! flog_sim_commit_start() running
+	uint_fast8_t busy;
+	//! One bit for each of those started by flog_sim_commit_cache(), which
+	//! leave the cache register free
+	uint_fast8_t busy_cached;
+	//! The time at which each finishes
+	uint64_t busy_until[FS_STRIPE_CHIPS];
+	//! The result of each
+	flog_result_t busy_result[FS_STRIPE_CHIPS];
+
+#if FS_PLANES > 1
+	//! Pages loaded by flog_sim_commit_plane() on each chip, which go out
+	//! with the page of the last plane
+	struct {
+		uint_fast8_t n;
+		uint16_t block;
+		uint16_t page[FS_PLANES - 1];
+		uint8_t data[FS_PLANES - 1][FLOG_SIM_PAGE_SIZE];
+	} queue[FS_STRIPE_CHIPS];
+#endif
+
+	//! Set while a page started by flog_sim_read_ahead() is pending
+	uint_fast8_t ahead;
+	uint16_t ahead_block;
+	uint16_t ahead_page;
+	//! The time at which it has been loaded
+	uint64_t ahead_until;
+
+	flog_sim_timing_t timing;
+	flog_sim_stats_t stats;
+
+	//! Protects the whole part, mirroring the bus lock on hardware
+	pthread_mutex_t lock;
+	uint_fast8_t initialized;
+} flog_sim_t;
+
+//! One part for each volume
+static flog_sim_t flog_sim_parts[FS_NUM_VOLUMES];
+//! The part used by the calling thread
+static FLOG_THREAD_LOCAL flog_sim_t * sim = &flog_sim_parts[0];
+
+#define FLOG_SIM_BLOCK_SIZE (FLOG_SIM_PAGE_SIZE * FS_PAGES_PER_BLOCK)
+
+static inline uint8_t * flog_sim_page(uint16_t block, uint16_t page){
+	if(sim->blocks[block] == NULL){
+		return NULL;
+	}
+	return sim->blocks[block] + page * FLOG_SIM_PAGE_SIZE;
+}
+
+static inline void flog_sim_transfer(uint16_t n){
+	sim->stats.time += (uint64_t)sim->timing.t_byte * n;
+}
+
+//! The chip holding a page
+static inline uint_fast8_t flog_sim_chip(uint16_t page){
+	return page / FS_PLANES % FS_STRIPE_CHIPS;
+}
+
+//! Whether a chip holds pages for a multi-plane program
+static inline uint_fast8_t flog_sim_queued(uint_fast8_t chip){
+#if FS_PLANES > 1
+	return sim->queue[chip].n != 0;
+#else
+	(void)chip;
+	return 0;
+#endif
+}
+
+//! Whether a page is the next plane of the program held by its chip
+static inline uint_fast8_t flog_sim_joins(uint16_t block, uint16_t page){
+#if FS_PLANES > 1
+	uint_fast8_t const chip = flog_sim_chip(page);
+	uint_fast8_t const n = sim->queue[chip].n;
+	return n && (sim->queue[chip].block == block) &&
+	       (sim->queue[chip].page[n - 1] + 1 == page) &&
+	       (page % FS_PLANES == n);
+#else
+	(void)block;
+	(void)page;
+	return 0;
+#endif
+}
+
+//! Anything but a status poll has to wait for a program running on its chip
+//! (or held for more planes), except loading the next plane of that program
+static inline void flog_sim_check_chip(uint_fast8_t chip, uint_fast8_t joins){
+	if((sim->busy & (1 << chip)) || (flog_sim_queued(chip) && !joins)){
+		sim->stats.busy_violations += 1;
+		flog_sim_wait_chip(chip);
+	}
+}
+
+static inline void flog_sim_check_idle(uint16_t block, uint16_t page){
+	flog_sim_check_chip(flog_sim_chip(page), flog_sim_joins(block, page));
+}
+
+//! Filling the cache register for a page only has to wait for a program
+//! which isn't a cache program
+static inline void flog_sim_check_register(uint16_t block, uint16_t page){
+	uint_fast8_t const chip = flog_sim_chip(page);
+	if((sim->busy & ~sim->busy_cached & (1 << chip)) ||
+	   (flog_sim_queued(chip) && !flog_sim_joins(block, page))){
+		sim->stats.busy_violations += 1;
+		flog_sim_wait_chip(chip);
+	}
+}
+
+//! Erasing waits for every chip
+static inline void flog_sim_check_all_idle(){
+	for(uint_fast8_t chip = 0; chip < FS_STRIPE_CHIPS; chip++){
+		flog_sim_check_chip(chip, 0);
+	}
+}
+
+//! Anything but reading the cache register has to wait for a read ahead
+static inline void flog_sim_end_read_ahead(){
+	if(sim->ahead){
+		if(sim->stats.time < sim->ahead_until){
+			sim->stats.time = sim->ahead_until;
+		}
+		sim->ahead = 0;
+	}
+}
+
+flog_sim_timing_t flog_sim_default_timing(){
+	flog_sim_timing_t timing;
+	timing.t_read = 25000;
+	timing.t_prog = 200000;
+	timing.t_erase = 2000000;
+	timing.t_cmd = 200;
+	timing.t_byte = 40;
+	timing.max_partial_programs = 4;
+	return timing;
+}
+
+flog_result_t flog_sim_init(flog_sim_timing_t const * timing){
+	flog_sim_deinit();
+
+	memset(sim, 0, sizeof(*sim));
+	sim->nop = (uint8_t *)calloc(FS_NUM_BLOCKS * FS_PAGES_PER_BLOCK, 1);
+	if(sim->nop == NULL){
+		return FLOG_FAILURE;
+	}
+	if(timing){
+		sim->timing = *timing;
+	} else {
+		sim->timing = flog_sim_default_timing();
+	}
+	pthread_mutex_init(&sim->lock, NULL);
+	sim->initialized = 1;
+	return FLOG_SUCCESS;
+}
+
+void flog_sim_deinit(){
+	if(!sim->initialized){
+		return;
+	}
+	for(uint32_t i = 0; i < FS_NUM_BLOCKS; i++){
+		free(sim->blocks[i]);
+		sim->blocks[i] = NULL;
+	}
+	free(sim->nop);
+	sim->nop = NULL;
+	pthread_mutex_destroy(&sim->lock);
+	sim->initialized = 0;
+}
+
+flog_result_t flog_sim_select(uint8_t part){
+	if(part >= FS_NUM_VOLUMES){
+		return FLOG_FAILURE;
+	}
+	sim = &flog_sim_parts[part];
+	return FLOG_SUCCESS;
+}
+
+void flog_sim_set_timing(flog_sim_timing_t const * timing){
+	sim->timing = *timing;
+}
+
+flog_result_t flog_sim_power_on(){
+	if(!sim->initialized){
+		return FLOG_FAILURE;
+	}
+	// Whatever was being programmed has finished (or been lost)
+	sim->busy = 0;
+	sim->busy_cached = 0;
+#if FS_PLANES > 1
+	for(uint_fast8_t chip = 0; chip < FS_STRIPE_CHIPS; chip++){
+		sim->queue[chip].n = 0;
+	}
+#endif
+	sim->ahead = 0;
+	sim->cache_valid = 0;
+	sim->cache_loading = 0;
+	memset(sim->cache, 0xFF, sizeof(sim->cache));
+	return FLOG_SUCCESS;
+}
+
+void flog_sim_mark_bad(uint16_t block){
+	sim->bad[block] = 1;
+}
+
+void flog_sim_flip_bit(uint16_t block, uint16_t page, uint16_t offset,
+                       uint8_t bit){
+	if(sim->blocks[block] == NULL){
+		sim->blocks[block] = (uint8_t *)malloc(FLOG_SIM_BLOCK_SIZE);
+		if(sim->blocks[block] == NULL){
+			return;
+		}
+		memset(sim->blocks[block], 0xFF, FLOG_SIM_BLOCK_SIZE);
+	}
+	flog_sim_page(block, page)[offset] ^= 1 << bit;
+}
+
+flog_sim_stats_t flog_sim_get_stats(){
+	return sim->stats;
+}
+
+void flog_sim_clear_stats(){
+	uint64_t time = sim->stats.time;
+	memset(&sim->stats, 0, sizeof(sim->stats));
+	sim->stats.time = time;
+}
+
+uint64_t flog_sim_time(){
+	return sim->stats.time;
+}
+
+void flog_sim_advance(uint64_t ns){
+	sim->stats.time += ns;
+}
+
+void flog_sim_lock(){
+	pthread_mutex_lock(&sim->lock);
+}
+
+void flog_sim_unlock(){
+	pthread_mutex_unlock(&sim->lock);
+}
+
+flog_result_t flog_sim_open_page(uint16_t block, uint16_t page){
+	uint8_t const * src;
+	uint_fast8_t ahead;
+	flog_sim_check_idle(block, page);
+	ahead = sim->ahead && (sim->ahead_block == block) &&
+	        (sim->ahead_page == page);
+	flog_sim_end_read_ahead();
+	if((block >= FS_NUM_BLOCKS) || (page >= FS_PAGES_PER_BLOCK)){
+		sim->cache_valid = 0;
+		return FLOG_FAILURE;
+	}
+
+	src = flog_sim_page(block, page);
+	if(src){
+		memcpy(sim->cache, src, FLOG_SIM_PAGE_SIZE);
+	} else {
+		memset(sim->cache, 0xFF, FLOG_SIM_PAGE_SIZE);
+	}
+	if(sim->bad[block] && (page == 0)){
+		sim->cache[FLOG_SIM_BAD_BLOCK_OFFSET] = 0;
+	}
+
+	sim->cache_block = block;
+	sim->cache_page = page;
+	sim->cache_valid = 1;
+	sim->cache_loading = 0;
+
+	sim->stats.page_opens += 1;
+	if(ahead){
+		// Only the move from the data register to the cache register is left
+		sim->stats.read_ahead_hits += 1;
+		sim->stats.time += sim->timing.t_cmd;
+	} else {
+		sim->stats.time += sim->timing.t_cmd + sim->timing.t_read;
+	}
+	return FLOG_SUCCESS;
+}
+
+void flog_sim_read_ahead(uint16_t block, uint16_t page){
+	flog_sim_check_idle(block, page);
+	flog_sim_end_read_ahead();
+	if((block >= FS_NUM_BLOCKS) || (page >= FS_PAGES_PER_BLOCK)){
+		return;
+	}
+	sim->stats.read_aheads += 1;
+	sim->stats.time += sim->timing.t_cmd;
+	sim->ahead = 1;
+	sim->ahead_block = block;
+	sim->ahead_page = page;
+	sim->ahead_until = sim->stats.time + sim->timing.t_read;
+}
+
+flog_result_t flog_sim_load_page(uint16_t block, uint16_t page){
+	uint8_t const * src;
+	flog_sim_check_register(block, page);
+	flog_sim_end_read_ahead();
+	if((block >= FS_NUM_BLOCKS) || (page >= FS_PAGES_PER_BLOCK)){
+		sim->cache_valid = 0;
+		return FLOG_FAILURE;
+	}
+	// The register starts out erased, and bits left at 1 don't change the
+	// array. Starting from what the array holds does the same without
+	// counting them as overwrites. Nothing is read, so it costs no tR.
+	src = flog_sim_page(block, page);
+	if(src){
+		memcpy(sim->cache, src, FLOG_SIM_PAGE_SIZE);
+	} else {
+		memset(sim->cache, 0xFF, FLOG_SIM_PAGE_SIZE);
+	}
+	sim->cache_block = block;
+	sim->cache_page = page;
+	sim->cache_valid = 1;
+	sim->cache_loading = 1;
+	sim->stats.time += sim->timing.t_cmd;
+	return FLOG_SUCCESS;
+}
+
+void flog_sim_close_page(){
+	sim->cache_valid = 0;
+}
+
+flog_result_t flog_sim_read(uint8_t * dst, uint16_t offset, uint16_t n){
+	flog_sim_check_idle(sim->cache_block, sim->cache_page);
+	if(!sim->cache_valid || ((uint32_t)offset + n > FLOG_SIM_PAGE_SIZE)){
+		return FLOG_FAILURE;
+	}
+	memcpy(dst, sim->cache + offset, n);
+	sim->stats.bytes_read += n;
+	sim->stats.time += sim->timing.t_cmd;
+	flog_sim_transfer(n);
+	return FLOG_SUCCESS;
+}
+
+uint8_t const * flog_sim_map(uint16_t offset, uint16_t n){
+	flog_sim_check_idle(sim->cache_block, sim->cache_page);
+	if(!sim->cache_valid || ((uint32_t)offset + n > FLOG_SIM_PAGE_SIZE)){
+		return NULL;
+	}
+	// The bytes still have to come over the bus, just not into another buffer
+	sim->stats.bytes_read += n;
+	sim->stats.time += sim->timing.t_cmd;
+	flog_sim_transfer(n);
+	return sim->cache + offset;
+}
+
+flog_result_t flog_sim_write(uint8_t const * src, uint16_t offset, uint16_t n){
+	if(sim->cache_loading){
+		flog_sim_check_register(sim->cache_block, sim->cache_page);
+	} else {
+		flog_sim_check_idle(sim->cache_block, sim->cache_page);
+	}
+	flog_sim_end_read_ahead();
+	if(!sim->cache_valid || ((uint32_t)offset + n > FLOG_SIM_PAGE_SIZE)){
+		return FLOG_FAILURE;
+	}
+	memcpy(sim->cache + offset, src, n);
+	sim->stats.bytes_written += n;
+	sim->stats.time += sim->timing.t_cmd;
+	flog_sim_transfer(n);
+	return FLOG_SUCCESS;
+}
+
+//! Program a page image, leaving what the array holds afterwards in it
+static flog_result_t flog_sim_program(uint16_t block, uint16_t page,
+                                      uint8_t * data){
+	uint8_t * dst;
+	uint8_t * nop;
+	uint_fast8_t overwrite = 0;
+
+	if(sim->bad[block]){
+		sim->stats.bad_block_accesses += 1;
+		return FLOG_FAILURE;
+	}
+
+	if(sim->blocks[block] == NULL){
+		sim->blocks[block] = (uint8_t *)malloc(FLOG_SIM_BLOCK_SIZE);
+		if(sim->blocks[block] == NULL){
+			return FLOG_FAILURE;
+		}
+		memset(sim->blocks[block], 0xFF, FLOG_SIM_BLOCK_SIZE);
+	}
+
+	nop = &sim->nop[block * FS_PAGES_PER_BLOCK + page];
+	if(*nop < 0xFF){
+		*nop += 1;
+	}
+	if(*nop > sim->timing.max_partial_programs){
+		sim->stats.nop_violations += 1;
+	}
+
+	// Programming can only pull bits low
+	dst = flog_sim_page(block, page);
+	for(uint32_t i = 0; i < FLOG_SIM_PAGE_SIZE; i++){
+		if(data[i] & ~dst[i]){
+			overwrite = 1;
+		}
+		dst[i] &= data[i];
+	}
+	if(overwrite){
+		sim->stats.overwrite_violations += 1;
+	}
+
+	// The register keeps the page after a program, as on the real part
+	memcpy(data, dst, FLOG_SIM_PAGE_SIZE);
+	return FLOG_SUCCESS;
+}
+
+/*!
+ @brief Start one program of the pages held on a chip and (if with_cache is
+ set) the page in the cache register
+
+ A cache program (cached set) can follow one still running on the chip. It
+ only starts once that finishes, and the register is free from then on.
+ */
+static void flog_sim_program_start(uint_fast8_t chip, uint_fast8_t with_cache,
+                                   uint_fast8_t cached){
+	flog_result_t result = FLOG_SUCCESS;
+	uint_fast8_t n = with_cache;
+#if FS_PLANES > 1
+	n += sim->queue[chip].n;
+#endif
+
+	sim->stats.programs += n;
+	sim->stats.time += sim->timing.t_cmd;
+	if(sim->busy & (1 << chip)){
+		// The data register frees up when the program before finishes
+		result = sim->busy_result[chip];
+		if(sim->stats.time < sim->busy_until[chip]){
+			sim->stats.time = sim->busy_until[chip];
+		}
+	}
+	// The array is updated right away but the chip stays busy for tPROG
+	sim->busy |= 1 << chip;
+	sim->busy_until[chip] = sim->stats.time + sim->timing.t_prog;
+	if(cached){
+		sim->busy_cached |= 1 << chip;
+	} else {
+		sim->busy_cached &= ~(1 << chip);
+	}
+	if(with_cache){
+		// Only programming its page ends a load into the register. Held
+		// plane pages going out on their own leave it as it is.
+		sim->cache_loading = 0;
+	}
+
+#if FS_PLANES > 1
+	for(uint_fast8_t i = 0; i < sim->queue[chip].n; i++){
+		if(flog_sim_program(sim->queue[chip].block, sim->queue[chip].page[i],
+		                    sim->queue[chip].data[i]) != FLOG_SUCCESS){
+			result = FLOG_FAILURE;
+		}
+	}
+	sim->queue[chip].n = 0;
+#endif
+	if(with_cache &&
+	   (flog_sim_program(sim->cache_block, sim->cache_page, sim->cache) !=
+	    FLOG_SUCCESS)){
+		result = FLOG_FAILURE;
+	}
+	sim->busy_result[chip] = result;
+}
+
+flog_result_t flog_sim_commit(){
+	flog_sim_commit_start();
+	return flog_sim_wait_chip(flog_sim_chip(sim->cache_page));
+}
+
+flog_result_t flog_sim_wait(){
+	flog_result_t result = FLOG_SUCCESS;
+	for(uint_fast8_t chip = 0; chip < FS_STRIPE_CHIPS; chip++){
+		if(flog_sim_wait_chip(chip) != FLOG_SUCCESS){
+			result = FLOG_FAILURE;
+		}
+	}
+	return result;
+}
+
+flog_result_t flog_sim_wait_chip(uint8_t chip){
+	if(flog_sim_queued(chip)){
+		// Nothing else is coming for it, so the held pages go on their own
+		flog_sim_program_start(chip, 0, 0);
+	}
+	if(!(sim->busy & (1 << chip))){
+		return sim->busy_result[chip];
+	}
+	if(sim->stats.time < sim->busy_until[chip]){
+		sim->stats.time = sim->busy_until[chip];
+	}
+	sim->busy &= ~(1 << chip);
+	sim->busy_cached &= ~(1 << chip);
+	return sim->busy_result[chip];
+}
+
+void flog_sim_commit_start(){
+	flog_sim_check_idle(sim->cache_block, sim->cache_page);
+	flog_sim_end_read_ahead();
+	if(!sim->cache_valid){
+		sim->busy_result[flog_sim_chip(sim->cache_page)] = FLOG_FAILURE;
+		return;
+	}
+	flog_sim_program_start(flog_sim_chip(sim->cache_page), 1, 0);
+}
+
+void flog_sim_commit_cache(){
+	flog_sim_check_register(sim->cache_block, sim->cache_page);
+	flog_sim_end_read_ahead();
+	if(!sim->cache_valid){
+		sim->busy_result[flog_sim_chip(sim->cache_page)] = FLOG_FAILURE;
+		return;
+	}
+	flog_sim_program_start(flog_sim_chip(sim->cache_page), 1, 1);
+}
+
+void flog_sim_commit_plane(){
+#if FS_PLANES > 1
+	uint_fast8_t const chip = flog_sim_chip(sim->cache_page);
+	uint_fast8_t n;
+
+	flog_sim_check_register(sim->cache_block, sim->cache_page);
+	flog_sim_end_read_ahead();
+	n = sim->queue[chip].n;
+	if(!sim->cache_valid){
+		sim->busy_result[chip] = FLOG_FAILURE;
+		return;
+	}
+	if((sim->cache_page % FS_PLANES != n) || (n == FS_PLANES - 1)){
+		// Only a page for the next plane can be held, so this goes now
+		flog_sim_program_start(chip, 1, 1);
+		return;
+	}
+	sim->queue[chip].block = sim->cache_block;
+	sim->queue[chip].page[n] = sim->cache_page;
+	memcpy(sim->queue[chip].data[n], sim->cache, FLOG_SIM_PAGE_SIZE);
+	sim->queue[chip].n += 1;
+	sim->stats.time += sim->timing.t_cmd;
+#else
+	flog_sim_commit_start();
+#endif
+}
+
+flog_result_t flog_sim_erase_block(uint16_t block){
+	// The block is erased on every chip at once
+	flog_sim_check_all_idle();
+	flog_sim_end_read_ahead();
+	if(block >= FS_NUM_BLOCKS){
+		return FLOG_FAILURE;
+	}
+	sim->stats.erases += 1;
+	sim->stats.time += sim->timing.t_cmd + sim->timing.t_erase;
+
+	if(sim->bad[block]){
+		sim->stats.bad_block_accesses += 1;
+		return FLOG_FAILURE;
+	}
+
+	free(sim->blocks[block]);
+	sim->blocks[block] = NULL;
+	memset(&sim->nop[block * FS_PAGES_PER_BLOCK], 0, FS_PAGES_PER_BLOCK);
+	return FLOG_SUCCESS;
+}
+
+void flog_sim_ecc_result(flog_flash_read_result_t result){
+	if(result == FLOG_FLASH_ERR_CORRECT){
+		sim->stats.ecc_corrected += 1;
+	} else if(result == FLOG_FLASH_ERR_DETECT){
+		sim->stats.ecc_failed += 1;
+	}
+}
+
+//! @} // FLogSim